@@ -0,0 +1,334 @@
+/**
+ * Raw2Raw
+ * core/accumulate.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the incremental stack accumulator.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "accumulate.h"
+#include "stream.h"
+#include "progress.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <stdexcept>
+
+namespace {
+constexpr char kAccumulatorMagic[4] = {'R', '2', 'R', 'A'};
+constexpr r2r::u32 kAccumulatorVersion = 3;     // 2: 32 bit counts of the extremes, 3: 32 bit histograms, fingerprint
+constexpr r2r::u8 kStaleMin = 1, kStaleMax = 2;
+
+template<typename T>
+void write_vec(std::ofstream &out, const std::vector<T> &v)
+{
+    r2r::u64 n = v.size();
+    out.write(reinterpret_cast<const char *>(&n), sizeof(n));
+    out.write(reinterpret_cast<const char *>(v.data()), (std::streamsize)(n * sizeof(T)));
+}
+
+template<typename T>
+void read_vec(std::ifstream &in, std::vector<T> &v)
+{
+    r2r::u64 n = 0;
+    in.read(reinterpret_cast<char *>(&n), sizeof(n));
+    v.resize(in ? n : 0);
+    in.read(reinterpret_cast<char *>(v.data()), (std::streamsize)(v.size() * sizeof(T)));
+}
+} // anonymous namespace
+
+namespace r2r {
+
+Accumulator::Accumulator(size_t width, size_t height, u32 max_val, const AccumulatorOptions &options)
+    : width(width), height(height), wh(width * height), max_val(max_val), options(options)
+{
+    sum.assign(wh, 0);
+    if (options.moments) {
+        sum2.assign(wh, 0);
+    }
+    if (options.minmax) {
+        min.assign(wh, 0xffff);
+        max.assign(wh, 0);
+        min_count.assign(wh, 0);
+        max_count.assign(wh, 0);
+        stale.assign(wh, 0);
+    }
+    if (options.histogram_bins) {
+        bin_width = (max_val + options.histogram_bins) / options.histogram_bins;
+        hist.assign(wh * options.histogram_bins, 0);
+    }
+}
+
+void Accumulator::add_frame(const io_t *frame)
+{
+    const u32 bins = options.histogram_bins, bw = bin_width;
+    #pragma omp parallel for default(none) shared(frame, bins, bw) schedule(static)
+    for (size_t i = 0; i < wh; i++) {
+        const io_t v = frame[i];
+        sum[i] += v;
+        if (!sum2.empty()) {
+            sum2[i] += (u64)v * v;
+        }
+        if (!min.empty()) {
+            if (v < min[i]) {
+                min[i] = v;
+                min_count[i] = 1;
+                stale[i] &= ~kStaleMin;
+            } else if (v == min[i]) {
+                min_count[i]++;
+            }
+            if (v > max[i]) {
+                max[i] = v;
+                max_count[i] = 1;
+                stale[i] &= ~kStaleMax;
+            } else if (v == max[i]) {
+                max_count[i]++;
+            }
+        }
+        if (bins) {
+            hist[i * bins + std::min<u32>(v / bw, bins - 1)]++;
+        }
+    }
+    n_frames++;
+}
+
+size_t Accumulator::remove_frame(const io_t *frame)
+{
+    const u32 bins = options.histogram_bins, bw = bin_width;
+    size_t became_stale = 0;
+    #pragma omp parallel for default(none) shared(frame, bins, bw) reduction(+:became_stale) schedule(static)
+    for (size_t i = 0; i < wh; i++) {
+        const io_t v = frame[i];
+        sum[i] -= v;
+        if (!sum2.empty()) {
+            sum2[i] -= (u64)v * v;
+        }
+        if (bins) {
+            hist[i * bins + std::min<u32>(v / bw, bins - 1)]--;
+        }
+        if (!min.empty()) {
+            const u32 *h = bins ? hist.data() + i * bins : nullptr;
+            // the old extreme stays as a bound, unless the histogram gives a tighter one
+            if (v == min[i] && min_count[i] && --min_count[i] == 0) {
+                became_stale += !(stale[i] & kStaleMin);
+                stale[i] |= kStaleMin;
+                for (u32 b = 0; h && b < bins; b++) {
+                    if (h[b]) { min[i] = (io_t)std::max<u32>(min[i], b * bw); break; }
+                }
+            }
+            if (v == max[i] && max_count[i] && --max_count[i] == 0) {
+                became_stale += !(stale[i] & kStaleMax);
+                stale[i] |= kStaleMax;
+                for (u32 b = bins; h && b-- > 0;) {
+                    if (h[b]) { max[i] = (io_t)std::min<u32>(max[i], (b + 1) * bw - 1); break; }
+                }
+            }
+        }
+    }
+    n_frames--;
+    return became_stale;
+}
+
+void Accumulator::sync(const std::vector<std::filesystem::path> &files, const TaskOptions &task_options)
+{
+    std::set<std::filesystem::path> wanted(files.begin(), files.end()), have(sources.begin(), sources.end());
+    std::vector<std::filesystem::path> to_add, to_remove;
+    for (const auto &f : files) {
+        if (!have.count(f)) to_add.push_back(f);
+    }
+    for (const auto &f : sources) {
+        if (!wanted.count(f)) to_remove.push_back(f);
+    }
+
+    const u64 key = decode_fingerprint(task_options);
+    if (n_frames && key != fingerprint) {
+        throw std::invalid_argument("the frames of the state were read with another calibration or defect map");
+    }
+
+    Progress *progress = task_options.progress;
+    if (progress) progress->begin(Stage::INGEST, to_remove.size() + to_add.size());
+    // the files that are accumulated so far, so that a failed or cancelled sync leaves a consistent state for the next
+    std::set<std::filesystem::path> current = have;
+    try {
+        if (!to_remove.empty()) {
+            FrameStream stream(to_remove, task_options);
+            while (const io_t *frame = stream.next()) {
+                remove_frame(frame);
+                current.erase(to_remove[stream.index()]);
+                advance(progress, 1);
+                if (cancelled(progress)) throw ParserErrors::CANCELLED;
+            }
+        }
+        if (!to_add.empty()) {
+            FrameStream stream(to_add, task_options);
+            if (wh == 0 || n_frames == 0) {
+                *this = Accumulator(stream.width, stream.height, stream.max_val, options);
+            } else if (stream.wh != wh) {
+                throw ParserErrors::SIZE_MISMATCH;
+            }
+            fingerprint = key;
+            while (const io_t *frame = stream.next()) {
+                add_frame(frame);
+                current.insert(to_add[stream.index()]);
+                advance(progress, 1);
+                if (cancelled(progress)) throw ParserErrors::CANCELLED;
+            }
+        }
+    } catch (...) {
+        sources.clear();
+        for (const auto &f : files) {
+            if (current.count(f)) sources.push_back(f);
+        }
+        for (const auto &f : to_remove) {
+            if (current.count(f)) sources.push_back(f);
+        }
+        throw;
+    }
+    sources = files;
+}
+
+Buffer<io_t> Accumulator::finalize(pReduction reduction) const
+{
+    const bool needs_minmax = reduction == pReduction::MAXIMUM || reduction == pReduction::MINIMUM ||
+                              reduction == pReduction::RANGE;
+    const bool needs_moments = reduction == pReduction::VARIANCE || reduction == pReduction::STANDARD_DEVIATION;
+    // the rank based reductions other than the median need every sample
+    const bool supported = reduction == pReduction::MEAN || reduction == pReduction::SUMMATION ||
+                           reduction == pReduction::MEDIAN || needs_minmax || needs_moments;
+    if (!supported || n_frames == 0 || (needs_minmax && min.empty()) ||
+        (needs_moments && (sum2.empty() || n_frames < 2)) || (reduction == pReduction::MEDIAN && hist.empty()))
+    {
+        return {};
+    }
+
+    const size_t n = n_frames;
+    const u32 bins = options.histogram_bins, bw = bin_width;
+    Buffer<io_t> out(wh);
+    io_t *ans = out.get();
+    #pragma omp parallel for default(none) shared(ans, reduction, n, bins, bw) schedule(static)
+    for (size_t i = 0; i < wh; i++) {
+        switch (reduction) {
+            case pReduction::MEAN:
+                ans[i] = sum[i] / n;
+                break;
+            case pReduction::SUMMATION:
+                ans[i] = std::min(sum[i], max_val);
+                break;
+            case pReduction::MAXIMUM:
+                ans[i] = max[i];
+                break;
+            case pReduction::MINIMUM:
+                ans[i] = min[i];
+                break;
+            case pReduction::RANGE:
+                ans[i] = max[i] - min[i];
+                break;
+            case pReduction::VARIANCE:
+            case pReduction::STANDARD_DEVIATION: {
+                double var = ((double)sum2[i] - (double)sum[i] * sum[i] / n) / (n - 1);
+                if (reduction == pReduction::STANDARD_DEVIATION) var = std::sqrt(std::max(var, 0.0));
+                ans[i] = (io_t)std::clamp(var, 0.0, (double)max_val);
+                break;
+            }
+            case pReduction::MEDIAN: {
+                // interpolate linearly inside the bin that contains the middle sample
+                const u32 *h = hist.data() + i * bins;
+                double target = n / 2.0, cum = 0;
+                u32 b = 0;
+                while (b < bins - 1 && cum + h[b] <= target) cum += h[b++];
+                double frac = h[b] ? (target - cum) / h[b] : 0.5;
+                ans[i] = (io_t)std::min<double>(max_val, (b + frac) * bw);
+                break;
+            }
+            default:
+                ans[i] = 0;
+        }
+    }
+    return out;
+}
+
+size_t Accumulator::inexact() const
+{
+    return stale.size() - std::count(stale.begin(), stale.end(), 0);
+}
+
+ParserErrors Accumulator::save(const std::filesystem::path &file) const
+{
+    std::ofstream out(file, std::ios::binary);
+    if (!out.is_open()) {
+        return ParserErrors::CANNOT_OPEN_FILE;
+    }
+    u64 header[6] = {n_frames, width, height, max_val, bin_width, fingerprint};
+    u32 opts[3] = {options.minmax, options.moments, options.histogram_bins};
+    out.write(kAccumulatorMagic, sizeof(kAccumulatorMagic));
+    out.write(reinterpret_cast<const char *>(&kAccumulatorVersion), sizeof(kAccumulatorVersion));
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(opts), sizeof(opts));
+    u64 n_sources = sources.size();
+    out.write(reinterpret_cast<const char *>(&n_sources), sizeof(n_sources));
+    for (const auto &src : sources) {
+        std::string s = src.string();
+        write_vec(out, std::vector<char>(s.begin(), s.end()));
+    }
+    write_vec(out, sum);
+    write_vec(out, sum2);
+    write_vec(out, min);
+    write_vec(out, max);
+    write_vec(out, min_count);
+    write_vec(out, max_count);
+    write_vec(out, stale);
+    write_vec(out, hist);
+    return out.good() ? ParserErrors::PARSE_SUCCESS : ParserErrors::CANNOT_OPEN_FILE;
+}
+
+ParserErrors Accumulator::load(const std::filesystem::path &file)
+{
+    std::ifstream in(file, std::ios::binary);
+    if (!in.is_open()) {
+        return ParserErrors::CANNOT_OPEN_FILE;
+    }
+    char magic[4];
+    u32 version;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char *>(&version), sizeof(version));
+    if (!in || memcmp(magic, kAccumulatorMagic, sizeof(magic)) != 0 || version != kAccumulatorVersion) {
+        return ParserErrors::CANNOT_UNPACK_FILE;
+    }
+    u64 header[6];
+    u32 opts[3];
+    in.read(reinterpret_cast<char *>(header), sizeof(header));
+    in.read(reinterpret_cast<char *>(opts), sizeof(opts));
+    n_frames = header[0];
+    width = header[1];
+    height = header[2];
+    wh = width * height;
+    max_val = (u32)header[3];
+    bin_width = (u32)header[4];
+    fingerprint = header[5];
+    options = {opts[0] != 0, opts[1] != 0, opts[2]};
+
+    u64 n_sources = 0;
+    in.read(reinterpret_cast<char *>(&n_sources), sizeof(n_sources));
+    sources.clear();
+    for (u64 k = 0; in && k < n_sources; k++) {
+        std::vector<char> s;
+        read_vec(in, s);
+        sources.emplace_back(std::string(s.begin(), s.end()));
+    }
+    read_vec(in, sum);
+    read_vec(in, sum2);
+    read_vec(in, min);
+    read_vec(in, max);
+    read_vec(in, min_count);
+    read_vec(in, max_count);
+    read_vec(in, stale);
+    read_vec(in, hist);
+    return in && sum.size() == wh ? ParserErrors::PARSE_SUCCESS : ParserErrors::SIZE_MISMATCH;
+}
+
+} // namespace r2r
@@ -0,0 +1,77 @@
+/**
+ * Raw2Raw
+ * core/accumulate.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of the Accumulator class, a persistent state for the reductions that can be
+ * computed one frame at a time (sum, mean, min, max, range, variance and histograms). Frames can be added to or removed
+ * from an accumulator at the cost of one frame, instead of reloading the whole stack into a Task, and the state can be
+ * saved to disk so that a stack can keep growing across sessions.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+
+namespace r2r {
+
+struct AccumulatorOptions {
+    bool minmax {true};             // minimum, maximum and range
+    bool moments {true};            // variance and standard deviation
+    u32 histogram_bins {0};         // per-pixel histograms for the median, 0 to disable (each bin costs 4 bytes/pixel)
+};
+
+class Accumulator {
+public:
+    Accumulator() = default;
+    /* An empty accumulator with the given statistics, which is sized by the first frame that sync adds */
+    explicit Accumulator(const AccumulatorOptions &options) : options(options) {}
+    Accumulator(size_t width, size_t height, u32 max_val, const AccumulatorOptions &options = {});
+
+    void add_frame(const io_t *frame);
+
+    /* Remove a frame that was previously added. The minimum and maximum cannot always be recovered exactly when the
+     * extreme sample of a pixel is removed; those pixels keep their old extreme (or the edge of the histogram bin, if
+     * histograms are enabled) and are counted by inexact(). Returns the number of pixels that became inexact.
+     */
+    size_t remove_frame(const io_t *frame);
+
+    /* Make the accumulated frames match a list of files, by decoding only the files that were added or removed since
+     * the last call. Only the calibration, the known defects and the progress context of the options are used, and the
+     * calibration and defects must be the same as when the frames were added (see decode_fingerprint), since a removed
+     * frame is decoded again to subtract it; std::invalid_argument is thrown otherwise.
+     *
+     * Throws a ParserErrors if a file cannot be read (e.g. a removed file that was deleted, in which case the state has
+     * to be rebuilt), or ParserErrors::CANCELLED between two frames. Either way, the frames decoded so far stay
+     * accumulated, and sources lists exactly those.
+     */
+    void sync(const std::vector<std::filesystem::path> &files, const TaskOptions &options = {});
+
+    /* Compute a reduction from the accumulated state. Returns an empty buffer if the reduction is not supported by the
+     * enabled statistics (MEDIAN needs histograms, and is accurate to the width of a bin).
+     */
+    Buffer<io_t> finalize(pReduction reduction) const;
+
+    ParserErrors save(const std::filesystem::path &file) const;
+    ParserErrors load(const std::filesystem::path &file);
+
+    size_t inexact() const;
+    size_t n_frames {0};
+    size_t width {0}, height {0}, wh {0};
+    u32 max_val {0};
+    std::vector<std::filesystem::path> sources;     // the files added by sync
+
+private:
+    AccumulatorOptions options;
+    u32 bin_width {1};
+    u64 fingerprint {0};                            // decode_fingerprint of the options the frames were read with
+    std::vector<u32> sum;
+    std::vector<u64> sum2;
+    std::vector<io_t> min, max;
+    std::vector<u32> min_count, max_count;          // number of frames at the extreme, so removals can be tracked
+    std::vector<u8> stale;                          // pixels whose extremes are no longer exact
+    std::vector<u32> hist;                          // pixel-major, histogram_bins per pixel
+};
+
+} // namespace r2r
@@ -0,0 +1,197 @@
+/**
+ * Raw2Raw
+ * core/analysis.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the noise and sensor statistics of a stack.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "analysis.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+constexpr size_t kResidualBins = 8192;      // of twice the residual, larger residuals go to the last bin
+constexpr size_t kPtcBins = 64;             // four per stop of signal
+constexpr size_t kPtcMinPixels = 16;        // fewer pixels are not used for the fit
+
+/* What each thread accumulates, merged at the end of the pass */
+struct Partial {
+    double sum[4] {}, masked_sum[4] {}, var_sum[4] {};
+    r2r::u64 count[4] {}, masked_count[4] {}, var_count[4] {}, clipped[4] {};
+    std::vector<r2r::u32> residuals = std::vector<r2r::u32>(4 * kResidualBins, 0);
+    double ptc_signal[kPtcBins] {}, ptc_variance[kPtcBins] {};
+    r2r::u64 ptc_pixels[kPtcBins] {};
+
+    void merge(const Partial &o)
+    {
+        for (int p = 0; p < 4; p++) {
+            sum[p] += o.sum[p];
+            masked_sum[p] += o.masked_sum[p];
+            var_sum[p] += o.var_sum[p];
+            count[p] += o.count[p];
+            masked_count[p] += o.masked_count[p];
+            var_count[p] += o.var_count[p];
+            clipped[p] += o.clipped[p];
+        }
+        for (size_t b = 0; b < residuals.size(); b++) residuals[b] += o.residuals[b];
+        for (size_t b = 0; b < kPtcBins; b++) {
+            ptc_signal[b] += o.ptc_signal[b];
+            ptc_variance[b] += o.ptc_variance[b];
+            ptc_pixels[b] += o.ptc_pixels[b];
+        }
+    }
+};
+
+/* The median of a histogram, in bins */
+double histogram_median(const r2r::u32 *hist, size_t bins)
+{
+    r2r::u64 total = 0, seen = 0;
+    for (size_t b = 0; b < bins; b++) total += hist[b];
+    if (total == 0) {
+        return NAN;
+    }
+    for (size_t b = 0; b < bins; b++) {
+        seen += hist[b];
+        if (2 * seen >= total) return (double)b;
+    }
+    return (double)(bins - 1);
+}
+} // anonymous namespace
+
+namespace r2r {
+
+NoiseStats analyze(const Task &task)
+{
+    const RawInfo &info = task.infos[0];
+    const bool planar = task.layout == Layout::CFA_PLANES;
+    // the rows of the task in its layout: in the planar layout, the four planes are stacked into an image of half the
+    // width, and the same-color neighbor of a sample is the next one instead of the one after
+    const size_t W = planar ? task.width / 2 : task.width, R = task.wh / W, step = planar ? 1 : 2;
+    const size_t plane_rows = task.height / 2, n = task.n_images;
+    const size_t x0 = info.left_margin, x1 = x0 + info.visible_width;
+    const size_t y0 = info.top_margin, y1 = y0 + info.visible_height;
+    const io_t white = (io_t)std::min<u32>(task.max_val, 0xffff);
+
+    Partial total;
+    #pragma omp parallel default(none) shared(task, info, total, planar, W, R, step, plane_rows, n, x0, x1, y0, y1, white)
+    {
+        Partial part;
+        std::vector<u32> sum(W);
+        std::vector<u64> sum2(W);
+        std::vector<u8> clip(W);
+        #pragma omp for schedule(static)
+        for (size_t r = 0; r < R; r++) {
+            // the raw coordinates of the row, and of the first column
+            const size_t p_row = planar ? r / plane_rows : 0;
+            const size_t y = planar ? 2 * (r % plane_rows) + (p_row >> 1) : r, xs = planar ? (p_row & 1) : 0;
+            const size_t dx = planar ? 2 : 1;
+            const bool visible_row = y >= y0 && y < y1;
+            std::fill(sum.begin(), sum.end(), 0);
+            std::fill(sum2.begin(), sum2.end(), 0);
+            std::fill(clip.begin(), clip.end(), 0);
+
+            for (size_t j = 0; j < n; j++) {
+                const io_t *row = task.data + j * task.wh + r * W;
+                #pragma omp simd
+                for (size_t c = 0; c < W; c++) {
+                    sum[c] += row[c];
+                    sum2[c] += (u64)row[c] * row[c];
+                    clip[c] |= row[c] >= white;
+                }
+                if (!visible_row) continue;
+                for (size_t c = step; c + step < W; c++) {
+                    const size_t x = xs + c * dx;
+                    if (x < x0 || x >= x1 || clip[c]) continue;
+                    const io_t a = row[c - step], b = row[c + step];
+                    if (a >= white || b >= white) continue;
+                    const int p = (int)((y & 1) * 2 + (x & 1));
+                    const u32 d = (u32)std::abs(2 * (int)row[c] - (int)a - (int)b);
+                    part.residuals[p * kResidualBins + std::min<size_t>(d, kResidualBins - 1)]++;
+                }
+            }
+
+            for (size_t c = 0; c < W; c++) {
+                const size_t x = xs + c * dx;
+                const int p = (int)((y & 1) * 2 + (x & 1));
+                if (!visible_row || x < x0 || x >= x1) {
+                    part.masked_sum[p] += sum[c];
+                    part.masked_count[p] += n;
+                    continue;
+                }
+                part.sum[p] += sum[c];
+                part.count[p] += n;
+                if (clip[c]) {
+                    // only the frames that clip are counted, the others are still valid samples of the pixel
+                    const io_t *px = task.data + r * W + c;
+                    for (size_t j = 0; j < n; j++) part.clipped[p] += px[j * task.wh] >= white;
+                    continue;
+                }
+                if (n < 2) continue;
+                const double mean = (double)sum[c] / n;
+                const double var = std::max(((double)sum2[c] - mean * sum[c]) / (n - 1), 0.);
+                part.var_sum[p] += var;
+                part.var_count[p]++;
+                const double signal = mean - info.black[p];
+                if (signal > 0) {
+                    const size_t b = std::min<size_t>((size_t)(4 * std::log2(1 + signal)), kPtcBins - 1);
+                    part.ptc_signal[b] += signal;
+                    part.ptc_variance[b] += var;
+                    part.ptc_pixels[b]++;
+                }
+            }
+        }
+        #pragma omp critical
+        total.merge(part);
+    }
+
+    NoiseStats stats;
+    stats.n_frames = n;
+    for (int p = 0; p < 4; p++) {
+        ChannelStats &ch = stats.channels[p];
+        ch.mean = total.count[p] ? total.sum[p] / total.count[p] - info.black[p] : NAN;
+        ch.temporal_sigma = total.var_count[p] ? std::sqrt(total.var_sum[p] / total.var_count[p]) : NAN;
+        // 2v - a - b has 6 times the variance of a sample, and the MAD of a normal distribution is 0.6745 sigma
+        ch.spatial_sigma = histogram_median(total.residuals.data() + p * kResidualBins, kResidualBins) /
+                           (0.6745 * std::sqrt(6.));
+        ch.black = total.masked_count[p] ? total.masked_sum[p] / total.masked_count[p] : NAN;
+        ch.clipped = total.count[p] ? (double)total.clipped[p] / total.count[p] : NAN;
+    }
+
+    // least squares fit of variance = gain * signal + read^2, weighted by the pixels of each point
+    double sw = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (size_t b = 0; b < kPtcBins; b++) {
+        if (total.ptc_pixels[b] < kPtcMinPixels) continue;
+        const double w = (double)total.ptc_pixels[b];
+        const double s = total.ptc_signal[b] / w, v = total.ptc_variance[b] / w;
+        stats.ptc.push_back({s, v, (size_t)total.ptc_pixels[b]});
+        sw += w;
+        sx += w * s;
+        sy += w * v;
+        sxx += w * s * s;
+        sxy += w * s * v;
+    }
+    const double det = sw * sxx - sx * sx;
+    if (stats.ptc.size() >= 2 && det > 0) {
+        stats.conversion_gain = (sw * sxy - sx * sy) / det;
+        stats.read_noise = std::sqrt(std::max((sy - stats.conversion_gain * sx) / sw, 0.));
+    } else {
+        stats.conversion_gain = stats.read_noise = NAN;
+    }
+    return stats;
+}
+
+std::vector<double> noise(const Task &task)
+{
+    NoiseStats stats = analyze(task);
+    std::vector<double> sigma(4);
+    for (int p = 0; p < 4; p++) {
+        sigma[p] = stats.channels[p].temporal_sigma;
+    }
+    return sigma;
+}
+
+} // namespace r2r
@@ -0,0 +1,51 @@
+/**
+ * Raw2Raw
+ * core/analysis.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definitions of the whole-image analysis of a stack: the noise and the black level of each CFA
+ * channel, how much of it is clipped, and the photon transfer curve (the temporal variance of a pixel against its
+ * signal), from which the conversion gain and the read noise of the sensor follow. Everything comes from one tiled pass
+ * over the task, so it is cheap enough to run before choosing how to reduce the stack.
+ *
+ * The temporal noise is the spread of each pixel across the frames, so it includes anything that moves. The spatial
+ * noise is estimated within each frame from the median absolute deviation of a high-pass residual (each sample minus
+ * the mean of its same-color neighbors on the row), which ignores most of the scene.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+
+namespace r2r {
+
+/* Statistics of one CFA position (see core/cfa.h), over the visible area unless stated otherwise */
+struct ChannelStats {
+    double mean;                    // DN above the black level of the metadata
+    double temporal_sigma;          // RMS of the standard deviation of each pixel across the frames, NaN for one frame
+    double spatial_sigma;           // from the MAD of the high-pass residual of each frame
+    double black;                   // mean of the masked area, NaN if the raw has no masked area
+    double clipped;                 // fraction of the samples at the white level
+};
+
+/* A point of the photon transfer curve: the mean temporal variance of the pixels with about this signal */
+struct PtcPoint {
+    double signal;                  // DN above the black level
+    double variance;                // DN^2
+    size_t pixels;
+};
+
+struct NoiseStats {
+    size_t n_frames;
+    ChannelStats channels[4];
+    std::vector<PtcPoint> ptc;      // in order of signal, without the pixels that clip in any frame
+    // variance = conversion_gain * signal + read_noise^2, fit to the photon transfer curve. NaN for one frame.
+    double conversion_gain;         // DN per electron
+    double read_noise;              // DN
+};
+
+/* Analyze a task in either layout in a single pass */
+NoiseStats analyze(const Task &task);
+
+} // namespace r2r
@@ -0,0 +1,242 @@
+/**
+ * Raw2Raw
+ * core/batch.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the batch scheduler.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "batch.h"
+#include "progress.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <omp.h>
+
+namespace {
+/* Bytes of the jobs in flight. A job waits until it fits the budget, or until nothing else is in flight. */
+class Budget {
+public:
+    explicit Budget(size_t limit) : limit(limit) {}
+
+    void acquire(size_t bytes)
+    {
+        std::unique_lock lock(m);
+        cv.wait(lock, [&] { return used == 0 || used + bytes <= limit; });
+        used += bytes;
+    }
+
+    void release(size_t bytes)
+    {
+        {
+            std::lock_guard lock(m);
+            used -= bytes;
+        }
+        cv.notify_all();
+    }
+
+private:
+    std::mutex m;
+    std::condition_variable cv;
+    size_t limit, used {0};
+};
+
+/* A queue between two stages, closed by the producers once they are done */
+template<typename T>
+class Channel {
+public:
+    explicit Channel(size_t producers) : producers(producers) {}
+
+    void push(T &&item)
+    {
+        {
+            std::lock_guard lock(m);
+            items.push_back(std::move(item));
+        }
+        cv.notify_one();
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard lock(m);
+            producers--;
+        }
+        cv.notify_all();
+    }
+
+    /* Returns false once every producer closed the channel and it is empty */
+    bool pop(T &item)
+    {
+        std::unique_lock lock(m);
+        cv.wait(lock, [&] { return !items.empty() || producers == 0; });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        return true;
+    }
+
+private:
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<T> items;
+    size_t producers;
+};
+
+/* The status of a job that threw. Called from a catch block. */
+r2r::ParserErrors job_error()
+{
+    try {
+        throw;
+    } catch (r2r::ParserErrors e) {
+        return e;
+    } catch (const std::bad_alloc &) {
+        return r2r::ParserErrors::OUT_OF_MEMORY;
+    } catch (...) {
+        return r2r::ParserErrors::UNEXPECTED_ERROR;
+    }
+}
+
+struct Decoded {
+    size_t job;
+    size_t bytes;
+    std::unique_ptr<r2r::Task> task;
+};
+
+struct Reduced {
+    size_t job;
+    size_t bytes;
+    std::unique_ptr<r2r::Task> task;        // kept for the reference data of the output
+    r2r::Buffer<r2r::io_t> ans;
+};
+} // anonymous namespace
+
+namespace r2r {
+
+std::vector<ParserErrors> run_batch(const std::vector<BatchJob> &jobs, const BatchParams &params, Progress *progress)
+{
+    std::vector<ParserErrors> status(jobs.size(), ParserErrors::PARSE_SUCCESS);
+    for (const BatchJob &job : jobs) {
+        if (job.reduction == pReduction::NONE || job.reduction == pReduction::SKEWNESS ||
+            job.reduction == pReduction::KURTOSIS || job.reduction == pReduction::ENTROPY) {
+            throw std::invalid_argument("run_batch: the reduction of a job is not implemented");
+        }
+    }
+    if (jobs.empty()) {
+        return status;
+    }
+    if (progress) progress->begin(Stage::BATCH, jobs.size());
+
+    // one thread for the writer, which only copies and writes, and half of the others for the decoders
+    const size_t threads = std::max(omp_get_max_threads(), 1);
+    const size_t decoding = std::max<size_t>((threads - 1) / 2, 1);
+    size_t decoders = params.decoders;
+    if (decoders == 0) {
+        // the frames of a job are decoded in parallel, so a decoder with more threads than frames leaves them idle
+        size_t frames = 0;
+        for (const BatchJob &job : jobs) frames += job.files.size();
+        decoders = std::clamp<size_t>(decoding * jobs.size() / std::max<size_t>(frames, 1), 1, decoding);
+    }
+    decoders = std::min(decoders, jobs.size());
+    const int decoder_threads = (int)std::max<size_t>(decoding / decoders, 1);
+    // the reducer gets the threads that are left, which is never fewer than one even if the decoders were asked for
+    // more than there are
+    const int reducer_threads = (int)std::max<long>((long)threads - 1 - (long)decoders * decoder_threads, 1);
+
+    TaskOptions options = params.options;
+    options.progress = nullptr;
+    Budget budget(params.memory_budget);
+    Channel<Decoded> decoded(decoders);
+    Channel<Reduced> reduced(1);
+    std::atomic<size_t> next {0};
+
+    std::mutex done_mutex;
+    auto finish = [&](size_t job, ParserErrors e) {
+        std::lock_guard lock(done_mutex);
+        status[job] = e;
+        if (params.on_done) params.on_done(job, e);
+        advance(progress, 1);
+    };
+
+    auto decode = [&] {
+        omp_set_num_threads(decoder_threads);
+        for (size_t k; (k = next.fetch_add(1)) < jobs.size();) {
+            const BatchJob &job = jobs[k];
+            size_t width, height;
+            u32 max_val;
+            if (cancelled(progress)) {
+                finish(k, ParserErrors::CANCELLED);
+                continue;
+            }
+            if (job.files.empty() ||
+                get_dimensions(job.files[0].string().c_str(), width, height, max_val) != ParserErrors::PARSE_SUCCESS) {
+                finish(k, ParserErrors::CANNOT_OPEN_FILE);
+                continue;
+            }
+            // the frames, and the output with the copy that interleaves it
+            const size_t bytes = width * height * sizeof(io_t) * (job.files.size() + 2);
+            budget.acquire(bytes);
+            try {
+                decoded.push({k, bytes, std::make_unique<Task>(job.files, options)});
+            } catch (...) {
+                budget.release(bytes);
+                finish(k, job_error());
+            }
+        }
+        decoded.close();
+    };
+
+    auto reduce = [&] {
+        omp_set_num_threads(reducer_threads);
+        Decoded d;
+        while (decoded.pop(d)) {
+            try {
+                Buffer<io_t> ans = p_reduce(*d.task, jobs[d.job].reduction, jobs[d.job].params);
+                reduced.push({d.job, d.bytes, std::move(d.task), std::move(ans)});
+            } catch (...) {
+                d.task.reset();
+                budget.release(d.bytes);
+                finish(d.job, job_error());
+            }
+        }
+        reduced.close();
+    };
+
+    auto write = [&] {
+        omp_set_num_threads(1);
+        Reduced r;
+        while (reduced.pop(r)) {
+            const BatchJob &job = jobs[r.job];
+            ParserErrors e;
+            try {
+                e = write_image(job.files[0], job.output, r.ans.get(), r.task->reference, r.task->width,
+                                r.task->height);
+            } catch (...) {
+                e = job_error();
+            }
+            r.ans = {};
+            r.task.reset();
+            budget.release(r.bytes);
+            finish(r.job, e);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < decoders; i++) workers.emplace_back(decode);
+    workers.emplace_back(reduce);
+    workers.emplace_back(write);
+    for (auto &w : workers) w.join();
+    return status;
+}
+
+} // namespace r2r
@@ -0,0 +1,49 @@
+/**
+ * Raw2Raw
+ * core/batch.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definitions of the batch scheduler, which runs many small stacks (brackets of a few frames,
+ * each reduced to its own output) as a pipeline instead of one Task after another. While one thread reduces job k, the
+ * decoders already read the jobs after it and another thread writes the output of job k - 1, so the cores are not left
+ * idle in the tail of each small task.
+ *
+ * The stages share the OpenMP threads: the writer takes one, the decoders half of the others (each decoder a share of
+ * them, since reading a bracket of a few frames cannot use more), and the reducer what is left. The jobs whose frames
+ * are in memory (decoded, or waiting to be reduced or written) are limited by a memory budget, so a batch of any length
+ * runs in a bounded amount of memory.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+#include <functional>
+
+namespace r2r {
+
+struct BatchJob {
+    std::vector<std::filesystem::path> files;
+    pReduction reduction {pReduction::MEAN};
+    ReductionParams params;
+    std::filesystem::path output;               // written with write_image, the first file is the reference
+};
+
+struct BatchParams {
+    TaskOptions options;                        // of the task of every job, without the progress context
+    size_t memory_budget {size_t(4) << 30};     // bytes of the frames and outputs in flight, a larger job runs alone
+    size_t decoders {0};                        // jobs decoded at once, 0 to share the threads by the size of the jobs
+    // called when a job is done, in no particular order, from the threads of the batch but never concurrently
+    std::function<void(size_t job, ParserErrors status)> on_done;
+};
+
+/* Run a batch of jobs, and return the status of each. The progress context counts the jobs that are done, and a
+ * cancelled batch finishes the jobs that are already decoded, and returns ParserErrors::CANCELLED for the others.
+ * A job that throws is given the ParserErrors it throws, OUT_OF_MEMORY for std::bad_alloc, or UNEXPECTED_ERROR for
+ * anything else, and the other jobs still run. Throws std::invalid_argument if the reduction of a job is not
+ * implemented by p_reduce.
+ */
+std::vector<ParserErrors> run_batch(const std::vector<BatchJob> &jobs, const BatchParams &params = {},
+                                    Progress *progress = nullptr);
+
+} // namespace r2r
@@ -0,0 +1,134 @@
+/**
+ * Raw2Raw
+ * core/buffer.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the pooled allocator of the frames and outputs.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "buffer.h"
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace {
+constexpr size_t kHugePage = size_t(2) << 20;
+
+/* Every block starts with a header of one alignment, which keeps the size that the block was made for */
+struct Header {
+    size_t bytes;       // of the block, including the header
+    bool pooled;        // whether it goes back into the pool
+};
+static_assert(sizeof(Header) <= r2r::kBufferAlignment);
+
+size_t round_up(size_t x, size_t to)
+{
+    return (x + to - 1) / to * to;
+}
+
+struct Pool {
+    std::mutex m;
+    std::unordered_map<size_t, std::vector<Header *>> free;     // by the size of the block
+    size_t cached {0}, limit {size_t(2) << 30};
+
+    /* Give blocks back to the system until the pool is within its limit. Called with the lock held. */
+    void shrink()
+    {
+        for (auto it = free.begin(); cached > limit && it != free.end(); ++it) {
+            while (cached > limit && !it->second.empty()) {
+                cached -= it->first;
+                std::free(it->second.back());
+                it->second.pop_back();
+            }
+        }
+    }
+};
+
+/* Never destroyed, since a task may be freed after the static objects are */
+Pool &pool()
+{
+    static Pool *p = new Pool;
+    return *p;
+}
+} // anonymous namespace
+
+namespace r2r {
+
+void *buffer_alloc(size_t bytes, bool pooled)
+{
+    // the large blocks are whole huge pages, so that blocks of about the same size are also the same size here
+    const bool huge = bytes + kBufferAlignment >= kHugePage;
+    const size_t align = huge ? kHugePage : kBufferAlignment;
+    const size_t total = round_up(bytes + kBufferAlignment, align);
+
+    Pool &p = pool();
+    if (pooled) {
+        std::lock_guard lock(p.m);
+        auto it = p.free.find(total);
+        if (it != p.free.end() && !it->second.empty()) {
+            Header *h = it->second.back();
+            it->second.pop_back();
+            p.cached -= total;
+            return (char *)h + kBufferAlignment;
+        }
+    }
+
+    auto *h = (Header *)std::aligned_alloc(align, total);
+    if (!h) {
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge) {
+        madvise(h, total, MADV_HUGEPAGE);
+    }
+#endif
+    h->bytes = total;
+    h->pooled = pooled;
+    return (char *)h + kBufferAlignment;
+}
+
+void buffer_free(void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+    auto *h = (Header *)((char *)ptr - kBufferAlignment);
+    if (!h->pooled) {
+        std::free(h);
+        return;
+    }
+    Pool &p = pool();
+    std::lock_guard lock(p.m);
+    p.free[h->bytes].push_back(h);
+    p.cached += h->bytes;
+    p.shrink();
+}
+
+void buffer_pool_limit(size_t bytes)
+{
+    Pool &p = pool();
+    std::lock_guard lock(p.m);
+    p.limit = bytes;
+    p.shrink();
+}
+
+void buffer_trim()
+{
+    Pool &p = pool();
+    std::lock_guard lock(p.m);
+    for (auto &[bytes, blocks] : p.free) {
+        for (Header *h : blocks) std::free(h);
+    }
+    p.free.clear();
+    p.cached = 0;
+}
+
+} // namespace r2r
@@ -0,0 +1,84 @@
+/**
+ * Raw2Raw
+ * core/buffer.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definitions of the memory of the frames of a task and of the outputs of the reductions. It is
+ * aligned to a cache line (which is also the width of an AVX-512 vector), and the large blocks are aligned to a huge
+ * page and advised to be backed by huge pages, since a stack of frames is gigabytes that are walked with strides of a
+ * whole frame. The blocks that are freed are kept in a pool and handed out again for a block of the same size, so the
+ * outputs of the GUI, which reduces the same stack again and again, or of a batch of brackets, do not go back to the
+ * system.
+ *
+ * The pages of a block from the pool are already placed on the NUMA nodes of the threads that touched them last, so a
+ * block that is placed by first touch (the frames of a task or of a packed stack) is allocated unpooled, and given back
+ * to the system when it is freed.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include <cstddef>
+
+namespace r2r {
+
+constexpr size_t kBufferAlignment = 64;
+
+/* A block of at least bytes, aligned to kBufferAlignment. It is taken from the pool if it has one of that size, unless
+ * pooled is false, in which case it comes from the system (which maps the large blocks with fresh pages), and never
+ * goes into the pool. Thread safe.
+ */
+void *buffer_alloc(size_t bytes, bool pooled = true);
+/* Give a block from buffer_alloc back to the pool, or to the system if the pool is full or the block is unpooled.
+ * nullptr is ignored.
+ */
+void buffer_free(void *p);
+/* The most memory that the pool keeps, 2 GiB by default. A smaller limit frees the blocks above it. */
+void buffer_pool_limit(size_t bytes);
+/* Give every block of the pool back to the system */
+void buffer_trim();
+
+/* An owning array from buffer_alloc, e.g. the output of a reduction. The elements are not initialized. */
+template<typename T>
+class Buffer {
+public:
+    Buffer() = default;
+    explicit Buffer(size_t count, bool pooled = true)
+        : data_((T *)buffer_alloc(count * sizeof(T), pooled)), size_(count) {}
+    ~Buffer() { buffer_free(data_); }
+
+    Buffer(Buffer &&o) noexcept : data_(o.data_), size_(o.size_) { o.data_ = nullptr; o.size_ = 0; }
+    Buffer &operator=(Buffer &&o) noexcept
+    {
+        if (this != &o) {
+            buffer_free(data_);
+            data_ = o.data_;
+            size_ = o.size_;
+            o.data_ = nullptr;
+            o.size_ = 0;
+        }
+        return *this;
+    }
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+
+    T *get() const { return data_; }
+    size_t size() const { return size_; }
+    explicit operator bool() const { return data_ != nullptr; }
+    T &operator[](size_t i) const { return data_[i]; }
+
+    /* Give up the ownership. The caller frees the array with buffer_free. */
+    T *release()
+    {
+        T *p = data_;
+        data_ = nullptr;
+        size_ = 0;
+        return p;
+    }
+
+private:
+    T *data_ {nullptr};
+    size_t size_ {0};
+};
+
+} // namespace r2r
@@ -0,0 +1,350 @@
+/**
+ * Raw2Raw
+ * core/calibrate.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the calibration stage: building master frames with the pixel-wise
+ * reductions, the on-disk master library, and the per-frame correction kernel that is run during Task ingest.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "calibrate.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+namespace {
+constexpr char kMasterMagic[4] = {'R', '2', 'R', 'M'};
+constexpr r2r::u32 kMasterVersion = 1;
+
+template<typename T>
+void write_pod(std::ofstream &out, const T &v)
+{
+    out.write(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+template<typename T>
+void read_pod(std::ifstream &in, T &v)
+{
+    in.read(reinterpret_cast<char *>(&v), sizeof(T));
+}
+
+const char *kind_name(r2r::MasterKind kind)
+{
+    switch (kind) {
+        case r2r::MasterKind::BIAS: return "bias";
+        case r2r::MasterKind::DARK: return "dark";
+        default:                    return "flat";
+    }
+}
+
+std::string master_filename(const r2r::MasterFrame &m)
+{
+    std::string camera = m.key.camera;
+    std::replace_if(camera.begin(), camera.end(), [](char c) { return !std::isalnum((unsigned char)c); }, '-');
+    char buf[64];
+    snprintf(buf, sizeof(buf), "_iso%.0f", m.key.iso);
+    std::string name = std::string(kind_name(m.kind)) + "_" + camera + buf;
+    if (m.kind == r2r::MasterKind::DARK) {
+        snprintf(buf, sizeof(buf), "_%.6gs", m.key.exposure);
+        name += buf;
+        if (!std::isnan(m.key.temperature)) {
+            snprintf(buf, sizeof(buf), "_%.1fC", m.key.temperature);
+            name += buf;
+        }
+    }
+    return name + ".r2rm";
+}
+
+bool same_key(const r2r::MasterFrame &a, const r2r::MasterFrame &b)
+{
+    auto same = [](float x, float y) { return x == y || (std::isnan(x) && std::isnan(y)); };
+    return a.kind == b.kind && a.key.camera == b.key.camera && same(a.key.iso, b.key.iso) &&
+           same(a.key.exposure, b.key.exposure) && same(a.key.temperature, b.key.temperature);
+}
+} // anonymous namespace
+
+namespace r2r {
+
+MasterKey MasterKey::from(const RawInfo &info)
+{
+    return {info.make + " " + info.model, info.iso, info.shutter, info.temperature};
+}
+
+MasterFrame build_master(const std::vector<std::filesystem::path> &files, MasterKind kind)
+{
+    Task task(files);
+    Buffer<io_t> ans = p_reduce(task, kind == MasterKind::FLAT ? pReduction::MEAN : pReduction::MEDIAN);
+
+    MasterFrame master;
+    master.kind = kind;
+    master.key = MasterKey::from(task.infos[0]);
+    // the temperature drifts during a series of darks, so key the master by the average of the frames that report it,
+    // or leave it unknown (NaN) if none do
+    float t = 0;
+    size_t n_known = 0;
+    for (const auto &info : task.infos) {
+        if (!std::isfinite(info.temperature)) continue;
+        t += info.temperature;
+        n_known++;
+    }
+    master.key.temperature = n_known ? t / n_known : NAN;
+    master.width = task.width;
+    master.height = task.height;
+    master.n_frames = task.n_images;
+    master.data.assign(ans.get(), ans.get() + task.wh);
+    return master;
+}
+
+ParserErrors save_master(const MasterFrame &master, const std::filesystem::path &file)
+{
+    std::ofstream out(file, std::ios::binary);
+    if (!out.is_open()) {
+        return ParserErrors::CANNOT_OPEN_FILE;
+    }
+    out.write(kMasterMagic, sizeof(kMasterMagic));
+    write_pod(out, kMasterVersion);
+    write_pod(out, (u32)master.kind);
+    write_pod(out, (u32)master.key.camera.size());
+    out.write(master.key.camera.data(), (std::streamsize)master.key.camera.size());
+    write_pod(out, master.key.iso);
+    write_pod(out, master.key.exposure);
+    write_pod(out, master.key.temperature);
+    write_pod(out, (u64)master.width);
+    write_pod(out, (u64)master.height);
+    write_pod(out, master.n_frames);
+    out.write(reinterpret_cast<const char *>(master.data.data()), (std::streamsize)(master.data.size() * sizeof(io_t)));
+    return out.good() ? ParserErrors::PARSE_SUCCESS : ParserErrors::CANNOT_OPEN_FILE;
+}
+
+ParserErrors load_master(const std::filesystem::path &file, MasterFrame &master, bool header_only)
+{
+    std::ifstream in(file, std::ios::binary);
+    if (!in.is_open()) {
+        return ParserErrors::CANNOT_OPEN_FILE;
+    }
+    char magic[4];
+    u32 version, kind, camera_len;
+    u64 width, height;
+    in.read(magic, sizeof(magic));
+    read_pod(in, version);
+    if (!in || memcmp(magic, kMasterMagic, sizeof(magic)) != 0 || version != kMasterVersion) {
+        return ParserErrors::CANNOT_UNPACK_FILE;
+    }
+    read_pod(in, kind);
+    read_pod(in, camera_len);
+    master.kind = (MasterKind)kind;
+    master.key.camera.resize(camera_len);
+    in.read(master.key.camera.data(), camera_len);
+    read_pod(in, master.key.iso);
+    read_pod(in, master.key.exposure);
+    read_pod(in, master.key.temperature);
+    read_pod(in, width);
+    read_pod(in, height);
+    read_pod(in, master.n_frames);
+    master.width = width;
+    master.height = height;
+    if (!header_only) {
+        master.data.resize(width * height);
+        in.read(reinterpret_cast<char *>(master.data.data()), (std::streamsize)(master.data.size() * sizeof(io_t)));
+    }
+    return in ? ParserErrors::PARSE_SUCCESS : ParserErrors::SIZE_MISMATCH;
+}
+
+MasterLibrary::MasterLibrary(const std::filesystem::path &dir) : dir(dir)
+{
+    std::filesystem::create_directories(dir);
+    for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() != ".r2rm") continue;
+        Entry e{entry.path(), {}, nullptr};
+        if (load_master(e.file, e.header, true) == ParserErrors::PARSE_SUCCESS) {
+            entries.push_back(std::move(e));
+        }
+    }
+}
+
+ParserErrors MasterLibrary::add(MasterFrame master)
+{
+    std::lock_guard lock(mtx);
+    auto file = dir / master_filename(master);
+    auto e = save_master(master, file);
+    if (e != ParserErrors::PARSE_SUCCESS) {
+        return e;
+    }
+    std::erase_if(entries, [&](const Entry &x) { return same_key(x.header, master); });
+
+    Entry entry{file, master, nullptr};
+    entry.header.data.clear();
+    entry.loaded = std::make_shared<const MasterFrame>(std::move(master));
+    entries.push_back(std::move(entry));
+    return ParserErrors::PARSE_SUCCESS;
+}
+
+size_t MasterLibrary::size() const
+{
+    std::lock_guard lock(mtx);
+    return entries.size();
+}
+
+std::shared_ptr<const MasterFrame> MasterLibrary::find(MasterKind kind, const RawInfo &light) const
+{
+    MasterKey key = MasterKey::from(light);
+    // held for the whole search, since add() may erase and append entries
+    std::lock_guard lock(mtx);
+    const Entry *best = nullptr;
+    float best_dt = INFINITY;
+    for (const auto &e : entries) {
+        const auto &h = e.header;
+        if (h.kind != kind || h.key.camera != key.camera || h.width != light.width || h.height != light.height) {
+            continue;
+        }
+        if (kind != MasterKind::FLAT && h.key.iso != key.iso) {
+            continue;
+        }
+        float dt = 0;
+        if (kind == MasterKind::DARK) {
+            if (std::abs(h.key.exposure - key.exposure) > 0.05f * key.exposure) continue;
+            if (!std::isnan(h.key.temperature) && !std::isnan(key.temperature)) {
+                dt = std::abs(h.key.temperature - key.temperature);
+                if (dt > 3.f) continue;
+            } else {
+                // a master of an unknown temperature is only taken when no measured one matches
+                dt = std::numeric_limits<float>::max();
+            }
+        }
+        if (!best || dt < best_dt) {
+            best = &e;
+            best_dt = dt;
+        }
+    }
+    if (!best) {
+        return nullptr;
+    }
+    if (!best->loaded) {
+        auto m = std::make_shared<MasterFrame>();
+        if (load_master(best->file, *m) != ParserErrors::PARSE_SUCCESS) {
+            return nullptr;
+        }
+        best->loaded = std::move(m);
+    }
+    return best->loaded;
+}
+
+Calibration make_calibration(const RawInfo &light,
+                             const MasterFrame *bias,
+                             const MasterFrame *dark,
+                             const MasterFrame *flat)
+{
+    for (const MasterFrame *m : {bias, dark, flat}) {
+        if (m && (m->width != light.width || m->height != light.height)) {
+            throw ParserErrors::SIZE_MISMATCH;
+        }
+    }
+
+    Calibration cal;
+    cal.width = light.width;
+    cal.height = light.height;
+    cal.max_val = light.max_val;
+    std::copy(light.black, light.black + 4, cal.black);
+
+    cal.pedestal.resize(2 * cal.width);
+    for (size_t r = 0; r < 2; r++) {
+        for (size_t c = 0; c < cal.width; c++) {
+            cal.pedestal[r * cal.width + c] = (float)cal.black[r * 2 + (c & 1)];
+        }
+    }
+
+    // a dark already contains the bias, so the bias is only used when there is no dark
+    if (dark) {
+        cal.offset = dark->data;
+    } else if (bias) {
+        cal.offset = bias->data;
+    }
+
+    if (flat) {
+        const size_t wh = cal.width * cal.height;
+        // the flat signal is the flat minus its own offset. Without a bias, the black level is the best we have
+        std::vector<float> signal(wh);
+        for (size_t r = 0; r < cal.height; r++) {
+            for (size_t c = 0; c < cal.width; c++) {
+                size_t i = r * cal.width + c;
+                float off = bias ? bias->data[i] : cal.black[(r & 1) * 2 + (c & 1)];
+                signal[i] = (float)flat->data[i] - off;
+            }
+        }
+
+        // normalize each CFA channel by its mean over the visible area, so the flat does not change the white balance
+        double sum[4] = {0, 0, 0, 0};
+        size_t count[4] = {0, 0, 0, 0};
+        for (size_t r = light.top_margin; r < light.top_margin + light.visible_height; r++) {
+            for (size_t c = light.left_margin; c < light.left_margin + light.visible_width; c++) {
+                float s = signal[r * cal.width + c];
+                if (s > 0) {
+                    sum[(r & 1) * 2 + (c & 1)] += s;
+                    count[(r & 1) * 2 + (c & 1)]++;
+                }
+            }
+        }
+
+        cal.gain.resize(wh);
+        #pragma omp parallel for default(none) shared(cal, signal, sum, count) schedule(static)
+        for (size_t r = 0; r < cal.height; r++) {
+            for (size_t c = 0; c < cal.width; c++) {
+                size_t p = (r & 1) * 2 + (c & 1);
+                float mean = count[p] ? (float)(sum[p] / count[p]) : 1.f;
+                float s = signal[r * cal.width + c];
+                // dust donuts and vignetting rarely need more than 10x, anything beyond that is a defect in the flat
+                cal.gain[r * cal.width + c] = s > 0 ? std::clamp(mean / s, 0.1f, 10.f) : 1.f;
+            }
+        }
+    }
+    return cal;
+}
+
+Calibration make_calibration(const RawInfo &light, const MasterLibrary &library)
+{
+    auto bias = library.find(MasterKind::BIAS, light);
+    auto dark = library.find(MasterKind::DARK, light);
+    auto flat = library.find(MasterKind::FLAT, light);
+    return make_calibration(light, bias.get(), dark.get(), flat.get());
+}
+
+void calibrate_frame(const Calibration &cal, io_t *frame)
+{
+    const float hi = (float)cal.max_val;
+    const bool has_offset = !cal.offset.empty(), has_gain = !cal.gain.empty();
+    for (size_t r = 0; r < cal.height; r++) {
+        io_t *row = frame + r * cal.width;
+        const float *ped = cal.pedestal.data() + (r & 1) * cal.width;
+        const io_t *off = has_offset ? cal.offset.data() + r * cal.width : nullptr;
+        const float *gain = has_gain ? cal.gain.data() + r * cal.width : nullptr;
+
+        // each combination gets its own branch-free loop so that the compiler can vectorize it
+        if (has_offset && has_gain) {
+            #pragma omp simd
+            for (size_t c = 0; c < cal.width; c++) {
+                float v = ((float)row[c] - (float)off[c]) * gain[c] + ped[c];
+                row[c] = (io_t)std::clamp(v + 0.5f, 0.f, hi);
+            }
+        } else if (has_offset) {
+            #pragma omp simd
+            for (size_t c = 0; c < cal.width; c++) {
+                float v = (float)row[c] - (float)off[c] + ped[c];
+                row[c] = (io_t)std::clamp(v + 0.5f, 0.f, hi);
+            }
+        } else if (has_gain) {
+            #pragma omp simd
+            for (size_t c = 0; c < cal.width; c++) {
+                float v = ((float)row[c] - ped[c]) * gain[c] + ped[c];
+                row[c] = (io_t)std::clamp(v + 0.5f, 0.f, hi);
+            }
+        }
+    }
+}
+
+} // namespace r2r
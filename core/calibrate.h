@@ -0,0 +1,112 @@
+/**
+ * Raw2Raw
+ * core/calibrate.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definitions of the calibration stage, which corrects light frames with master bias, dark and
+ * flat frames. Masters are built with the existing pixel-wise reductions, and are kept in an on-disk library keyed by
+ * the camera, ISO, exposure time and sensor temperature, so they only need to be built once.
+ *
+ * The correction itself is applied during the ingest of a Task (see TaskOptions::calibration), one frame at a time on
+ * the decoder threads, so it never needs another pass over the stack.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+#include <memory>
+#include <mutex>
+
+namespace r2r {
+
+enum class MasterKind {
+    BIAS = 0,
+    DARK,
+    FLAT
+};
+
+/* The conditions a master frame was taken under. Bias frames only depend on the camera and ISO, darks also depend on
+ * the exposure and the temperature, and flats only depend on the camera (and the optics, which we cannot know).
+ */
+struct MasterKey {
+    std::string camera;
+    float iso, exposure;
+    float temperature;  // NaN if unknown
+
+    static MasterKey from(const RawInfo &info);
+};
+
+struct MasterFrame {
+    MasterKind kind;
+    MasterKey key;
+    size_t width, height;
+    u32 n_frames;
+    std::vector<io_t> data;
+};
+
+/* Build a master frame from a set of calibration frames. Bias and darks use the median to reject cosmic ray hits,
+ * while flats use the mean for the best SNR.
+ */
+MasterFrame build_master(const std::vector<std::filesystem::path> &files, MasterKind kind);
+
+ParserErrors save_master(const MasterFrame &master, const std::filesystem::path &file);
+ParserErrors load_master(const std::filesystem::path &file, MasterFrame &master, bool header_only = false);
+
+/* A directory of master frames. Only the headers are read when the library is opened, the pixel data of a master is
+ * loaded (and then kept) the first time it is used. Every method takes the lock of the library, so masters can be
+ * added and found from several threads.
+ */
+class MasterLibrary {
+public:
+    explicit MasterLibrary(const std::filesystem::path &dir);
+
+    /* Store a master in the library, replacing any master of the same kind and key */
+    ParserErrors add(MasterFrame master);
+
+    /* Find the best master of a kind for a light frame, or nullptr if there is no suitable master. Darks must match
+     * the exposure to within 5% and the temperature to within 3C (when both are known). The closest temperature wins,
+     * and a dark of an unknown temperature only when none of a known one matches.
+     */
+    std::shared_ptr<const MasterFrame> find(MasterKind kind, const RawInfo &light) const;
+
+    size_t size() const;
+
+private:
+    struct Entry {
+        std::filesystem::path file;
+        MasterFrame header;
+        mutable std::shared_ptr<const MasterFrame> loaded;
+    };
+    std::filesystem::path dir;
+    std::vector<Entry> entries;
+    mutable std::mutex mtx;
+};
+
+/* A calibration that is ready to be applied to light frames. A sample v at pixel i, CFA position p is corrected to
+ *     (v - offset[i]) * gain[i] + black[p]
+ * where offset is the dark (or the bias, or the black level if neither is available) and gain is the flat field
+ * normalized per CFA channel. The black level is added back so the output is still a valid raw file for the camera.
+ */
+struct Calibration {
+    size_t width, height;
+    u32 max_val;
+    u32 black[4];
+    std::vector<io_t> offset;       // empty if there is no dark or bias
+    std::vector<float> gain;        // empty if there is no flat
+    std::vector<float> pedestal;    // black level of two consecutive rows, precomputed for the kernel
+};
+
+/* Prepare a calibration from masters, any of which may be null. Throws SIZE_MISMATCH if a master does not match. */
+Calibration make_calibration(const RawInfo &light,
+                             const MasterFrame *bias,
+                             const MasterFrame *dark,
+                             const MasterFrame *flat);
+
+/* Prepare a calibration with the best masters of a library */
+Calibration make_calibration(const RawInfo &light, const MasterLibrary &library);
+
+/* Correct a single frame in place */
+void calibrate_frame(const Calibration &cal, io_t *frame);
+
+} // namespace r2r
@@ -0,0 +1,134 @@
+/**
+ * Raw2Raw
+ * core/cfa.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the CFA plane layout and the per-channel helpers.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "cfa.h"
+#include <algorithm>
+
+namespace {
+/* The CFA positions of the two greens (some cameras report both greens as color 1) */
+void green_positions(const r2r::RawInfo &info, int &g1, int &g2)
+{
+    int green[2] = {1, 2}, n_green = 0;
+    for (int p = 0; p < 4 && n_green < 2; p++) {
+        if (info.cfa[p] == 1 || info.cfa[p] == 3) green[n_green++] = p;
+    }
+    g1 = green[0];
+    g2 = green[1];
+}
+} // anonymous namespace
+
+namespace r2r {
+
+void cfa_split(const io_t *in, io_t *out, size_t width, size_t height)
+{
+    const size_t pw = width / 2, ph = height / 2, plane = pw * ph;
+    for (size_t y = 0; y < ph; y++) {
+        const io_t *r0 = in + (2 * y) * width;
+        const io_t *r1 = r0 + width;
+        io_t *p0 = out + y * pw, *p1 = p0 + plane, *p2 = p1 + plane, *p3 = p2 + plane;
+        for (size_t x = 0; x < pw; x++) {
+            p0[x] = r0[2 * x];
+            p1[x] = r0[2 * x + 1];
+            p2[x] = r1[2 * x];
+            p3[x] = r1[2 * x + 1];
+        }
+    }
+}
+
+void cfa_bin(const io_t *in, io_t *out, size_t width, size_t height)
+{
+    const size_t ow = width / 4 * 2, oh = height / 4 * 2;
+    for (size_t y = 0; y < oh; y++) {
+        // the same-color rows of the input are two apart
+        const io_t *r0 = in + (2 * (y & ~(size_t)1) + (y & 1)) * width, *r1 = r0 + 2 * width;
+        io_t *o = out + y * ow;
+        for (size_t x = 0; x < ow; x++) {
+            const size_t c = 2 * (x & ~(size_t)1) + (x & 1);
+            o[x] = (io_t)(((u32)r0[c] + r0[c + 2] + r1[c] + r1[c + 2] + 2) >> 2);
+        }
+    }
+}
+
+void cfa_merge(const io_t *in, io_t *out, size_t width, size_t height)
+{
+    const size_t pw = width / 2, ph = height / 2, plane = pw * ph;
+    #pragma omp parallel for default(none) shared(in, out, width, pw, ph, plane) schedule(static)
+    for (size_t y = 0; y < ph; y++) {
+        io_t *r0 = out + (2 * y) * width;
+        io_t *r1 = r0 + width;
+        const io_t *p0 = in + y * pw, *p1 = p0 + plane, *p2 = p1 + plane, *p3 = p2 + plane;
+        for (size_t x = 0; x < pw; x++) {
+            r0[2 * x] = p0[x];
+            r0[2 * x + 1] = p1[x];
+            r1[2 * x] = p2[x];
+            r1[2 * x + 1] = p3[x];
+        }
+    }
+}
+
+Buffer<io_t> to_interleaved(const Task &task, Buffer<io_t> ans)
+{
+    if (!ans || task.layout != Layout::CFA_PLANES) {
+        return ans;
+    }
+    Buffer<io_t> out(task.wh);
+    cfa_merge(ans.get(), out.get(), task.width, task.height);
+    return out;
+}
+
+int cfa_position(const Task &task, size_t i)
+{
+    if (task.layout == Layout::CFA_PLANES) {
+        return (int)(i / (task.wh / 4));
+    }
+    return (int)(((i / task.width) & 1) * 2 + (i % task.width & 1));
+}
+
+int cfa_plane_of(const RawInfo &info, int color)
+{
+    for (int p = 0; p < 4; p++) {
+        if (info.cfa[p] == color) return p;
+    }
+    return -1;
+}
+
+void cfa_green(const Task &task, size_t frame, float *out)
+{
+    const io_t *data = task.data + frame * task.wh;
+    if (task.layout != Layout::CFA_PLANES) {
+        cfa_green(data, task.infos[frame], task.width, task.height, out);
+        return;
+    }
+    int g1, g2;
+    green_positions(task.infos[frame], g1, g2);
+    const io_t *a = data + g1 * (task.wh / 4), *b = data + g2 * (task.wh / 4);
+    const size_t n = (task.width / 2) * (task.height / 2);
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++) {
+        out[i] = 0.5f * ((float)a[i] + (float)b[i]);
+    }
+}
+
+void cfa_green(const io_t *frame, const RawInfo &info, size_t width, size_t height, float *out)
+{
+    int g1, g2;
+    green_positions(info, g1, g2);
+    const size_t pw = width / 2, ph = height / 2;
+    const size_t oa = (g1 >> 1) * width + (g1 & 1), ob = (g2 >> 1) * width + (g2 & 1);
+    for (size_t y = 0; y < ph; y++) {
+        const io_t *row = frame + 2 * y * width;
+        for (size_t x = 0; x < pw; x++) {
+            out[y * pw + x] = 0.5f * ((float)row[2 * x + oa] + (float)row[2 * x + ob]);
+        }
+    }
+}
+
+} // namespace r2r
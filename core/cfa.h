@@ -0,0 +1,52 @@
+/**
+ * Raw2Raw
+ * core/cfa.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the functions that deal with the color filter array (CFA) of bayer sensors. A task can optionally
+ * store each frame as four half-resolution planes, one for each position of the 2x2 CFA block, instead of the
+ * interleaved sensor layout. In the planar layout a per-channel pass (e.g. the green channel that the alignment
+ * correlates) is a contiguous loop over a plane, instead of a strided or branchy loop over the whole frame.
+ *
+ * Planes are ordered by their position in the 2x2 block in raw coordinates (row-major), i.e. plane p holds the samples
+ * at row parity p >> 1 and column parity p & 1. RawInfo::cfa[p] gives the color of plane p.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+
+namespace r2r {
+
+/* Deinterleave a width x height frame into four (width / 2) x (height / 2) planes stored one after another in out.
+ * Width and height must be even.
+ */
+void cfa_split(const io_t *in, io_t *out, size_t width, size_t height);
+
+/* The inverse of cfa_split */
+void cfa_merge(const io_t *in, io_t *out, size_t width, size_t height);
+
+/* Average every 2x2 group of same-color samples of a width x height frame (i.e. each 4x4 block of the CFA) into one
+ * sample of a (width / 4 * 2) x (height / 4 * 2) frame, which has the same CFA pattern.
+ */
+void cfa_bin(const io_t *in, io_t *out, size_t width, size_t height);
+
+/* Return a frame sized result of a reduction in the interleaved layout. If the task is planar, ans is merged into a new
+ * buffer and freed when it goes out of scope, otherwise ans itself is moved out.
+ */
+Buffer<io_t> to_interleaved(const Task &task, Buffer<io_t> ans);
+
+/* The CFA position of the i-th sample of a frame, in the layout of the task */
+int cfa_position(const Task &task, size_t i);
+
+/* The plane of a color (0 = R, 1 = G, 2 = B, 3 = second G), or -1 if the CFA does not have it */
+int cfa_plane_of(const RawInfo &info, int color);
+
+/* Average the two greens of each 2x2 block into a (width / 2) x (height / 2) image. Works with both layouts. */
+void cfa_green(const Task &task, size_t frame, float *out);
+
+/* The same for a single frame in the interleaved layout */
+void cfa_green(const io_t *frame, const RawInfo &info, size_t width, size_t height, float *out);
+
+} // namespace r2r
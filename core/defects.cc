@@ -0,0 +1,238 @@
+/**
+ * Raw2Raw
+ * core/defects.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the defective pixel detection, correction and cache.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "defects.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+namespace {
+constexpr char kDefectMagic[4] = {'R', '2', 'R', 'D'};
+constexpr r2r::u32 kDefectVersion = 1;
+
+template<typename T>
+void write_pod(std::ofstream &out, const T &v)
+{
+    out.write(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+template<typename T>
+void read_pod(std::ifstream &in, T &v)
+{
+    in.read(reinterpret_cast<char *>(&v), sizeof(T));
+}
+
+void write_string(std::ofstream &out, const std::string &s)
+{
+    write_pod(out, (r2r::u32)s.size());
+    out.write(s.data(), (std::streamsize)s.size());
+}
+
+void read_string(std::ifstream &in, std::string &s)
+{
+    r2r::u32 n = 0;
+    read_pod(in, n);
+    s.resize(in ? n : 0);
+    in.read(s.data(), (std::streamsize)s.size());
+}
+
+/* Replace every defect by the mean of the (up to 8) same-color samples around it that are not defects, where at maps
+ * raw coordinates to the index of the sample in the frame.
+ */
+template<typename At>
+void correct(const r2r::DefectMap &map, r2r::io_t *frame, At at)
+{
+    const size_t w = map.width, h = map.height;
+    for (r2r::u32 i : map.pixels) {
+        const size_t x = i % w, y = i / w;
+        r2r::u32 s = 0, n = 0;
+        for (int dy = -2; dy <= 2; dy += 2) {
+            for (int dx = -2; dx <= 2; dx += 2) {
+                const size_t xx = x + dx, yy = y + dy;
+                if ((dx == 0 && dy == 0) || xx >= w || yy >= h) continue;
+                if (std::binary_search(map.pixels.begin(), map.pixels.end(), (r2r::u32)(yy * w + xx))) continue;
+                s += frame[at(xx, yy)];
+                n++;
+            }
+        }
+        if (n) {
+            frame[at(x, y)] = (r2r::io_t)((s + n / 2) / n);
+        }
+    }
+}
+} // anonymous namespace
+
+namespace r2r {
+
+DefectDetector::DefectDetector(const DefectParams &params) : params(params) {}
+
+void DefectDetector::add(const io_t *frame, const RawInfo &info, size_t width, size_t height)
+{
+    if (!info.bayer || width < 8 || height < 8) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (counts.empty()) {
+            counts.assign(width * height, 0);
+            header.camera = info.make + " " + info.model;
+            header.serial = info.serial;
+            header.width = width;
+            header.height = height;
+        } else if (width != header.width || height != header.height) {
+            return;
+        }
+        header.n_frames++;
+    }
+
+    const float shot = params.shot_noise, read2 = params.read_noise * params.read_noise;
+    const float th2 = params.threshold * params.threshold;
+    // the deviation of a sample from the median of its four nearest same-color samples, and the variance of the noise
+    const auto deviation = [&](size_t x, size_t y, float &var) {
+        const size_t i = y * width + x;
+        io_t a = frame[i - 2], b = frame[i + 2], c = frame[i - 2 * width], d = frame[i + 2 * width];
+        if (a > b) std::swap(a, b);
+        if (c > d) std::swap(c, d);
+        const float m = 0.5f * ((float)std::max(a, c) + (float)std::min(b, d));
+        var = shot * std::max(m - (float)info.black[(y & 1) * 2 + (x & 1)], 0.f) + read2;
+        return (float)frame[i] - m;
+    };
+
+    u16 *c = counts.data();
+    for (size_t y = 3; y + 3 < height; y++) {
+        for (size_t x = 3; x + 3 < width; x++) {
+            float var;
+            const float d = deviation(x, y, var);
+            if (d * d <= th2 * var) continue;
+            // a point of light also lights up the neighbors of the other colors, a defect does not
+            bool isolated = true;
+            for (int dy = -1; dy <= 1 && isolated; dy++) {
+                for (int dx = -1; dx <= 1 && isolated; dx++) {
+                    if (dx == 0 && dy == 0) continue;
+                    float nvar;
+                    const float nd = deviation(x + dx, y + dy, nvar);
+                    isolated = nd * d <= 0 || 4 * nd * nd <= th2 * nvar;
+                }
+            }
+            if (isolated) {
+                std::atomic_ref<u16>(c[y * width + x]).fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+DefectMap DefectDetector::finish() const
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    DefectMap map = header;
+    if (map.n_frames < std::max<u32>(params.min_frames, 1)) {
+        return map;
+    }
+    const u32 limit = std::max<u32>((u32)std::ceil(params.min_fraction * (float)map.n_frames), 1);
+    for (size_t i = 0; i < counts.size(); i++) {
+        if (counts[i] >= limit) map.pixels.push_back((u32)i);
+    }
+    return map;
+}
+
+void correct_defects(const DefectMap &map, io_t *frame)
+{
+    const size_t w = map.width;
+    correct(map, frame, [w](size_t x, size_t y) { return y * w + x; });
+}
+
+void correct_defects(const DefectMap &map, Task &task)
+{
+    if (map.pixels.empty()) {
+        return;
+    }
+    if (map.width != task.width || map.height != task.height) {
+        throw ParserErrors::SIZE_MISMATCH;
+    }
+    const size_t w = task.width, pw = task.width / 2, plane = task.wh / 4;
+    const bool planar = task.layout == Layout::CFA_PLANES;
+    #pragma omp parallel for default(none) shared(map, task, w, pw, plane, planar) schedule(static)
+    for (size_t j = 0; j < task.n_images; j++) {
+        io_t *frame = task.data + j * task.wh;
+        if (planar) {
+            correct(map, frame, [=](size_t x, size_t y) { return ((y & 1) * 2 + (x & 1)) * plane + (y / 2) * pw + x / 2; });
+        } else {
+            correct(map, frame, [=](size_t x, size_t y) { return y * w + x; });
+        }
+    }
+}
+
+ParserErrors save_defects(const DefectMap &map, const std::filesystem::path &file)
+{
+    std::ofstream out(file, std::ios::binary);
+    if (!out.is_open()) {
+        return ParserErrors::CANNOT_OPEN_FILE;
+    }
+    out.write(kDefectMagic, sizeof(kDefectMagic));
+    write_pod(out, kDefectVersion);
+    write_string(out, map.camera);
+    write_string(out, map.serial);
+    write_pod(out, (u64)map.width);
+    write_pod(out, (u64)map.height);
+    write_pod(out, map.n_frames);
+    write_pod(out, (u64)map.pixels.size());
+    out.write(reinterpret_cast<const char *>(map.pixels.data()), (std::streamsize)(map.pixels.size() * sizeof(u32)));
+    return out.good() ? ParserErrors::PARSE_SUCCESS : ParserErrors::CANNOT_OPEN_FILE;
+}
+
+ParserErrors load_defects(const std::filesystem::path &file, DefectMap &map)
+{
+    std::ifstream in(file, std::ios::binary);
+    if (!in.is_open()) {
+        return ParserErrors::CANNOT_OPEN_FILE;
+    }
+    char magic[4];
+    u32 version;
+    in.read(magic, sizeof(magic));
+    read_pod(in, version);
+    if (!in || memcmp(magic, kDefectMagic, sizeof(magic)) != 0 || version != kDefectVersion) {
+        return ParserErrors::CANNOT_UNPACK_FILE;
+    }
+    u64 width = 0, height = 0, n = 0;
+    read_string(in, map.camera);
+    read_string(in, map.serial);
+    read_pod(in, width);
+    read_pod(in, height);
+    read_pod(in, map.n_frames);
+    read_pod(in, n);
+    map.width = width;
+    map.height = height;
+    map.pixels.resize(in && n <= width * height ? n : 0);
+    in.read(reinterpret_cast<char *>(map.pixels.data()), (std::streamsize)(map.pixels.size() * sizeof(u32)));
+    if (!in || map.pixels.size() != n) {
+        return ParserErrors::SIZE_MISMATCH;
+    }
+    const bool valid = std::is_sorted(map.pixels.begin(), map.pixels.end()) &&
+                       (map.pixels.empty() || map.pixels.back() < width * height);
+    return valid ? ParserErrors::PARSE_SUCCESS : ParserErrors::SIZE_MISMATCH;
+}
+
+std::filesystem::path defect_cache_path(const std::filesystem::path &dir, const RawInfo &info)
+{
+    if (info.serial.empty()) {
+        return {};
+    }
+    std::string name = info.make + "_" + info.model + "_" + info.serial;
+    for (char &ch : name) {
+        if (!std::isalnum((unsigned char)ch)) ch = '_';
+    }
+    return dir / (name + ".r2rd");
+}
+
+} // namespace r2r
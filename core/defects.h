@@ -0,0 +1,80 @@
+/**
+ * Raw2Raw
+ * core/defects.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definitions of the defective pixel stage, which finds the hot, dead and stuck pixels of a
+ * sensor and replaces them by the mean of their same-color neighbors. Hot pixels are the same in every frame, so unlike
+ * noise they survive the mean, and they are the brightest sample of their pixel so they leave a trail in the maximum.
+ *
+ * A pixel is a defect when, in most frames of a stack, it deviates from its same-color neighbors by more than the noise
+ * explains, while none of its immediate neighbors does. A point of light is spread over a few pixels by the lens, so
+ * the second condition keeps stars and specular highlights that do not move between the frames out of the map.
+ *
+ * Both detection and correction run during the ingest of a Task (see TaskOptions::defects and TaskOptions::detector) on
+ * the decoder threads, so neither needs another pass over the stack. The defects belong to the sensor, so a map is
+ * cached by the serial number of the camera and later stacks of the same camera skip detection entirely.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+#include <mutex>
+
+namespace r2r {
+
+struct DefectParams {
+    float threshold {8.f};          // deviation from the neighbors, in standard deviations of the noise
+    float shot_noise {1.f};         // variance of the noise in DN^2 per DN of signal above the black level
+    float read_noise {4.f};         // standard deviation of the noise in DN at the black level
+    float min_fraction {0.8f};      // of the frames that a pixel must deviate in
+    u32 min_frames {5};             // fewer frames cannot tell a defect from a cosmic ray or a moving subject
+};
+
+struct DefectMap {
+    std::string camera, serial;
+    size_t width {0}, height {0};
+    u32 n_frames {0};               // the frames the map was detected from
+    std::vector<u32> pixels;        // indices of the defects in the raw frame, in ascending order
+};
+
+/* Counts the frames in which each pixel looks like a defect. Frames may be added from several threads at once. */
+class DefectDetector {
+public:
+    explicit DefectDetector(const DefectParams &params = {});
+
+    /* Look for defects in a raw frame (in the interleaved layout). Only bayer frames are used. */
+    void add(const io_t *frame, const RawInfo &info, size_t width, size_t height);
+
+    /* The pixels that deviated in enough of the frames so far. The map is empty if there were fewer than min_frames
+     * frames.
+     */
+    DefectMap finish() const;
+
+    const DefectParams &parameters() const { return params; }
+
+private:
+    DefectParams params;
+    std::vector<u16> counts;
+    DefectMap header;
+    mutable std::mutex mtx;
+};
+
+/* Replace the defects of a raw frame (in the interleaved layout) by the mean of their same-color neighbors that are
+ * not defects themselves.
+ */
+void correct_defects(const DefectMap &map, io_t *frame);
+
+/* The same for every frame of a task, in the layout of the task */
+void correct_defects(const DefectMap &map, Task &task);
+
+ParserErrors save_defects(const DefectMap &map, const std::filesystem::path &file);
+ParserErrors load_defects(const std::filesystem::path &file, DefectMap &map);
+
+/* Where the map of the camera of a frame is cached in a directory, or an empty path if the camera does not report its
+ * serial number (the defects of another body of the same model are different).
+ */
+std::filesystem::path defect_cache_path(const std::filesystem::path &dir, const RawInfo &info);
+
+} // namespace r2r
@@ -0,0 +1,241 @@
+/**
+ * Raw2Raw
+ * core/dng.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the minimal DNG writer. The file is a little endian TIFF with a single IFD
+ * that holds the whole uncompressed image in one strip, and the DNG tags needed by raw converters to render it.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "dng.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+namespace {
+using r2r::u8;
+using r2r::u16;
+using r2r::u32;
+
+enum TiffType : u16 {
+    BYTE = 1,
+    ASCII = 2,
+    SHORT = 3,
+    LONG = 4,
+    RATIONAL = 5,
+    SRATIONAL = 10
+};
+
+template<typename T>
+void put_le(std::vector<char> &out, T v)
+{
+    for (size_t i = 0; i < sizeof(T); i++) {
+        out.push_back((char)((u32)v >> (8 * i) & 0xff));
+    }
+}
+
+struct IfdEntry {
+    u16 tag;
+    u16 type;
+    u32 count;
+    std::vector<char> bytes;
+};
+
+class Ifd {
+public:
+    void add_byte(u16 tag, std::vector<u8> v)
+    {
+        IfdEntry &e = add(tag, BYTE, (u32)v.size());
+        for (u8 x : v) put_le(e.bytes, x);
+    }
+    void add_ascii(u16 tag, const std::string &s)
+    {
+        IfdEntry &e = add(tag, ASCII, (u32)s.size() + 1);
+        e.bytes.assign(s.begin(), s.end());
+        e.bytes.push_back(0);
+    }
+    void add_short(u16 tag, std::vector<u16> v)
+    {
+        IfdEntry &e = add(tag, SHORT, (u32)v.size());
+        for (u16 x : v) put_le(e.bytes, x);
+    }
+    void add_long(u16 tag, std::vector<u32> v)
+    {
+        IfdEntry &e = add(tag, LONG, (u32)v.size());
+        for (u32 x : v) put_le(e.bytes, x);
+    }
+    void add_rational(u16 tag, std::vector<double> v, bool is_signed = false)
+    {
+        IfdEntry &e = add(tag, is_signed ? SRATIONAL : RATIONAL, (u32)v.size());
+        constexpr u32 den = 10000;
+        for (double x : v) {
+            put_le(e.bytes, is_signed ? (u32)(r2r::s32)std::lround(x * den) : (u32)std::lround(std::max(x, 0.0) * den));
+            put_le(e.bytes, den);
+        }
+    }
+
+    /* Serialize the IFD, which starts at offset 8 of the file, followed by the values that do not fit in the entries.
+     * The image data starts at the returned offset.
+     */
+    u32 serialize(std::vector<char> &out, u16 strip_offsets_tag)
+    {
+        std::sort(entries.begin(), entries.end(), [](const IfdEntry &a, const IfdEntry &b) { return a.tag < b.tag; });
+        u32 extra = 8 + 2 + 12 * (u32)entries.size() + 4;
+        u32 data_offset = extra;
+        for (const auto &e : entries) {
+            if (e.bytes.size() > 4) data_offset += (u32)(e.bytes.size() + 1) & ~1u;
+        }
+        data_offset = (data_offset + 15) & ~15u;
+        for (auto &e : entries) {
+            if (e.tag == strip_offsets_tag) {
+                e.bytes.clear();
+                put_le(e.bytes, data_offset);
+            }
+        }
+
+        std::vector<char> values;
+        put_le(out, (u16)entries.size());
+        for (const auto &e : entries) {
+            put_le(out, e.tag);
+            put_le(out, e.type);
+            put_le(out, e.count);
+            if (e.bytes.size() <= 4) {
+                std::vector<char> padded = e.bytes;
+                padded.resize(4, 0);
+                out.insert(out.end(), padded.begin(), padded.end());
+            } else {
+                put_le(out, extra + (u32)values.size());
+                values.insert(values.end(), e.bytes.begin(), e.bytes.end());
+                if (values.size() % 2) values.push_back(0);
+            }
+        }
+        put_le(out, (u32)0); // no next IFD
+        out.insert(out.end(), values.begin(), values.end());
+        out.resize(data_offset - 8, 0);
+        return data_offset;
+    }
+
+private:
+    IfdEntry &add(u16 tag, u16 type, u32 count)
+    {
+        return entries.emplace_back(IfdEntry{tag, type, count, {}});
+    }
+    std::vector<IfdEntry> entries;
+};
+} // anonymous namespace
+
+namespace r2r {
+
+ParserErrors write_dng(const std::filesystem::path &out_file, const RawInfo &info, const DngImage &image)
+{
+    const bool cfa = image.samples == 1;
+    const bool is_float = image.f32 != nullptr;
+    const u16 bits = is_float ? 32 : 16;
+    const size_t count = image.width * image.height * image.samples;
+
+    Ifd ifd;
+    ifd.add_long(254, {0});                                             // NewSubfileType: main image
+    ifd.add_long(256, {(u32)image.width});
+    ifd.add_long(257, {(u32)image.height});
+    ifd.add_short(258, std::vector<u16>(image.samples, bits));          // BitsPerSample
+    ifd.add_short(259, {1});                                            // Compression: none
+    ifd.add_short(262, {(u16)(cfa ? 32803 : 34892)});                   // Photometric: CFA or LinearRaw
+    ifd.add_ascii(271, info.make);
+    ifd.add_ascii(272, info.model);
+    ifd.add_long(273, {0});                                             // StripOffsets, filled in by serialize
+    ifd.add_short(274, {1});                                            // Orientation
+    ifd.add_short(277, {(u16)image.samples});
+    ifd.add_long(278, {(u32)image.height});                             // RowsPerStrip
+    ifd.add_long(279, {(u32)(count * bits / 8)});                       // StripByteCounts
+    ifd.add_short(284, {1});                                            // PlanarConfiguration: chunky
+    ifd.add_ascii(305, "raw2raw");
+    ifd.add_short(339, std::vector<u16>(image.samples, is_float ? 3 : 1)); // SampleFormat
+
+    if (cfa) {
+        std::vector<u8> pattern(4);
+        // TIFF/EP has no second green, LibRaw's color 3 is green as well
+        std::transform(info.cfa, info.cfa + 4, pattern.begin(), [](u8 c) { return (u8)(c == 3 ? 1 : c); });
+        ifd.add_short(33421, {2, 2});                                   // CFARepeatPatternDim
+        ifd.add_byte(33422, pattern);                                   // CFAPattern
+        ifd.add_byte(50710, {0, 1, 2});                                 // CFAPlaneColor
+        ifd.add_short(50711, {1});                                      // CFALayout: rectangular
+    }
+    ifd.add_byte(50706, {1, 4, 0, 0});                                  // DNGVersion, 1.4 for floating point
+    ifd.add_byte(50707, {1, is_float ? (u8)4 : (u8)1, 0, 0});           // DNGBackwardVersion
+    ifd.add_ascii(50708, info.make + " " + info.model);                 // UniqueCameraModel
+
+    std::vector<double> black;
+    if (cfa) {
+        ifd.add_short(50713, {2, 2});                                   // BlackLevelRepeatDim
+        black.assign(image.black, image.black + 4);
+    } else {
+        black.assign(image.black, image.black + image.samples);
+    }
+    ifd.add_rational(50714, black);                                     // BlackLevel
+    ifd.add_long(50717, std::vector<u32>(image.samples, is_float ? 1 : image.white)); // WhiteLevel
+
+    std::vector<double> color_matrix(9);
+    bool has_matrix = false;
+    for (int i = 0; i < 9; i++) {
+        color_matrix[i] = info.cam_xyz[i / 3][i % 3];
+        has_matrix |= color_matrix[i] != 0;
+    }
+    if (!has_matrix) {
+        color_matrix = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+    }
+    ifd.add_rational(50721, color_matrix, true);                        // ColorMatrix1
+    std::vector<double> neutral(3, 1.0);
+    for (int c = 0; c < 3; c++) {
+        if (info.cam_mul[c] > 0 && info.cam_mul[1] > 0) neutral[c] = info.cam_mul[1] / info.cam_mul[c];
+    }
+    ifd.add_rational(50728, neutral);                                   // AsShotNeutral
+    ifd.add_rational(50730, {image.baseline_exposure}, true);           // BaselineExposure
+    ifd.add_short(50778, {21});                                         // CalibrationIlluminant1: D65
+
+    // the visible area of the sensor, scaled to the output size
+    if (info.width && info.height) {
+        double sx = (double)image.width / info.width, sy = (double)image.height / info.height;
+        u32 top = (u32)std::lround(info.top_margin * sy), left = (u32)std::lround(info.left_margin * sx);
+        u32 bottom = std::min<u32>((u32)image.height, (u32)std::lround((info.top_margin + info.visible_height) * sy));
+        u32 right = std::min<u32>((u32)image.width, (u32)std::lround((info.left_margin + info.visible_width) * sx));
+        // the active area must start on a CFA block so the pattern stays valid
+        if (cfa) {
+            top &= ~1u;
+            left &= ~1u;
+        }
+        if (bottom > top && right > left) {
+            ifd.add_long(50829, {top, left, bottom, right});            // ActiveArea
+        }
+    }
+
+    std::vector<char> bytes = {'I', 'I', 42, 0, 8, 0, 0, 0};
+    std::vector<char> ifd_bytes;
+    u32 data_offset = ifd.serialize(ifd_bytes, 273);
+    bytes.insert(bytes.end(), ifd_bytes.begin(), ifd_bytes.end());
+    bytes.reserve(data_offset + count * bits / 8);
+    if (is_float) {
+        for (size_t i = 0; i < count; i++) {
+            u32 v;
+            static_assert(sizeof(v) == sizeof(*image.f32));
+            memcpy(&v, image.f32 + i, sizeof(v));
+            put_le(bytes, v);
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            put_le(bytes, image.u16[i]);
+        }
+    }
+
+    std::ofstream out(out_file, std::ios::binary);
+    if (!out.is_open()) {
+        return ParserErrors::CANNOT_OPEN_FILE;
+    }
+    out.write(bytes.data(), (std::streamsize)bytes.size());
+    return out.good() ? ParserErrors::PARSE_SUCCESS : ParserErrors::CANNOT_OPEN_FILE;
+}
+
+} // namespace r2r
@@ -0,0 +1,37 @@
+/**
+ * Raw2Raw
+ * core/dng.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains a minimal DNG writer. Unlike write_image, which patches the raw data of a reference file, it
+ * writes a new file, so it is used for the outputs that cannot be stored in the camera's own format: floating point
+ * (HDR) data, images that have a different size than the sensor, and linear (demosaiced) images.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+
+namespace r2r {
+
+/* Description of the image to write. Exactly one of f32 and u16 must be set.
+ *
+ * With samples = 1 the image is a CFA image with the pattern of info, with samples = 3 it is a linear RGB image. The
+ * visible area is taken from info, scaled by width / info.width. Float data is expected to be normalized so that 0 is
+ * black and 1 is white; u16 data uses black and white.
+ */
+struct DngImage {
+    size_t width, height;
+    int samples {1};
+    const float *f32 {nullptr};
+    const io_t *u16 {nullptr};
+    u32 black[4] {0, 0, 0, 0};      // per CFA position (or per channel for linear images)
+    u32 white {0xffff};
+    double baseline_exposure {0};   // in EV
+};
+
+/* Write a DNG with the metadata (camera, color matrix, white balance) of a raw file */
+ParserErrors write_dng(const std::filesystem::path &out_file, const RawInfo &info, const DngImage &image);
+
+} // namespace r2r
@@ -0,0 +1,239 @@
+/**
+ * Raw2Raw
+ * core/drizzle.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the drizzle accumulator.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "drizzle.h"
+#include "cfa.h"
+#include "dng.h"
+#include "register.h"
+#include "stars.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace r2r {
+
+namespace {
+constexpr size_t kBand = 32;        // output rows per band, a band is owned by one thread
+
+/* Sample (x, y) of a frame of the task, in either layout */
+inline io_t sample(const Task &task, const io_t *frame, size_t x, size_t y)
+{
+    if (task.layout == Layout::CFA_PLANES) {
+        const size_t p = (y & 1) * 2 + (x & 1);
+        return frame[p * (task.wh / 4) + (y / 2) * (task.width / 2) + x / 2];
+    }
+    return frame[y * task.width + x];
+}
+
+/* Both greens are the same channel of the output */
+inline int channel(u8 color)
+{
+    return color == 3 ? 1 : color;
+}
+} // anonymous namespace
+
+std::vector<Affine> estimate_transforms(const Task &task, Alignment align, std::vector<size_t> *unmatched)
+{
+    if (align == Alignment::GLOBAL) {
+        return estimate_offsets(task);
+    }
+    if (align != Alignment::SIMILARITY && align != Alignment::AFFINE) {
+        throw std::invalid_argument("drizzle needs a global, similarity or affine alignment");
+    }
+    StarParams params;
+    params.affine = align == Alignment::AFFINE;
+    std::vector<Affine> transforms(task.n_images);
+    std::vector<std::vector<Star>> stars(task.n_images);
+    #pragma omp parallel default(none) shared(task, params, stars)
+    {
+        std::vector<io_t> frame(task.layout == Layout::CFA_PLANES ? task.wh : 0);
+        #pragma omp for schedule(dynamic)
+        for (size_t j = 0; j < task.n_images; j++) {
+            const io_t *data = task.data + j * task.wh;
+            if (!frame.empty()) {
+                cfa_merge(data, frame.data(), task.width, task.height);
+                data = frame.data();
+            }
+            stars[j] = detect_stars(data, task.infos[j], task.width, task.height, params);
+        }
+    }
+    for (size_t j = 1; j < task.n_images; j++) {
+        // the identity would drizzle the frame where it is, so it is left to the caller to skip it
+        if (!match_stars(stars[0], stars[j], transforms[j], params) && unmatched) {
+            unmatched->push_back(j);
+        }
+    }
+    return transforms;
+}
+
+DrizzleResult drizzle(const Task &task, const std::vector<Affine> &transforms, const DrizzleParams &params,
+                      const std::vector<size_t> &skip)
+{
+    if (!(params.scale > 0) || !(params.pixfrac > 0)) {
+        throw std::invalid_argument("the scale and pixfrac must be positive");
+    }
+    if (transforms.size() != task.n_images || task.infos.size() != task.n_images) {
+        throw std::invalid_argument("drizzle needs one transform per frame");
+    }
+    std::vector<u8> skipped(task.n_images, 0);
+    for (size_t j : skip) {
+        if (j == 0 || j >= task.n_images) {
+            throw std::invalid_argument("drizzle can only skip the frames after the first one");
+        }
+        skipped[j] = 1;
+    }
+
+    DrizzleResult result;
+    const double s = params.scale;
+    const long W = std::max(1l, std::lround((double)task.width * s));
+    const long H = std::max(1l, std::lround((double)task.height * s));
+    const int S = params.linear ? 3 : 1;
+    result.width = (size_t)W;
+    result.height = (size_t)H;
+    result.samples = S;
+    result.data.assign(W * H * S, 0);
+    result.weights.assign(W * H * S, 0.f);
+    result.holes = 0;
+    result.dropped = std::count(skipped.begin(), skipped.end(), 1);
+    result.info = task.infos[0];
+
+    // the channel of every output sample of a mosaic follows the pattern of the reference
+    u8 out_color[4];
+    for (int p = 0; p < 4; p++) out_color[p] = (u8)channel(result.info.cfa[p]);
+
+    // frame coordinates to reference coordinates, and half the size of a drop in output pixels. A frame sample covers
+    // 1 / |det| of the reference.
+    const size_t n = task.n_images;
+    std::vector<Affine> inverse(n);
+    std::vector<double> half(n);
+    for (size_t j = 0; j < n; j++) {
+        const Affine &T = transforms[j];
+        inverse[j] = T.inverse();
+        half[j] = 0.5 * params.pixfrac * s / std::sqrt(std::abs(T.a * T.d - T.b * T.c));
+    }
+
+    const long n_bands = (H + (long)kBand - 1) / (long)kBand;
+    size_t holes = 0;
+    #pragma omp parallel default(none) shared(task, transforms, params, result, out_color, inverse, half, skipped, s, W, H, S, n, n_bands) reduction(+:holes)
+    {
+        std::vector<float> sum(kBand * W * S), weight(kBand * W * S);
+        #pragma omp for schedule(dynamic)
+        for (long band = 0; band < n_bands; band++) {
+            const long Y0 = band * (long)kBand, Y1 = std::min(H, Y0 + (long)kBand);
+            std::fill(sum.begin(), sum.end(), 0.f);
+            std::fill(weight.begin(), weight.end(), 0.f);
+
+            for (size_t j = 0; j < n; j++) {
+                if (skipped[j]) continue;
+                const Affine &T = transforms[j], &inv = inverse[j];
+                const double h = half[j];
+                // the reference rows whose drops can reach the band, and the frame rows that map to them
+                const double ry0 = (Y0 - h) / s - 0.5, ry1 = (Y1 + h) / s - 0.5;
+                const double rx0 = -1.0, rx1 = (double)task.width;
+                double fy0 = INFINITY, fy1 = -INFINITY, fx0 = INFINITY, fx1 = -INFINITY;
+                for (double rx : {rx0, rx1}) {
+                    for (double ry : {ry0, ry1}) {
+                        fx0 = std::min(fx0, T.a * rx + T.b * ry + T.tx);
+                        fx1 = std::max(fx1, T.a * rx + T.b * ry + T.tx);
+                        fy0 = std::min(fy0, T.c * rx + T.d * ry + T.ty);
+                        fy1 = std::max(fy1, T.c * rx + T.d * ry + T.ty);
+                    }
+                }
+                const long y_begin = std::max(0l, (long)std::floor(fy0) - 1);
+                const long y_end = std::min((long)task.height, (long)std::ceil(fy1) + 2);
+                const long x_begin = std::max(0l, (long)std::floor(fx0) - 1);
+                const long x_end = std::min((long)task.width, (long)std::ceil(fx1) + 2);
+                const io_t *frame = task.data + j * task.wh;
+                const RawInfo &info = task.infos[j];
+
+                for (long y = y_begin; y < y_end; y++) {
+                    for (long x = x_begin; x < x_end; x++) {
+                        // center of the sample in output pixels
+                        const double px = (inv.a * x + inv.b * y + inv.tx + 0.5) * s - 0.5;
+                        const double py = (inv.c * x + inv.d * y + inv.ty + 0.5) * s - 0.5;
+                        const long oy0 = std::max(Y0, (long)std::ceil(py - h - 0.5));
+                        const long oy1 = std::min(Y1 - 1, (long)std::floor(py + h + 0.5));
+                        if (oy0 > oy1) continue;
+                        const long ox0 = std::max(0l, (long)std::ceil(px - h - 0.5));
+                        const long ox1 = std::min(W - 1, (long)std::floor(px + h + 0.5));
+                        if (ox0 > ox1) continue;
+
+                        const int p = (int)((y & 1) * 2 + (x & 1));
+                        const int c = channel(info.cfa[p]);
+                        const float v = (float)std::max<int>((int)sample(task, frame, x, y) - (int)info.black[p], 0);
+                        for (long oy = oy0; oy <= oy1; oy++) {
+                            const double wy = std::min(py + h, oy + 0.5) - std::max(py - h, oy - 0.5);
+                            if (wy <= 0) continue;
+                            float *srow = sum.data() + (oy - Y0) * W * S, *wrow = weight.data() + (oy - Y0) * W * S;
+                            for (long ox = ox0; ox <= ox1; ox++) {
+                                if (S == 1 && out_color[(oy & 1) * 2 + (ox & 1)] != c) continue;
+                                const double wx = std::min(px + h, ox + 0.5) - std::max(px - h, ox - 0.5);
+                                if (wx <= 0) continue;
+                                const size_t o = ox * S + (S == 1 ? 0 : c);
+                                srow[o] += (float)(wx * wy) * v;
+                                wrow[o] += (float)(wx * wy);
+                            }
+                        }
+                    }
+                }
+            }
+
+            // normalize the band, and fill the holes from the nearest sample of the same color of the first frame
+            const io_t *frame = task.data;
+            const RawInfo &info = task.infos[0];
+            const Affine &T = transforms[0];
+            for (long oy = Y0; oy < Y1; oy++) {
+                for (long ox = 0; ox < W; ox++) {
+                    for (int k = 0; k < S; k++) {
+                        const size_t b = ((oy - Y0) * W + ox) * S + k, o = (oy * W + ox) * S + k;
+                        const float w = weight[b];
+                        result.weights[o] = w;
+                        if (w > 0) {
+                            result.data[o] = (io_t)std::min(sum[b] / w + 0.5f, 65535.f);
+                            continue;
+                        }
+                        holes++;
+                        const int c = S == 1 ? out_color[(oy & 1) * 2 + (ox & 1)] : k;
+                        const double rx = (ox + 0.5) / s - 0.5, ry = (oy + 0.5) / s - 0.5;
+                        const double fx = T.a * rx + T.b * ry + T.tx, fy = T.c * rx + T.d * ry + T.ty;
+                        const long bx = std::clamp(std::lround(fx) & ~1l, 0l, (long)task.width - 2);
+                        const long by = std::clamp(std::lround(fy) & ~1l, 0l, (long)task.height - 2);
+                        double best = INFINITY;
+                        for (int p = 0; p < 4; p++) {
+                            const long x = bx + (p & 1), y = by + (p >> 1);
+                            const double d = (x - fx) * (x - fx) + (y - fy) * (y - fy);
+                            if (channel(info.cfa[p]) != c || d >= best) continue;
+                            best = d;
+                            result.data[o] = (io_t)std::max<int>((int)sample(task, frame, x, y) - (int)info.black[p], 0);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    result.holes = holes;
+    result.info.max_val -= *std::max_element(result.info.black, result.info.black + 4);
+    std::fill(result.info.black, result.info.black + 4, 0);
+    return result;
+}
+
+ParserErrors write_drizzle(const std::filesystem::path &out_file, const DrizzleResult &result)
+{
+    DngImage image;
+    image.width = result.width;
+    image.height = result.height;
+    image.samples = result.samples;
+    image.u16 = result.data.data();
+    image.white = result.info.max_val;
+    return write_dng(out_file, result.info, image);
+}
+
+} // namespace r2r
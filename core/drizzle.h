@@ -0,0 +1,58 @@
+/**
+ * Raw2Raw
+ * core/drizzle.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of the drizzle accumulator, which combines frames with sub-pixel offsets into an
+ * image with more pixels than the sensor. Every raw sample of every frame is mapped back to the reference, and dropped
+ * on a finer output grid as a small square (pixfrac of the sample's size), which adds to the output pixels it overlaps
+ * in proportion to the overlap. Since every raw sample has a single color, the weights are kept per color: either on a
+ * new CFA mosaic of the output size, or on the three channels of a linear (demosaiced) output.
+ *
+ * The output is split in bands of rows, and each band is accumulated by a single thread from all of the frames, so the
+ * accumulation needs no atomics or locks.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+#include "warp.h"
+
+namespace r2r {
+
+struct DrizzleParams {
+    double scale {2.0};             // size of the output relative to the sensor, e.g. 1.5 or 2
+    double pixfrac {0.7};           // size of a drop relative to a raw sample
+    bool linear {false};            // write a linear RGB image instead of a CFA mosaic
+};
+
+struct DrizzleResult {
+    size_t width, height;
+    int samples;                    // 1 for a CFA mosaic with the pattern of the reference, 3 for linear RGB
+    std::vector<io_t> data;         // black subtracted, info.max_val is the white level
+    std::vector<float> weights;     // total weight of every output sample, per channel
+    size_t holes;                   // output samples that no drop reached, which are filled from the reference
+    size_t dropped;                 // frames that were skipped, e.g. because their stars did not match
+    RawInfo info;                   // metadata of the reference
+};
+
+/* Estimate the transform of every frame of a task relative to the first one, to sub-pixel precision. GLOBAL uses
+ * phase correlation (a translation), SIMILARITY and AFFINE match the stars of each frame. The frames whose stars cannot
+ * be matched have no transform, and are added to unmatched if it is given. Throws std::invalid_argument for other
+ * alignments.
+ */
+std::vector<Affine> estimate_transforms(const Task &task, Alignment align, std::vector<size_t> *unmatched = nullptr);
+
+/* Drizzle the frames of a task, given the transform from the reference to each frame, leaving out the frames in skip
+ * (e.g. the unmatched ones of estimate_transforms). The holes are filled from the first frame. Throws
+ * std::invalid_argument if the scale or pixfrac is not positive, if there is not one transform per frame, or if the
+ * first frame or a frame that does not exist is skipped.
+ */
+DrizzleResult drizzle(const Task &task, const std::vector<Affine> &transforms, const DrizzleParams &params = {},
+                      const std::vector<size_t> &skip = {});
+
+/* Write the result as a CFA or linear DNG */
+ParserErrors write_drizzle(const std::filesystem::path &out_file, const DrizzleResult &result);
+
+} // namespace r2r
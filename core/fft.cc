@@ -0,0 +1,109 @@
+/**
+ * Raw2Raw
+ * core/fft.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the radix-2 fast Fourier transform.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "fft.h"
+#include <cmath>
+#include <numbers>
+#include <utility>
+
+namespace r2r {
+
+size_t fft_size(size_t n)
+{
+    size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+namespace {
+/* The twiddles of the last size are kept per thread, since the same size is usually transformed many times */
+const cf32 *twiddles(size_t n)
+{
+    thread_local std::vector<cf32> table;
+    if (table.size() != n / 2) {
+        table.resize(n / 2);
+        for (size_t k = 0; k < n / 2; k++) {
+            const double angle = -2.0 * std::numbers::pi * (double)k / (double)n;
+            table[k] = cf32((float)std::cos(angle), (float)std::sin(angle));
+        }
+    }
+    return table.data();
+}
+
+size_t reverse_bits(size_t i, size_t n)
+{
+    size_t r = 0;
+    for (size_t bit = 1; bit < n; bit <<= 1) {
+        r = (r << 1) | (i & 1);
+        i >>= 1;
+    }
+    return r;
+}
+
+/* Transform every column of a row-major array of n rows. Each butterfly combines two whole rows, so the inner loops
+ * run over contiguous memory and are vectorized.
+ */
+void fft_columns(cf32 *data, size_t width, size_t n, bool inverse)
+{
+    for (size_t i = 1; i < n; i++) {
+        const size_t j = reverse_bits(i, n);
+        if (i < j) std::swap_ranges(data + i * width, data + (i + 1) * width, data + j * width);
+    }
+    const cf32 *tw = twiddles(n);
+    for (size_t len = 2; len <= n; len <<= 1) {
+        const size_t half = len / 2, stride = n / len;
+        for (size_t i = 0; i < n; i += len) {
+            for (size_t k = 0; k < half; k++) {
+                const cf32 w = inverse ? std::conj(tw[k * stride]) : tw[k * stride];
+                const float wr = w.real(), wi = w.imag();
+                // std::complex is reinterpretable as two floats, and plain floats vectorize much better
+                float *a = reinterpret_cast<float *>(data + (i + k) * width);
+                float *b = reinterpret_cast<float *>(data + (i + k + half) * width);
+                #pragma omp simd
+                for (size_t x = 0; x < 2 * width; x += 2) {
+                    const float vr = b[x] * wr - b[x + 1] * wi, vi = b[x] * wi + b[x + 1] * wr;
+                    const float ur = a[x], ui = a[x + 1];
+                    a[x] = ur + vr;
+                    a[x + 1] = ui + vi;
+                    b[x] = ur - vr;
+                    b[x + 1] = ui - vi;
+                }
+            }
+        }
+    }
+}
+
+void transpose(const cf32 *in, cf32 *out, size_t width, size_t height)
+{
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            out[x * height + y] = in[y * width + x];
+        }
+    }
+}
+} // anonymous namespace
+
+void fft(cf32 *data, size_t n, bool inverse)
+{
+    fft_columns(data, 1, n, inverse);
+}
+
+void fft2(cf32 *data, size_t width, size_t height, bool inverse)
+{
+    fft_columns(data, width, height, inverse);
+    thread_local std::vector<cf32> scratch;
+    scratch.resize(width * height);
+    transpose(data, scratch.data(), width, height);
+    fft_columns(scratch.data(), height, width, inverse);
+    transpose(scratch.data(), data, height, width);
+}
+
+} // namespace r2r
@@ -0,0 +1,35 @@
+/**
+ * Raw2Raw
+ * core/fft.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of a small radix-2 fast Fourier transform, used by the registration. The
+ * transforms are single threaded, so that many of them can run at the same time on different frames.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+#include <complex>
+
+namespace r2r {
+
+using cf32 = std::complex<float>;
+
+/* Complex product without the checks for infinities and NaNs of std::complex, which are not vectorized */
+inline cf32 cmul(cf32 a, cf32 b)
+{
+    return {a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real()};
+}
+
+/* Smallest power of two that is at least n */
+size_t fft_size(size_t n);
+
+/* In-place transform of n samples, where n is a power of two. The inverse is not normalized by 1 / n. */
+void fft(cf32 *data, size_t n, bool inverse = false);
+
+/* In-place transform of a row-major height x width array, where both are powers of two */
+void fft2(cf32 *data, size_t width, size_t height, bool inverse = false);
+
+} // namespace r2r
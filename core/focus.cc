@@ -0,0 +1,186 @@
+/**
+ * Raw2Raw
+ * core/focus.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the focus stacking reduction.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "focus.h"
+#include "cfa.h"
+#include "stream.h"
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+namespace r2r {
+
+namespace {
+constexpr long kBand = 32;          // rows of 2x2 blocks per band
+
+/* Sharpness of the blocks of rows [b0, b1) of a frame, into pw x (b1 - b0) samples of out. green and lap are scratch
+ * space of the calling thread.
+ */
+void sharpness(const io_t *frame, const RawInfo &info, size_t width, long ph, long radius, long b0, long b1,
+               std::vector<float> &green, std::vector<float> &lap, std::vector<float> &out)
+{
+    const long pw = (long)width / 2;
+    // the Laplacian of the rows within radius of the band, and the green rows next to those
+    const long l0 = std::max(0l, b0 - radius), l1 = std::min(ph, b1 + radius);
+    const long g0 = std::max(0l, l0 - 1), g1 = std::min(ph, l1 + 1);
+    green.resize((g1 - g0) * pw);
+    lap.resize((l1 - l0) * pw);
+    out.resize((b1 - b0) * pw);
+    cfa_green(frame + 2 * g0 * width, info, width, 2 * (g1 - g0), green.data());
+
+    const float norm = 1.f / (float)((2 * radius + 1) * (2 * radius + 1));
+    for (long y = l0; y < l1; y++) {
+        const float *g = green.data() + (y - g0) * pw;
+        const float *up = green.data() + (std::max(y - 1, 0l) - g0) * pw;
+        const float *down = green.data() + (std::min(y + 1, ph - 1) - g0) * pw;
+        float *l = lap.data() + (y - l0) * pw;
+        const auto laplacian = [&](long x, long left, long right) {
+            const float v = 4 * g[x] - g[left] - g[right] - up[x] - down[x];
+            l[x] = v * v;
+        };
+        laplacian(0, 0, std::min(1l, pw - 1));
+        #pragma omp simd
+        for (long x = 1; x < pw - 1; x++) {
+            laplacian(x, x - 1, x + 1);
+        }
+        laplacian(pw - 1, std::max(pw - 2, 0l), pw - 1);
+        // horizontal box sum in place, from a copy of the row
+        float *row = out.data();
+        std::copy(l, l + pw, row);
+        float s = 0;
+        for (long x = -radius; x <= radius; x++) s += row[std::clamp(x, 0l, pw - 1)];
+        for (long x = 0; x < pw; x++) {
+            l[x] = s;
+            s += row[std::min(x + radius + 1, pw - 1)] - row[std::max(x - radius, 0l)];
+        }
+    }
+    for (long y = b0; y < b1; y++) {
+        float *o = out.data() + (y - b0) * pw;
+        std::fill(o, o + pw, 0.f);
+        for (long k = -radius; k <= radius; k++) {
+            const float *l = lap.data() + (std::clamp(y + k, l0, l1 - 1) - l0) * pw;
+            #pragma omp simd
+            for (long x = 0; x < pw; x++) o[x] += l[x];
+        }
+        #pragma omp simd
+        for (long x = 0; x < pw; x++) o[x] *= norm;
+    }
+}
+} // anonymous namespace
+
+FocusResult focus_stack(const std::vector<std::filesystem::path> &files, const FocusParams &params)
+{
+    FrameStream stream(files, params.options);
+    const size_t width = stream.width, height = stream.height, wh = stream.wh;
+    if (width < 2 || height < 2) {
+        throw std::invalid_argument("the frames must have a 2x2 bayer CFA");
+    }
+    const long pw = (long)width / 2, ph = (long)height / 2, n_bands = (ph + kBand - 1) / kBand;
+    const long radius = (long)params.radius;
+    const bool blend = params.blend;
+
+    FocusResult result;
+    result.width = width;
+    result.height = height;
+    result.n_frames = files.size();
+    result.data.resize(wh);
+    result.index.assign(pw * ph, 0);
+    std::vector<float> best(pw * ph, -1.f);
+    std::vector<float> acc(blend ? wh : 0, 0.f), wsum(blend ? pw * ph : 0, 0.f);
+
+    RawInfo info;
+    while (const io_t *frame = stream.next(&info)) {
+        if (!info.bayer) {
+            throw std::invalid_argument("the frames must have a 2x2 bayer CFA");
+        }
+        const u16 j = (u16)stream.index();
+        if (j == 0) {
+            // the samples past the last whole block are only ever taken from the first frame
+            std::copy(frame, frame + wh, result.data.begin());
+        }
+        #pragma omp parallel default(none) shared(frame, info, result, best, acc, wsum, width, pw, ph, n_bands, radius, blend, j)
+        {
+            std::vector<float> green, lap, sharp;
+            #pragma omp for schedule(static)
+            for (long band = 0; band < n_bands; band++) {
+                const long b0 = band * kBand, b1 = std::min(ph, b0 + kBand);
+                sharpness(frame, info, width, ph, radius, b0, b1, green, lap, sharp);
+                for (long y = b0; y < b1; y++) {
+                    const float *s = sharp.data() + (y - b0) * pw;
+                    const io_t *r0 = frame + 2 * y * width, *r1 = r0 + width;
+                    io_t *o0 = result.data.data() + 2 * y * width, *o1 = o0 + width;
+                    for (long x = 0; x < pw; x++) {
+                        const long b = y * pw + x;
+                        if (s[x] > best[b]) {
+                            best[b] = s[x];
+                            result.index[b] = j;
+                            if (!blend) {
+                                o0[2 * x] = r0[2 * x];
+                                o0[2 * x + 1] = r0[2 * x + 1];
+                                o1[2 * x] = r1[2 * x];
+                                o1[2 * x + 1] = r1[2 * x + 1];
+                            }
+                        }
+                    }
+                    if (blend) {
+                        float *a0 = acc.data() + 2 * y * width, *a1 = a0 + width;
+                        float *ws = wsum.data() + y * pw;
+                        #pragma omp simd
+                        for (long x = 0; x < pw; x++) {
+                            // the epsilon turns flat areas, where no frame is sharper, into the mean
+                            const float w = s[x] * s[x] + 1e-6f;
+                            ws[x] += w;
+                            a0[2 * x] += w * r0[2 * x];
+                            a0[2 * x + 1] += w * r0[2 * x + 1];
+                            a1[2 * x] += w * r1[2 * x];
+                            a1[2 * x + 1] += w * r1[2 * x + 1];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (blend) {
+        #pragma omp parallel for default(none) shared(result, acc, wsum, width, pw, ph) schedule(static)
+        for (long y = 0; y < ph; y++) {
+            for (long x = 0; x < pw; x++) {
+                const float inv = 1.f / wsum[y * pw + x];
+                for (long k = 0; k < 4; k++) {
+                    const size_t i = (2 * y + (k >> 1)) * width + 2 * x + (k & 1);
+                    result.data[i] = (io_t)std::min(acc[i] * inv + 0.5f, 65535.f);
+                }
+            }
+        }
+    }
+    return result;
+}
+
+ParserErrors write_index_map(const std::filesystem::path &out_file, const FocusResult &result)
+{
+    std::ofstream out(out_file, std::ios::binary);
+    if (!out.is_open()) {
+        return ParserErrors::CANNOT_OPEN_FILE;
+    }
+    const size_t pw = result.width / 2, ph = result.height / 2;
+    const size_t last = std::max<size_t>(result.n_frames, 2) - 1;
+    out << "P5\n" << pw << " " << ph << "\n255\n";
+    std::vector<u8> row(pw);
+    for (size_t y = 0; y < ph; y++) {
+        for (size_t x = 0; x < pw; x++) {
+            row[x] = (u8)(result.index[y * pw + x] * 255 / last);
+        }
+        out.write(reinterpret_cast<const char *>(row.data()), (std::streamsize)pw);
+    }
+    return out ? ParserErrors::PARSE_SUCCESS : ParserErrors::CANNOT_OPEN_FILE;
+}
+
+} // namespace r2r
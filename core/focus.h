@@ -0,0 +1,43 @@
+/**
+ * Raw2Raw
+ * core/focus.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of the focus stacking reduction, for macro and product shots taken at several focus
+ * distances. Unlike the other reductions, which are statistics of the values of a pixel, it picks every 2x2 CFA block
+ * from the frame where it is the sharpest. The sharpness is the energy of the Laplacian of the green channel over a
+ * small window around the block, so the colors of a block always come from the same frame.
+ *
+ * The frames are streamed, and each one is processed in bands of rows whose green channel, Laplacian and sharpness fit
+ * in the cache of the thread that owns the band.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+
+namespace r2r {
+
+struct FocusParams {
+    size_t radius {2};              // the sharpness is summed over (2 * radius + 1)^2 green samples
+    bool blend {false};             // weight the frames by the square of their sharpness instead of picking one
+    TaskOptions options {};         // only the calibration is used
+};
+
+struct FocusResult {
+    size_t width, height;
+    size_t n_frames;
+    std::vector<io_t> data;         // interleaved
+    std::vector<u16> index;         // the sharpest frame of every 2x2 block, (width / 2) x (height / 2)
+};
+
+/* Focus stack a sequence of files. Throws a ParserErrors if a file cannot be read, and std::invalid_argument if the
+ * frames do not have a 2x2 bayer CFA.
+ */
+FocusResult focus_stack(const std::vector<std::filesystem::path> &files, const FocusParams &params = {});
+
+/* Write the index map as a grayscale PGM, where black is the first frame and white the last one */
+ParserErrors write_index_map(const std::filesystem::path &out_file, const FocusResult &result);
+
+} // namespace r2r
@@ -0,0 +1,253 @@
+/**
+ * Raw2Raw
+ * core/group.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the grouping of files into stacks, and of the cache of their metadata.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "group.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+
+namespace {
+constexpr char kHeaderMagic[4] = {'R', '2', 'R', 'H'};
+constexpr r2r::u32 kHeaderVersion = 1;
+
+template<typename T>
+void write_pod(std::ofstream &out, const T &v)
+{
+    out.write(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+template<typename T>
+void read_pod(std::ifstream &in, T &v)
+{
+    in.read(reinterpret_cast<char *>(&v), sizeof(T));
+}
+
+void write_string(std::ofstream &out, const std::string &s)
+{
+    write_pod(out, (r2r::u32)s.size());
+    out.write(s.data(), (std::streamsize)s.size());
+}
+
+void read_string(std::ifstream &in, std::string &s)
+{
+    r2r::u32 n = 0;
+    read_pod(in, n);
+    s.resize(in ? n : 0);
+    in.read(s.data(), (std::streamsize)s.size());
+}
+
+void write_info(std::ofstream &out, const r2r::RawInfo &info)
+{
+    for (size_t v : {info.width, info.height, info.left_margin, info.top_margin, info.visible_width,
+                     info.visible_height}) {
+        write_pod(out, (r2r::u64)v);
+    }
+    write_pod(out, info.max_val);
+    write_pod(out, info.black);
+    write_pod(out, info.cfa);
+    write_pod(out, info.bayer);
+    write_string(out, info.make);
+    write_string(out, info.model);
+    write_string(out, info.serial);
+    write_pod(out, info.iso);
+    write_pod(out, info.shutter);
+    write_pod(out, info.aperture);
+    write_pod(out, info.temperature);
+    write_pod(out, info.timestamp);
+    write_pod(out, info.shot_order);
+    write_pod(out, info.cam_xyz);
+    write_pod(out, info.cam_mul);
+}
+
+void read_info(std::ifstream &in, r2r::RawInfo &info)
+{
+    for (size_t *v : {&info.width, &info.height, &info.left_margin, &info.top_margin, &info.visible_width,
+                      &info.visible_height}) {
+        r2r::u64 x = 0;
+        read_pod(in, x);
+        *v = x;
+    }
+    read_pod(in, info.max_val);
+    read_pod(in, info.black);
+    read_pod(in, info.cfa);
+    read_pod(in, info.bayer);
+    read_string(in, info.make);
+    read_string(in, info.model);
+    read_string(in, info.serial);
+    read_pod(in, info.iso);
+    read_pod(in, info.shutter);
+    read_pod(in, info.aperture);
+    read_pod(in, info.temperature);
+    read_pod(in, info.timestamp);
+    read_pod(in, info.shot_order);
+    read_pod(in, info.cam_xyz);
+    read_pod(in, info.cam_mul);
+}
+
+/* The size and modification time that tell whether a cached entry is still valid, or false if the file is missing */
+bool stat_file(const std::filesystem::path &file, r2r::u64 &size, r2r::s64 &mtime)
+{
+    std::error_code ec;
+    size = std::filesystem::file_size(file, ec);
+    if (ec) {
+        return false;
+    }
+    mtime = std::filesystem::last_write_time(file, ec).time_since_epoch().count();
+    return !ec;
+}
+} // anonymous namespace
+
+namespace r2r {
+
+std::vector<RawInfo> HeaderCache::get(const std::vector<std::filesystem::path> &files)
+{
+    std::vector<RawInfo> infos(files.size());
+    std::vector<Entry> fresh(files.size());
+    std::vector<u8> missing(files.size(), 0), failed(files.size(), 0);
+    for (size_t i = 0; i < files.size(); i++) {
+        Entry &e = fresh[i];
+        if (!stat_file(files[i], e.size, e.mtime)) {
+            throw ParserErrors::CANNOT_OPEN_FILE;
+        }
+        auto it = entries.find(files[i].string());
+        if (it != entries.end() && it->second.size == e.size && it->second.mtime == e.mtime) {
+            infos[i] = it->second.info;
+        } else {
+            missing[i] = 1;
+        }
+    }
+
+    const size_t n = files.size();
+    #pragma omp parallel for default(none) shared(files, infos, fresh, missing, failed, n) schedule(dynamic)
+    for (size_t i = 0; i < n; i++) {
+        if (!missing[i]) continue;
+        failed[i] = get_info(files[i].string().c_str(), infos[i]) != ParserErrors::PARSE_SUCCESS;
+        fresh[i].info = infos[i];
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (failed[i]) {
+            throw ParserErrors::CANNOT_OPEN_FILE;
+        }
+        if (missing[i]) {
+            entries[files[i].string()] = std::move(fresh[i]);
+        }
+    }
+    return infos;
+}
+
+ParserErrors HeaderCache::save(const std::filesystem::path &file) const
+{
+    std::ofstream out(file, std::ios::binary);
+    if (!out.is_open()) {
+        return ParserErrors::CANNOT_OPEN_FILE;
+    }
+    out.write(kHeaderMagic, sizeof(kHeaderMagic));
+    write_pod(out, kHeaderVersion);
+    write_pod(out, (u64)entries.size());
+    for (const auto &[path, e] : entries) {
+        write_string(out, path);
+        write_pod(out, e.size);
+        write_pod(out, e.mtime);
+        write_info(out, e.info);
+    }
+    return out.good() ? ParserErrors::PARSE_SUCCESS : ParserErrors::CANNOT_OPEN_FILE;
+}
+
+ParserErrors HeaderCache::load(const std::filesystem::path &file)
+{
+    std::ifstream in(file, std::ios::binary);
+    if (!in.is_open()) {
+        return ParserErrors::CANNOT_OPEN_FILE;
+    }
+    char magic[4];
+    u32 version;
+    u64 n = 0;
+    in.read(magic, sizeof(magic));
+    read_pod(in, version);
+    if (!in || memcmp(magic, kHeaderMagic, sizeof(magic)) != 0 || version != kHeaderVersion) {
+        return ParserErrors::CANNOT_UNPACK_FILE;
+    }
+    read_pod(in, n);
+    std::unordered_map<std::string, Entry> loaded;
+    for (u64 i = 0; i < n && in; i++) {
+        std::string path;
+        Entry e;
+        read_string(in, path);
+        read_pod(in, e.size);
+        read_pod(in, e.mtime);
+        read_info(in, e.info);
+        loaded[std::move(path)] = std::move(e);
+    }
+    if (!in) {
+        return ParserErrors::SIZE_MISMATCH;
+    }
+    entries = std::move(loaded);
+    return ParserErrors::PARSE_SUCCESS;
+}
+
+std::vector<std::vector<std::filesystem::path>> group_files(const std::vector<std::filesystem::path> &files,
+                                                            const std::vector<RawInfo> &infos,
+                                                            const GroupParams &params)
+{
+    if (infos.size() != files.size()) {
+        throw std::invalid_argument("group_files: need the metadata of every file");
+    }
+    std::vector<size_t> order(files.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (infos[a].timestamp != infos[b].timestamp) return infos[a].timestamp < infos[b].timestamp;
+        if (infos[a].shot_order != infos[b].shot_order) return infos[a].shot_order < infos[b].shot_order;
+        return files[a] < files[b];
+    });
+    // the exposure of every file in EV, relative to any one of them
+    std::vector<float> ev;
+    if (params.by == Grouping::EXPOSURE && !infos.empty()) {
+        ev = relative_exposures(infos);
+        for (float &e : ev) e = std::log2(e);
+    }
+
+    std::vector<std::vector<std::filesystem::path>> groups;
+    std::vector<size_t> current;
+    auto flush = [&]() {
+        if (current.size() >= std::max<size_t>(params.min_size, 1)) {
+            groups.emplace_back();
+            for (size_t i : current) groups.back().push_back(files[i]);
+        }
+        current.clear();
+    };
+    for (size_t i : order) {
+        bool split = false;
+        if (!current.empty()) {
+            switch (params.by) {
+                case Grouping::TIME_GAP:
+                    split = (double)(infos[i].timestamp - infos[current.back()].timestamp) > params.max_gap;
+                    break;
+                case Grouping::COUNT:
+                    split = current.size() >= std::max<size_t>(params.count, 1);
+                    break;
+                case Grouping::EXPOSURE:
+                    split = std::any_of(current.begin(), current.end(), [&](size_t j) {
+                        return std::abs(ev[i] - ev[j]) <= params.tolerance;
+                    });
+                    break;
+            }
+        }
+        if (split) flush();
+        current.push_back(i);
+    }
+    flush();
+    return groups;
+}
+
+} // namespace r2r
@@ -0,0 +1,65 @@
+/**
+ * Raw2Raw
+ * core/group.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definitions of the grouping of a long sequence of files (a bracketed timelapse, or many bursts
+ * shot one after another) into the stacks that are reduced on their own, e.g. by run_batch (see core/batch.h).
+ *
+ * The files are put in order of capture, and split where the time between two frames is larger than a gap, every count
+ * frames, or where the exposure pattern of a bracket starts over. Only the metadata is read, and the metadata of the
+ * files can be kept in a HeaderCache file, so grouping the same directory again does not open any file that did not
+ * change.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+#include <unordered_map>
+
+namespace r2r {
+
+enum class Grouping {
+    TIME_GAP = 0,       // a new group after a pause of more than max_gap seconds
+    COUNT,              // groups of count consecutive frames, like the brackets of a camera set to count shots
+    EXPOSURE            // a new group when an exposure of the current group comes again
+};
+
+struct GroupParams {
+    Grouping by {Grouping::TIME_GAP};
+    double max_gap {2.0};           // seconds, TIME_GAP
+    size_t count {3};               // COUNT
+    float tolerance {1.f / 6};      // EV within which two exposures are the same, EXPOSURE
+    size_t min_size {2};            // smaller groups are dropped
+};
+
+/* The metadata of raw files, by path, size and modification time */
+class HeaderCache {
+public:
+    /* The metadata of the files, reading the files that are not cached (or changed since) in parallel. Throws
+     * ParserErrors::CANNOT_OPEN_FILE if a file cannot be read.
+     */
+    std::vector<RawInfo> get(const std::vector<std::filesystem::path> &files);
+
+    ParserErrors save(const std::filesystem::path &file) const;
+    ParserErrors load(const std::filesystem::path &file);
+    size_t size() const { return entries.size(); }
+
+private:
+    struct Entry {
+        u64 size;
+        s64 mtime;
+        RawInfo info;
+    };
+    std::unordered_map<std::string, Entry> entries;
+};
+
+/* Group files in order of capture (the timestamp, then the shot order and the name). The infos are the metadata of the
+ * files, in the same order, or std::invalid_argument is thrown.
+ */
+std::vector<std::vector<std::filesystem::path>> group_files(const std::vector<std::filesystem::path> &files,
+                                                            const std::vector<RawInfo> &infos,
+                                                            const GroupParams &params);
+
+} // namespace r2r
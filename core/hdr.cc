@@ -0,0 +1,95 @@
+/**
+ * Raw2Raw
+ * core/hdr.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the streaming raw domain HDR merge.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "hdr.h"
+#include "dng.h"
+#include "stream.h"
+#include <algorithm>
+#include <cmath>
+
+namespace r2r {
+
+HdrResult hdr_merge(const std::vector<std::filesystem::path> &files, const HdrParams &params)
+{
+    // the headers are cheap to read, and we need every exposure to know which frame is the shortest
+    std::vector<RawInfo> infos(files.size());
+    for (size_t j = 0; j < files.size(); j++) {
+        auto e = get_info(files[j].string().c_str(), infos[j]);
+        if (e != ParserErrors::PARSE_SUCCESS) throw e;
+    }
+    std::vector<float> ev = relative_exposures(infos);
+    const size_t shortest = std::min_element(ev.begin(), ev.end()) - ev.begin();
+    for (float &e : ev) {
+        e /= ev[shortest];
+    }
+
+    FrameStream stream(files, params.options);
+    HdrResult hdr;
+    hdr.width = stream.width;
+    hdr.height = stream.height;
+    hdr.info = infos[shortest];
+    std::vector<float> sorted_ev = ev;
+    std::nth_element(sorted_ev.begin(), sorted_ev.begin() + sorted_ev.size() / 2, sorted_ev.end());
+    hdr.baseline_exposure = std::log2(sorted_ev[sorted_ev.size() / 2]);
+
+    const size_t width = stream.width, height = stream.height, wh = stream.wh;
+    std::vector<float> sum(wh, 0.f), wsum(wh, 0.f);
+    const float read_var = params.read_noise * params.read_noise;
+    const float knee = params.knee, clip = params.clip;
+
+    RawInfo info;
+    while (const io_t *frame = stream.next(&info)) {
+        const size_t j = stream.index();
+        const float e = ev[j];
+        // samples of the shortest exposure always keep a tiny weight, so that pixels that are clipped in every frame
+        // still end up at the clipping point instead of zero
+        const float floor = j == shortest ? 1e-12f : 0.f;
+        #pragma omp parallel for default(none) shared(frame, info, sum, wsum, e, floor, width, height, read_var, knee, clip) schedule(static)
+        for (size_t r = 0; r < height; r++) {
+            const float black[2] = {(float)info.black[(r & 1) * 2], (float)info.black[(r & 1) * 2 + 1]};
+            const float white[2] = {(float)info.max_val - black[0], (float)info.max_val - black[1]};
+            for (size_t c = 0; c < width; c++) {
+                const size_t i = r * width + c;
+                const float v = std::max((float)frame[i] - black[c & 1], 0.f);
+                const float sat = std::clamp((clip - v / white[c & 1]) / (clip - knee), 0.f, 1.f);
+                // radiance is v / e, and its variance is (v + read_var) / e^2
+                const float w = std::max(sat * e * e / (v + read_var), floor);
+                sum[i] += w * (v / e);
+                wsum[i] += w;
+            }
+        }
+    }
+
+    // normalize so that 1 is the white level of the shortest exposure
+    const RawInfo &ref = hdr.info;
+    hdr.data.resize(wh);
+    #pragma omp parallel for default(none) shared(hdr, sum, wsum, ref, width, height) schedule(static)
+    for (size_t r = 0; r < height; r++) {
+        for (size_t c = 0; c < width; c++) {
+            const size_t i = r * width + c;
+            const float white = (float)ref.max_val - (float)ref.black[(r & 1) * 2 + (c & 1)];
+            hdr.data[i] = wsum[i] > 0 ? sum[i] / wsum[i] / white : 0.f;
+        }
+    }
+    return hdr;
+}
+
+ParserErrors write_hdr(const std::filesystem::path &out_file, const HdrResult &hdr)
+{
+    DngImage image;
+    image.width = hdr.width;
+    image.height = hdr.height;
+    image.f32 = hdr.data.data();
+    image.baseline_exposure = hdr.baseline_exposure;
+    return write_dng(out_file, hdr.info, image);
+}
+
+} // namespace r2r
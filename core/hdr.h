@@ -0,0 +1,41 @@
+/**
+ * Raw2Raw
+ * core/hdr.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definitions of the raw domain HDR merge, which merges a set of exposure brackets into a single
+ * floating point CFA image. Each sample is converted to scene radiance using the exposure from the EXIF, and weighted
+ * by its inverse noise variance (shot noise and read noise) and by how far it is from clipping.
+ *
+ * The frames are streamed one at a time, so only two frames of raw data and two float accumulators are ever in memory,
+ * no matter how many brackets there are.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+
+namespace r2r {
+
+struct HdrParams {
+    float read_noise {4.f};         // standard deviation of the read noise, in DN
+    float knee {0.9f};              // fraction of the white level where the weight of a sample starts to drop
+    float clip {0.98f};             // fraction of the white level where the weight of a sample reaches zero
+    TaskOptions options {};         // only the calibration is used
+};
+
+struct HdrResult {
+    size_t width, height;
+    std::vector<float> data;        // black subtracted, 1 is the white level of the shortest exposure
+    RawInfo info;                   // metadata of the shortest exposure
+    double baseline_exposure;       // EV from the shortest exposure to the median exposure
+};
+
+/* Merge exposure brackets. Throws a ParserErrors if a file cannot be read. */
+HdrResult hdr_merge(const std::vector<std::filesystem::path> &files, const HdrParams &params = {});
+
+/* Write the merged image as a floating point DNG */
+ParserErrors write_hdr(const std::filesystem::path &out_file, const HdrResult &hdr);
+
+} // namespace r2r
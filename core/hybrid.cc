@@ -0,0 +1,122 @@
+/**
+ * Raw2Raw
+ * core/hybrid.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the motion-adaptive reduction.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "hybrid.h"
+#include "cfa.h"
+#include "progress.h"
+#include <algorithm>
+#include <cmath>
+
+namespace r2r {
+
+Buffer<io_t> p_hybrid(const Task &task, const HybridParams &params, HybridStats *stats)
+{
+    // in the planar layout, the four planes of a frame are stacked into one image of half the width
+    const size_t width = task.layout == Layout::CFA_PLANES ? task.width / 2 : task.width;
+    const size_t height = task.wh / width, n = task.n_images;
+    const size_t T = std::max<size_t>(params.tile, 1);
+    const size_t tiles_x = (width + T - 1) / T, tiles_y = (height + T - 1) / T, n_tiles = tiles_x * tiles_y;
+    const float shot = params.shot_noise, read2 = params.read_noise * params.read_noise;
+    const float th2 = params.threshold * params.threshold;
+    const u32 *black = task.infos[0].black;
+
+    Buffer<io_t> out(task.wh);
+    io_t *ans = out.get();
+    size_t moving = 0;
+    #pragma omp parallel default(none) shared(task, params, ans, width, height, n, T, tiles_x, n_tiles, shot, read2, \
+                                              th2, black) reduction(+:moving)
+    {
+        std::vector<interm_t> sum(T * T);
+        std::vector<float> mean(T * T), limit(T * T), pedestal(T * T);
+        std::vector<io_t> buf(n);
+        #pragma omp for schedule(dynamic)
+        for (size_t t = 0; t < n_tiles; t++) {
+            if (cancelled(task.progress)) continue;
+            const size_t x0 = (t % tiles_x) * T, y0 = (t / tiles_x) * T;
+            const size_t tw = std::min(T, width - x0), th = std::min(T, height - y0);
+
+            // cheap pass: the sums, and the distance from the mean that the noise explains
+            std::fill(sum.begin(), sum.end(), 0);
+            for (size_t j = 0; j < n; j++) {
+                for (size_t y = 0; y < th; y++) {
+                    const io_t *row = task.data + j * task.wh + (y0 + y) * width + x0;
+                    interm_t *s = sum.data() + y * T;
+                    #pragma omp simd
+                    for (size_t x = 0; x < tw; x++) s[x] += row[x];
+                }
+            }
+            // the shot noise grows with the signal above the black level of the CFA position of the sample
+            for (size_t y = 0; y < th; y++) {
+                for (size_t x = 0; x < tw; x++) {
+                    pedestal[y * T + x] = (float)black[cfa_position(task, (y0 + y) * width + x0 + x)];
+                }
+                #pragma omp simd
+                for (size_t x = 0; x < tw; x++) {
+                    const float m = (float)sum[y * T + x] / (float)n;
+                    mean[y * T + x] = m;
+                    limit[y * T + x] = th2 * (shot * std::max(m - pedestal[y * T + x], 0.f) + read2);
+                }
+            }
+            size_t outliers = 0;
+            for (size_t j = 0; j < n && outliers < params.min_outliers; j++) {
+                for (size_t y = 0; y < th; y++) {
+                    const io_t *row = task.data + j * task.wh + (y0 + y) * width + x0;
+                    const float *m = mean.data() + y * T, *l = limit.data() + y * T;
+                    #pragma omp simd reduction(+:outliers)
+                    for (size_t x = 0; x < tw; x++) {
+                        const float d = (float)row[x] - m[x];
+                        outliers += d * d > l[x];
+                    }
+                }
+            }
+
+            const bool robust = outliers >= std::max<size_t>(params.min_outliers, 1);
+            moving += robust;
+            for (size_t y = 0; y < th; y++) {
+                io_t *out = ans + (y0 + y) * width + x0;
+                if (!robust) {
+                    for (size_t x = 0; x < tw; x++) out[x] = (io_t)(sum[y * T + x] / n);
+                    continue;
+                }
+                for (size_t x = 0; x < tw; x++) {
+                    const size_t i = (y0 + y) * width + x0 + x;
+                    for (size_t j = 0; j < n; j++) buf[j] = task.data[j * task.wh + i];
+                    std::nth_element(buf.begin(), buf.begin() + n / 2, buf.end());
+                    const io_t median = buf[n / 2];
+                    if (!params.clip) {
+                        out[x] = median;
+                        continue;
+                    }
+                    // mean of the samples that the noise at the median explains
+                    const float l = th2 * (shot * std::max((float)median - pedestal[y * T + x], 0.f) + read2);
+                    interm_t s = 0, count = 0;
+                    for (size_t j = 0; j < n; j++) {
+                        const float d = (float)buf[j] - (float)median;
+                        if (d * d <= l) {
+                            s += buf[j];
+                            count++;
+                        }
+                    }
+                    out[x] = (io_t)((s + count / 2) / count);
+                }
+            }
+            advance(task.progress, tw * th);
+        }
+    }
+
+    if (stats) {
+        stats->moving_tiles = moving;
+        stats->static_tiles = n_tiles - moving;
+    }
+    return out;
+}
+
+} // namespace r2r
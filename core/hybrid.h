@@ -0,0 +1,45 @@
+/**
+ * Raw2Raw
+ * core/hybrid.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of the motion-adaptive reduction. Most of a typical crowd removal stack is static,
+ * where the median only costs time over the mean. The frame is cut in tiles, and each tile first gets a cheap pass
+ * that sums its samples and counts the samples that are further from the mean than the noise allows. Only the tiles
+ * where something moved pay for the robust estimator (the median, or a mean clipped around it), and the others take
+ * the mean that the first pass already has.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+
+namespace r2r {
+
+struct HybridParams {
+    size_t tile {32};               // tile size in samples of the task's layout
+    float shot_noise {1.f};         // variance of the noise in DN^2 per DN of signal above the black level
+    float read_noise {4.f};         // standard deviation of the read noise, in DN
+    float threshold {6.f};          // distance from the mean, in standard deviations of the noise, that is motion
+    size_t min_outliers {4};        // samples of a tile past the threshold that make it a moving tile
+    bool clip {false};              // in moving tiles, take the mean of the samples within threshold of the median
+};
+
+struct HybridStats {
+    size_t static_tiles {0};
+    size_t moving_tiles {0};
+
+    double moving_fraction() const
+    {
+        const size_t n = static_tiles + moving_tiles;
+        return n ? (double)moving_tiles / (double)n : 0.0;
+    }
+};
+
+/* Mean in the static tiles, median (or clipped mean) in the moving ones. The output is in the same layout as the task,
+ * like the other p_ functions, and the number of tiles that took each path is written to stats if it is given.
+ */
+Buffer<io_t> p_hybrid(const Task &task, const HybridParams &params = {}, HybridStats *stats = nullptr);
+
+} // namespace r2r
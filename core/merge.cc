@@ -0,0 +1,123 @@
+/**
+ * Raw2Raw
+ * core/merge.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the Fourier domain burst merge.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "merge.h"
+#include "cfa.h"
+#include "fft.h"
+#include "stream.h"
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+#include <stdexcept>
+
+namespace r2r {
+
+Buffer<io_t> fourier_merge(const std::vector<std::filesystem::path> &files, const FourierMergeParams &params)
+{
+    const size_t ref = std::min(params.reference, files.size() - 1);
+    // the reference is streamed first, so that its spectra are ready for every other frame
+    std::vector<std::filesystem::path> order = {files[ref]};
+    for (size_t j = 0; j < files.size(); j++) {
+        if (j != ref) order.push_back(files[j]);
+    }
+    FrameStream stream(order, params.options);
+    const size_t width = stream.width, height = stream.height, wh = stream.wh;
+    if (width % 2 || height % 2) {
+        throw std::invalid_argument("the frames must have a 2x2 bayer CFA");
+    }
+
+    // tiles of T samples overlap by half, starting half a tile before the plane so that every sample is covered by
+    // exactly 2 x 2 tiles. The sin^2 window of the overlap add then sums to one everywhere.
+    const long T = (long)fft_size(std::max<size_t>(params.tile, 2)), half = T / 2, TT = T * T;
+    const long pw = (long)width / 2, ph = (long)height / 2, plane = pw * ph;
+    const long nx = (pw + half - 1) / half + 1, ny = (ph + half - 1) / half + 1, n_tiles = 4 * nx * ny;
+    std::vector<float> window(T);
+    for (long i = 0; i < T; i++) {
+        const double s = std::sin(std::numbers::pi * (i + 0.5) / (double)T);
+        window[i] = (float)(s * s);
+    }
+
+    std::vector<cf32> ref_spec(n_tiles * TT);
+    std::vector<float> acc(wh, 0.f);
+    std::vector<io_t> planes(wh);
+    const float c = params.strength, shot = params.shot_noise, read2 = params.read_noise * params.read_noise;
+
+    RawInfo info;
+    while (const io_t *frame = stream.next(&info)) {
+        if (!info.bayer) {
+            throw std::invalid_argument("the frames must have a 2x2 bayer CFA");
+        }
+        const bool is_ref = stream.index() == 0;
+        cfa_split(frame, planes.data(), width, height);
+
+        // the tiles of one parity do not overlap, so they can be accumulated in parallel
+        for (long parity = 0; parity < 4; parity++) {
+            #pragma omp parallel default(none) shared(planes, ref_spec, acc, window, info, is_ref, parity, T, half, TT, pw, ph, plane, nx, ny, n_tiles, c, shot, read2)
+            {
+                std::vector<cf32> tile(TT);
+                #pragma omp for schedule(static)
+                for (long t = 0; t < n_tiles; t++) {
+                    const long p = t / (nx * ny), tx = t % nx, ty = (t / nx) % ny;
+                    if ((tx & 1) + 2 * (ty & 1) != parity) continue;
+                    const long x0 = tx * half - half, y0 = ty * half - half;
+                    const io_t *src = planes.data() + p * plane;
+                    float *dst = acc.data() + p * plane;
+                    cf32 *spec = ref_spec.data() + t * TT;
+
+                    for (long y = 0; y < T; y++) {
+                        const io_t *row = src + std::clamp(y0 + y, 0L, ph - 1) * pw;
+                        for (long x = 0; x < T; x++) {
+                            tile[y * T + x] = (float)row[std::clamp(x0 + x, 0L, pw - 1)];
+                        }
+                    }
+                    if (is_ref) {
+                        std::copy(tile.begin(), tile.end(), spec);
+                        fft2(spec, T, T);
+                    } else {
+                        fft2(tile.data(), T, T);
+                        // expected noise power of a frequency of the difference of two frames, from the level of the
+                        // reference tile (its DC term)
+                        const float mean = spec[0].real() / (float)TT - (float)info.black[p];
+                        const float noise = 2.f * (shot * std::max(mean, 0.f) + read2) * (float)TT;
+                        #pragma omp simd
+                        for (long k = 0; k < TT; k++) {
+                            const cf32 d = spec[k] - tile[k];
+                            const float d2 = std::norm(d);
+                            const float a = d2 / (d2 + c * noise);
+                            tile[k] += a * d;
+                        }
+                        fft2(tile.data(), T, T, true);
+                    }
+
+                    // the inverse transform is not normalized
+                    const float norm = is_ref ? 1.f : 1.f / (float)TT;
+                    for (long y = std::max(0L, -y0); y < T && y0 + y < ph; y++) {
+                        float *out = dst + (y0 + y) * pw;
+                        for (long x = std::max(0L, -x0); x < T && x0 + x < pw; x++) {
+                            out[x0 + x] += window[y] * window[x] * norm * tile[y * T + x].real();
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    const float inv = 1.f / (float)stream.size(), limit = (float)stream.max_val;
+    #pragma omp parallel for default(none) shared(planes, acc, inv, limit, wh) schedule(static)
+    for (size_t i = 0; i < wh; i++) {
+        planes[i] = (io_t)std::clamp(std::round(acc[i] * inv), 0.f, limit);
+    }
+    Buffer<io_t> ans(wh);
+    cfa_merge(planes.data(), ans.get(), width, height);
+    return ans;
+}
+
+} // namespace r2r
@@ -0,0 +1,36 @@
+/**
+ * Raw2Raw
+ * core/merge.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of the Fourier domain burst merge, after the merge of HDR+ (Hasinoff et al. 2016).
+ * Each CFA plane is cut in overlapping tiles, and every frequency of every tile of a frame is blended with the same
+ * frequency of the reference frame: where the frame agrees with the reference up to the expected noise it is averaged
+ * in, and where it differs (motion) the reference is used instead. This removes the ghosts of the mean at a fraction of
+ * the cost of the median.
+ *
+ * The frames are streamed, so only the spectra of the reference tiles and one accumulated frame are kept in memory.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+
+namespace r2r {
+
+struct FourierMergeParams {
+    size_t reference {0};           // index of the frame the others are merged into
+    size_t tile {16};               // tile size in samples of a CFA plane, a power of two
+    float shot_noise {1.f};         // variance of the noise in DN^2 per DN of signal above the black level
+    float read_noise {4.f};         // standard deviation of the read noise, in DN
+    float strength {8.f};           // how much a frequency may differ from the reference before it is rejected
+    TaskOptions options {};         // only the calibration is used
+};
+
+/* Merge a burst into the reference frame. The result is a frame in the interleaved layout. Throws a ParserErrors if a
+ * file cannot be read, and std::invalid_argument if the frames do not have a 2x2 bayer CFA.
+ */
+Buffer<io_t> fourier_merge(const std::vector<std::filesystem::path> &files, const FourierMergeParams &params = {});
+
+} // namespace r2r
@@ -11,21 +11,44 @@
  * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
  */
 #include "raw2raw.h"
+#include "cfa.h"
+#include "hybrid.h"
+#include "pipeline.h"
+#include "progress.h"
+#include "select.h"
 #include <algorithm>
 #include <cmath>
+#include <stdexcept>
+
+namespace {
+constexpr size_t kTile = 4096;      // pixels between two checks of the progress context
+
+/* Call f(begin, end) for the tiles of the pixels of a task on the OpenMP threads, and skip the tiles that are left once
+ * the task is cancelled
+ */
+template<typename F>
+void for_tiles(const r2r::Task &task, F &&f)
+{
+    const size_t n_tiles = (task.wh + kTile - 1) / kTile;
+    #pragma omp parallel for default(none) shared(task, f, n_tiles) schedule(static)
+    for (size_t t = 0; t < n_tiles; t++) {
+        if (r2r::cancelled(task.progress)) continue;
+        const size_t begin = t * kTile, end = std::min(task.wh, begin + kTile);
+        f(begin, end);
+        r2r::advance(task.progress, end - begin);
+    }
+}
+} // anonymous namespace
 
 namespace r2r {
-io_t *p_mean(const Task &task)
+Buffer<io_t> p_mean(const Task &task)
 {
-    io_t *ans = new io_t[task.wh];
-    #pragma omp parallel default(none) shared(task, ans)
-    {
+    Buffer<io_t> ans(task.wh);
+    for_tiles(task, [&task, &ans](size_t begin, size_t end) {
         interm_t s0, s1, s2, s3;
-
-        #pragma omp for schedule(static)
-        for (int i = 0; i < task.wh; i+=4) {
+        for (size_t i = begin; i < end; i += 4) {
             s0 = s1 = s2 = s3 = 0;
-            for (int j = 0; j < task.n_images; j++) {
+            for (size_t j = 0; j < task.n_images; j++) {
                 s0 += task.data[j * task.wh + i + 0];
                 s1 += task.data[j * task.wh + i + 1];
                 s2 += task.data[j * task.wh + i + 2];
@@ -36,144 +59,259 @@ io_t *p_mean(const Task &task)
             ans[i + 2] = s2 / task.n_images;
             ans[i + 3] = s3 / task.n_images;
         }
-    } 
+    });
     return ans;
 }
 
-io_t *p_median(const Task &task)
+Buffer<io_t> p_median(const Task &task)
 {
-    io_t *ans = new io_t[task.wh];
-    #pragma omp parallel default(none) shared(task, ans)
-    {
-        io_t *buf = new io_t[task.n_images];
-        #pragma omp for schedule(static)
-        for (int i = 0; i < task.wh; i++) {
-            for (int j = 0; j < task.n_images; j++) {
-                buf[j] = task.data[j * task.wh + i];
+    return rank_reduce(task, RankStatistic(pReduction::MEDIAN, {}, task.n_images));
+}
+
+Buffer<io_t> p_percentile(const Task &task, float percentile)
+{
+    ReductionParams params;
+    params.percentile = percentile;
+    return rank_reduce(task, RankStatistic(pReduction::PERCENTILE, params, task.n_images));
+}
+
+Buffer<io_t> p_trimmed_mean(const Task &task, float trim)
+{
+    ReductionParams params;
+    params.trim = trim;
+    return rank_reduce(task, RankStatistic(pReduction::TRIMMED_MEAN, params, task.n_images));
+}
+
+Buffer<io_t> p_mode(const Task &task, u32 bin)
+{
+    ReductionParams params;
+    params.mode_bin = bin;
+    return rank_reduce(task, RankStatistic(pReduction::MODE, params, task.n_images));
+}
+
+Buffer<io_t> p_clipped_mean(const Task &task, float kappa)
+{
+    ReductionParams params;
+    params.kappa = kappa;
+    return rank_reduce(task, RankStatistic(pReduction::CLIPPED_MEAN, params, task.n_images));
+}
+
+Buffer<io_t> p_summation(const Task &task)
+{
+    interm_t limit = task.max_val;
+    Buffer<io_t> ans(task.wh);
+    for_tiles(task, [&task, &ans, limit](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            interm_t s = 0;
+            for (size_t j = 0; j < task.n_images; j++) {
+                s += task.data[j * task.wh + i];
             }
-            std::nth_element(buf, buf + task.n_images / 2, buf + task.n_images);
-            ans[i] = buf[task.n_images / 2];
+            ans[i] = std::min(s, limit);
         }
-        delete[] buf;
-    }
+    });
     return ans;
 }
 
-io_t *p_summation(const Task &task)
+Buffer<io_t> p_maximum(const Task &task)
 {
-    interm_t limit = task.max_val;
-    io_t *ans = new io_t[task.wh];
-    #pragma omp parallel for default(none) shared(task, ans, limit) schedule(static)
-    for (int i = 0; i < task.wh; i++) {
-        interm_t s = 0;
-        for (int j = 0; j < task.n_images; j++) {
-            s += task.data[j * task.wh + i];
+    Buffer<io_t> ans(task.wh);
+    for_tiles(task, [&task, &ans](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            io_t M = 0;
+            for (size_t j = 0; j < task.n_images; j++) {
+                M = std::max(M, task.data[j * task.wh + i]);
+            }
+            ans[i] = M;
         }
-        ans[i] = std::min(s, limit);
-    }
+    });
     return ans;
 }
 
-io_t *p_maximum(const Task &task)
+Buffer<io_t> p_minimum(const Task &task)
 {
-    io_t *ans = new io_t[task.wh];
-    #pragma omp parallel for default(none) shared(task, ans) schedule(static)
-    for (int i = 0; i < task.wh; i++) {
-        io_t M = 0;
-        for (int j = 0; j < task.n_images; j++) {
-            M = std::max(M, task.data[j * task.wh + i]);
+    Buffer<io_t> ans(task.wh);
+    for_tiles(task, [&task, &ans](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            io_t m = 0xffff;
+            for (size_t j = 0; j < task.n_images; j++) {
+                m = std::min(m, task.data[j * task.wh + i]);
+            }
+            ans[i] = m;
         }
-        ans[i] = M;
-    }
+    });
     return ans;
 }
 
-io_t *p_minimum(const Task &task)
+Buffer<io_t> p_range(const Task &task)
 {
-    io_t *ans = new io_t[task.wh];
-    #pragma omp parallel for default(none) shared(task, ans) schedule(static)
-    for (int i = 0; i < task.wh; i++) {
-        io_t m = 0xffff;
-        for (int j = 0; j < task.n_images; j++) {
-            m = std::min(m, task.data[j * task.wh + i]);
+    Buffer<io_t> ans(task.wh);
+    for_tiles(task, [&task, &ans](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            io_t m = 0xffff, M = 0;
+            for (size_t j = 0; j < task.n_images; j++) {
+                m = std::min(m, task.data[j * task.wh + i]);
+                M = std::max(M, task.data[j * task.wh + i]);
+            }
+            ans[i] = M - m;
         }
-        ans[i] = m;
-    }
+    });
     return ans;
 }
 
-io_t *p_range(const Task &task)
+Buffer<io_t> p_variance(const Task &task)
 {
-    io_t *ans = new io_t[task.wh];
-    #pragma omp parallel for default(none) shared(task, ans) schedule(static)
-    for (int i = 0; i < task.wh; i++) {
-        io_t m = 0xffff, M = 0;
-        for (int j = 0; j < task.n_images; j++) {
-            m = std::min(m, task.data[j * task.wh + i]);
-            M = std::max(M, task.data[j * task.wh + i]);
+    Buffer<io_t> mean = p_mean(task);
+    Buffer<io_t> ans(task.wh);
+    for_tiles(task, [&task, &mean, &ans](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            interm_t s = 0;
+            for (size_t j = 0; j < task.n_images; j++) {
+                auto delta = task.data[j * task.wh + i] - mean[i];
+                s += delta * delta;
+            }
+            ans[i] = std::min<interm_t>(s / (task.n_images - 1), task.max_val);
         }
-        ans[i] = M - m;
-    }
+    });
     return ans;
 }
 
-io_t *p_variance(const Task &task)
+Buffer<io_t> p_standard_deviation(const Task &task)
 {
-    io_t *mean = p_mean(task);
-    io_t *ans = new io_t[task.wh];
-    #pragma omp parallel for default(none) shared(task, mean, ans) schedule(static)
-    for (int i = 0; i < task.wh; i++) {
-        interm_t s = 0;
-        for (int j = 0; j < task.n_images; j++) {
-            auto delta = task.data[j * task.wh + i] - mean[i];
-            s += delta * delta;
+    Buffer<io_t> mean = p_mean(task);
+    Buffer<io_t> ans(task.wh);
+    for_tiles(task, [&task, &mean, &ans](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            interm_t s = 0;
+            for (size_t j = 0; j < task.n_images; j++) {
+                auto delta = task.data[j * task.wh + i] - mean[i];
+                s += delta * delta;
+            }
+            ans[i] = std::min<interm_t>((interm_t)std::sqrt(s / (task.n_images - 1)), task.max_val);
         }
-        ans[i] = std::min<interm_t>(s / (task.n_images - 1), task.max_val);
-    }
-    delete[] mean;
+    });
     return ans;
 }
 
-io_t *p_standard_deviation(const Task &task)
+
+std::vector<float> relative_exposures(const std::vector<RawInfo> &infos)
+{
+    auto valid = [&infos](auto field) {
+        return std::all_of(infos.begin(), infos.end(), [field](const RawInfo &info) { return info.*field > 0; });
+    };
+    const bool shutter = valid(&RawInfo::shutter), iso = valid(&RawInfo::iso), aperture = valid(&RawInfo::aperture);
+    std::vector<float> ev(infos.size(), 1.f);
+    for (size_t j = 0; j < infos.size(); j++) {
+        const RawInfo &a = infos[j], &b = infos[0];
+        if (shutter) ev[j] *= a.shutter / b.shutter;
+        if (iso) ev[j] *= a.iso / b.iso;
+        if (aperture) ev[j] *= (b.aperture * b.aperture) / (a.aperture * a.aperture);
+    }
+    return ev;
+}
+
+Buffer<io_t> p_weighted_mean(const Task &task, const std::vector<float> &weights, const std::vector<float> &scales)
 {
-    io_t *mean = p_mean(task);
-    io_t *ans = new io_t[task.wh];
-    #pragma omp parallel for default(none) shared(task, mean, ans) schedule(static)
-    for (int i = 0; i < task.wh; i++) {
-        interm_t s = 0;
-        for (int j = 0; j < task.n_images; j++) {
-            auto delta = task.data[j * task.wh + i] - mean[i];
-            s += delta * delta;
+    if (weights.size() != task.n_images || scales.size() != task.n_images) {
+        throw std::invalid_argument("p_weighted_mean: need a weight and a scale for every frame");
+    }
+    constexpr size_t tile = 4096;
+    const size_t n_tiles = (task.wh + tile - 1) / tile;
+    // leave some headroom, since the clipping point of a camera is not always exactly at max_val
+    const io_t clip = (io_t)(task.max_val * 0.98);
+    Buffer<io_t> ans(task.wh);
+    #pragma omp parallel default(none) shared(task, weights, scales, ans, n_tiles, clip)
+    {
+        std::vector<float> sum(tile), wsum(tile), fallback(tile);
+        std::vector<u8> pos(tile);
+        #pragma omp for schedule(static)
+        for (size_t t = 0; t < n_tiles; t++) {
+            if (cancelled(task.progress)) continue;
+            const size_t begin = t * tile, end = std::min(task.wh, begin + tile);
+            for (size_t i = begin; i < end; i++) {
+                pos[i - begin] = (u8)cfa_position(task, i);
+                sum[i - begin] = wsum[i - begin] = fallback[i - begin] = 0;
+            }
+            for (size_t j = 0; j < task.n_images; j++) {
+                const io_t *src = task.data + j * task.wh;
+                const u32 *black = task.infos[j].black;
+                const float w = weights[j], s = scales[j];
+                for (size_t i = begin; i < end; i++) {
+                    float v = ((float)src[i] - (float)black[pos[i - begin]]) * s;
+                    float wi = src[i] < clip ? w : 0.f;
+                    sum[i - begin] += wi * v;
+                    wsum[i - begin] += wi;
+                    fallback[i - begin] = std::max(fallback[i - begin], v);
+                }
+            }
+            const u32 *black = task.infos[0].black;
+            for (size_t i = begin; i < end; i++) {
+                float v = wsum[i - begin] > 0 ? sum[i - begin] / wsum[i - begin] : fallback[i - begin];
+                v += (float)black[pos[i - begin]];
+                ans[i] = (io_t)std::clamp(v + 0.5f, 0.f, (float)task.max_val);
+            }
+            advance(task.progress, end - begin);
         }
-        ans[i] = std::min<interm_t>((interm_t)std::sqrt(s / (task.n_images - 1)), task.max_val);
     }
-    delete[] mean;
     return ans;
 }
 
+Buffer<io_t> p_weighted_mean(const Task &task)
+{
+    std::vector<float> ev = relative_exposures(task.infos), scales(task.n_images);
+    for (size_t j = 0; j < task.n_images; j++) {
+        scales[j] = 1.f / ev[j];
+    }
+    return p_weighted_mean(task, ev, scales);
+}
 
-io_t *p_reduce(const Task &task, pReduction reduction)
+static Buffer<io_t> p_dispatch(const Task &task, pReduction reduction, const ReductionParams &params)
 {
+    // the streaming reductions go through the fused kernel of core/pipeline.h, with the identity chain
     switch (reduction) {
         case pReduction::MEAN:
-            return p_mean(task);
+            return px::kernel<px::Mean>(task);
         case pReduction::MEDIAN:
             return p_median(task);
         case pReduction::SUMMATION:
-            return p_summation(task);
+            return px::kernel<px::Summation>(task);
         case pReduction::MAXIMUM:
-            return p_maximum(task);
+            return px::kernel<px::Maximum>(task);
         case pReduction::MINIMUM:
-            return p_minimum(task);
+            return px::kernel<px::Minimum>(task);
         case pReduction::RANGE:
-            return p_range(task);
+            return px::kernel<px::Range>(task);
         case pReduction::VARIANCE:
-            return p_variance(task);
+            return px::kernel<px::Variance>(task);
         case pReduction::STANDARD_DEVIATION:
-            return p_standard_deviation(task);
+            return px::kernel<px::StandardDeviation>(task);
+        case pReduction::WEIGHTED_MEAN:
+            return p_weighted_mean(task);
+        case pReduction::HYBRID:
+            return p_hybrid(task);
+        case pReduction::PERCENTILE:
+            return p_percentile(task, params.percentile);
+        case pReduction::TRIMMED_MEAN:
+            return p_trimmed_mean(task, params.trim);
+        case pReduction::MODE:
+            return p_mode(task, params.mode_bin);
+        case pReduction::CLIPPED_MEAN:
+            return p_clipped_mean(task, params.kappa);
         default:
-            return nullptr;
+            return {};
+    }
+}
+
+Buffer<io_t> p_reduce(const Task &task, pReduction reduction, const ReductionParams &params, size_t level)
+{
+    if (level) {
+        return p_reduce(task.preview(level), reduction, params);
+    }
+    if (task.progress) task.progress->begin(Stage::REDUCE, task.wh);
+    Buffer<io_t> ans = p_dispatch(task, reduction, params);
+    if (cancelled(task.progress)) {
+        throw ParserErrors::CANCELLED;
     }
+    return to_interleaved(task, std::move(ans));
 }
 
 } // namespace r2r
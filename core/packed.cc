@@ -0,0 +1,350 @@
+/**
+ * Raw2Raw
+ * core/packed.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the packed stack.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "packed.h"
+#include "calibrate.h"
+#include "cfa.h"
+#include "defects.h"
+#include "progress.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+namespace {
+using r2r::io_t;
+using r2r::u8;
+using r2r::u32;
+
+constexpr size_t kBlock = 256;      // samples whose low bits share the bytes of the planes
+constexpr size_t kChunk = 4096;     // samples of a frame that are unpacked at once, a multiple of kBlock
+
+/* Call f with the bits as a constant, so the shifts and masks of the planes are known to the compiler */
+template<typename F>
+void with_bits(u32 bits, F &&f)
+{
+    switch (bits) {
+        case 10: f(std::integral_constant<u32, 10>{}); break;
+        case 12: f(std::integral_constant<u32, 12>{}); break;
+        case 14: f(std::integral_constant<u32, 14>{}); break;
+        default: f(std::integral_constant<u32, 16>{}); break;
+    }
+}
+
+/* Call f(offset, shift) for every plane of a frame, where the samples [begin, end) of the plane are its bytes
+ * [offset + (begin >> shift), offset + (end >> shift))
+ */
+template<typename F>
+void for_planes(u32 bits, size_t stride, F &&f)
+{
+    const u32 rest = bits - 8;
+    size_t offset = 0;
+    f(offset, 0);
+    offset += stride;
+    if (rest & 8) {
+        f(offset, 0);
+        offset += stride;
+    }
+    if (rest & 4) {
+        f(offset, 1);
+        offset += stride / 2;
+    }
+    if (rest & 2) {
+        f(offset, 2);
+    }
+}
+
+/* Pack the samples [begin, end) of a frame of wh samples, begin and end multiples of kBlock. The samples past wh are 0.
+ * The sample b + h * Q + m of the block at b is in the byte m of the quarter h % 2 of the 4 bit plane of the block, and
+ * in the byte m of its 2 bit plane.
+ */
+template<u32 Bits>
+void pack_span(const io_t *src, size_t wh, size_t stride, size_t begin, size_t end, u8 *frame)
+{
+    constexpr u32 rest = Bits - 8, limit = (1u << Bits) - 1, s = rest & 2;
+    constexpr size_t Q = kBlock / 4;
+    u8 *top = frame, *lo8 = top + stride, *lo4 = lo8 + (rest & 8 ? stride : 0);
+    u8 *lo2 = lo4 + (rest & 4 ? stride / 2 : 0);
+    u32 v[kBlock];
+    for (size_t b = begin; b < end; b += kBlock) {
+        for (size_t m = 0; m < kBlock; m++) {
+            v[m] = b + m < wh ? std::min<u32>(src[b + m], limit) : 0;
+            top[b + m] = (u8)(v[m] >> rest);
+            if constexpr ((rest & 8) != 0) lo8[b + m] = (u8)v[m];
+        }
+        for (size_t m = 0; m < Q && (rest & 4); m++) {
+            lo4[b / 2 + m] = (u8)((v[m] >> s & 0xf) | (v[2 * Q + m] >> s & 0xf) << 4);
+            lo4[b / 2 + Q + m] = (u8)((v[Q + m] >> s & 0xf) | (v[3 * Q + m] >> s & 0xf) << 4);
+        }
+        for (size_t m = 0; m < Q && (rest & 2); m++) {
+            lo2[b / 4 + m] = (u8)((v[m] & 3) | (v[Q + m] & 3) << 2 | (v[2 * Q + m] & 3) << 4 | (v[3 * Q + m] & 3) << 6);
+        }
+    }
+}
+
+/* Unpack the samples [begin, end) of a frame into out[0, end - begin), begin and end multiples of kBlock. The shift and
+ * the byte of every quarter of a block are fixed, so each quarter is a plain vector loop.
+ */
+template<u32 Bits>
+void unpack_span(const u8 *frame, size_t stride, size_t begin, size_t end, io_t *out)
+{
+    constexpr u32 rest = Bits - 8, s = rest & 2;
+    constexpr size_t Q = kBlock / 4;
+    const u8 *top = frame, *lo8 = top + stride, *lo4 = lo8 + (rest & 8 ? stride : 0);
+    const u8 *lo2 = lo4 + (rest & 4 ? stride / 2 : 0);
+    for (size_t b = begin; b < end; b += kBlock) {
+        io_t *dst = out + (b - begin);
+        for (size_t h = 0; h < 4; h++) {
+            const u8 *t = top + b + h * Q, *l8 = lo8 + b + h * Q, *l4 = lo4 + b / 2 + (h % 2) * Q, *l2 = lo2 + b / 4;
+            const u32 s4 = h / 2 * 4, s2 = h * 2;
+            #pragma omp simd
+            for (size_t m = 0; m < Q; m++) {
+                u32 v = (u32)t[m] << rest;
+                if constexpr ((rest & 8) != 0) v |= l8[m];
+                if constexpr ((rest & 4) != 0) v |= (u32)(l4[m] >> s4 & 0xf) << s;
+                if constexpr ((rest & 2) != 0) v |= (u32)(l2[m] >> s2 & 0x3);
+                dst[h * Q + m] = (io_t)v;
+            }
+        }
+    }
+}
+
+void pack_frame(u32 bits, const io_t *src, size_t wh, size_t stride, u8 *frame)
+{
+    with_bits(bits, [=](auto b) { pack_span<decltype(b)::value>(src, wh, stride, 0, stride, frame); });
+}
+
+/* The streaming reductions, a chunk of every frame at a time, on the threads that touched the chunks first */
+template<u32 Bits>
+void reduce_chunks(const u8 *frames, size_t frame_bytes, size_t stride, size_t wh, size_t n, u32 max_val,
+                   r2r::pReduction reduction, r2r::Progress *progress, io_t *ans)
+{
+    using r2r::pReduction;
+    const size_t n_chunks = (wh + kChunk - 1) / kChunk;
+    const bool additive = reduction == pReduction::MEAN || reduction == pReduction::SUMMATION;
+    #pragma omp parallel default(none) shared(frames, frame_bytes, stride, wh, n, max_val, reduction, progress, ans, \
+                                              n_chunks, additive)
+    {
+        std::vector<io_t> samples(kChunk), lo(kChunk), hi(kChunk);
+        std::vector<r2r::interm_t> sum(kChunk);
+        #pragma omp for schedule(static)
+        for (size_t c = 0; c < n_chunks; c++) {
+            if (r2r::cancelled(progress)) continue;
+            const size_t begin = c * kChunk, end = std::min(wh, begin + kChunk), len = end - begin;
+            io_t *x = samples.data(), *l = lo.data(), *h = hi.data();
+            r2r::interm_t *s = sum.data();
+            std::fill_n(s, len, 0);
+            std::fill_n(l, len, 0xffff);
+            std::fill_n(h, len, 0);
+            for (size_t j = 0; j < n; j++) {
+                unpack_span<Bits>(frames + j * frame_bytes, stride, begin, std::min(stride, begin + kChunk), x);
+                if (additive) {
+                    #pragma omp simd
+                    for (size_t k = 0; k < len; k++) s[k] += x[k];
+                } else {
+                    #pragma omp simd
+                    for (size_t k = 0; k < len; k++) {
+                        l[k] = std::min(l[k], x[k]);
+                        h[k] = std::max(h[k], x[k]);
+                    }
+                }
+            }
+            io_t *out = ans + begin;
+            for (size_t k = 0; k < len; k++) {
+                switch (reduction) {
+                    case pReduction::MEAN: out[k] = (io_t)(s[k] / n); break;
+                    case pReduction::SUMMATION: out[k] = (io_t)std::min<r2r::interm_t>(s[k], max_val); break;
+                    case pReduction::MAXIMUM: out[k] = h[k]; break;
+                    case pReduction::MINIMUM: out[k] = l[k]; break;
+                    default: out[k] = h[k] - l[k]; break;
+                }
+            }
+            r2r::advance(progress, len);
+        }
+    }
+}
+} // anonymous namespace
+
+namespace r2r {
+
+u32 packed_bits(u32 max_val)
+{
+    // an unknown white level could be anything
+    if (max_val == 0) {
+        return 16;
+    }
+    for (u32 bits : {10u, 12u, 14u}) {
+        if (max_val < (1u << bits)) {
+            return bits;
+        }
+    }
+    return 16;
+}
+
+bool PackedStack::supported(pReduction reduction)
+{
+    switch (reduction) {
+        case pReduction::MEAN:
+        case pReduction::SUMMATION:
+        case pReduction::MAXIMUM:
+        case pReduction::MINIMUM:
+        case pReduction::RANGE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void PackedStack::allocate()
+{
+    bits = packed_bits(max_val);
+    stride = (wh + kBlock - 1) / kBlock * kBlock;
+    // unpooled, so that the first touch below places the pages
+    data = Buffer<u8>(stride * bits / 8 * n_images, false);
+
+    // first touch every chunk on the thread that reduces it, like the frames of a task
+    u8 *frames = data.get();
+    const size_t frame_bytes = stride * bits / 8, n_chunks = (stride + kChunk - 1) / kChunk, n = n_images;
+    const size_t plane_stride = stride;
+    const u32 b = bits;
+    #pragma omp parallel for default(none) shared(frames, frame_bytes, n_chunks, n, plane_stride, b) schedule(static)
+    for (size_t c = 0; c < n_chunks; c++) {
+        const size_t begin = c * kChunk, end = std::min(plane_stride, begin + kChunk);
+        for (size_t j = 0; j < n; j++) {
+            for_planes(b, plane_stride, [&](size_t offset, u32 shift) {
+                memset(frames + j * frame_bytes + offset + (begin >> shift), 0, (end - begin) >> shift);
+            });
+        }
+    }
+}
+
+PackedStack::PackedStack(const Task &task)
+    : n_images(task.n_images), width(task.width), height(task.height), wh(task.wh), max_val(task.max_val),
+      layout(task.layout), infos(task.infos)
+{
+    allocate();
+    u8 *frames = data.get();
+    const size_t frame_bytes = stride * bits / 8, n_chunks = (stride + kChunk - 1) / kChunk, n = n_images;
+    const size_t count = wh, plane_stride = stride;
+    with_bits(bits, [&](auto b) {
+        constexpr u32 Bits = decltype(b)::value;
+        #pragma omp parallel for default(none) shared(task, frames, frame_bytes, n_chunks, n, count, plane_stride) \
+                                 schedule(static)
+        for (size_t c = 0; c < n_chunks; c++) {
+            const size_t begin = c * kChunk, end = std::min(plane_stride, begin + kChunk);
+            for (size_t j = 0; j < n; j++) {
+                pack_span<Bits>(task.data + j * count, count, plane_stride, begin, end, frames + j * frame_bytes);
+            }
+        }
+    });
+}
+
+PackedStack::PackedStack(const std::vector<std::filesystem::path> &files, const TaskOptions &options)
+    : n_images(files.size()), infos(files.size())
+{
+    if (options.align != Alignment::NONE || options.detector || options.quality || options.preview_levels) {
+        throw std::invalid_argument("PackedStack: the frames cannot be aligned, scored, binned or searched for "
+                                    "defects while they are packed");
+    }
+    if (files.empty()) {
+        return;
+    }
+    get_dimensions(files[0].string().c_str(), width, height, max_val);
+    if (options.defects && !options.defects->pixels.empty() &&
+        (options.defects->width != width || options.defects->height != height)) {
+        throw ParserErrors::SIZE_MISMATCH;
+    }
+    if (options.calibration && (options.calibration->width != width || options.calibration->height != height)) {
+        throw ParserErrors::SIZE_MISMATCH;
+    }
+    wh = width * height;
+    allocate();
+
+    Progress *progress = options.progress;
+    if (progress) {
+        progress->begin(Stage::INGEST, n_images);
+    }
+    std::vector<ParserErrors> errs(n_images);
+    u8 *frames = data.get();
+    const size_t frame_bytes = stride * bits / 8, n = n_images, w = width, h = height, count = wh;
+    const size_t plane_stride = stride;
+    const u32 b = bits;
+    RawInfo *info = infos.data();
+    #pragma omp parallel default(none) shared(files, options, progress, errs, info, frames, frame_bytes, n, w, h, \
+                                              count, plane_stride, b)
+    {
+        std::vector<io_t> scratch(count);
+        #pragma omp for
+        for (size_t i = 0; i < n; i++) {
+            if (cancelled(progress)) continue;
+            errs[i] = parse_image(files[i].string().c_str(), scratch.data(), w, h, info + i);
+            if (errs[i] == ParserErrors::PARSE_SUCCESS) {
+                if (options.calibration) {
+                    calibrate_frame(*options.calibration, scratch.data());
+                }
+                if (options.defects) {
+                    correct_defects(*options.defects, scratch.data());
+                }
+                pack_frame(b, scratch.data(), count, plane_stride, frames + i * frame_bytes);
+            }
+            advance(progress, 1);
+        }
+    }
+    if (cancelled(progress)) {
+        throw ParserErrors::CANCELLED;
+    }
+    for (ParserErrors e : errs) {
+        if (e != ParserErrors::PARSE_SUCCESS) {
+            throw e;
+        }
+    }
+}
+
+Buffer<io_t> PackedStack::reduce(pReduction reduction, Progress *progress) const
+{
+    if (!supported(reduction) || n_images == 0) {
+        return {};
+    }
+    if (progress) {
+        progress->begin(Stage::REDUCE, wh);
+    }
+    Buffer<io_t> ans(wh);
+    with_bits(bits, [&](auto b) {
+        reduce_chunks<decltype(b)::value>(data.get(), stride * bits / 8, stride, wh, n_images, max_val, reduction,
+                                          progress, ans.get());
+    });
+    if (cancelled(progress)) {
+        throw ParserErrors::CANCELLED;
+    }
+    if (layout != Layout::CFA_PLANES) {
+        return ans;
+    }
+    Buffer<io_t> out(wh);
+    cfa_merge(ans.get(), out.get(), width, height);
+    return out;
+}
+
+void PackedStack::unpack(size_t frame, io_t *out) const
+{
+    // the whole blocks straight into out, and the last one through a block on the stack
+    const size_t whole = wh / kBlock * kBlock;
+    with_bits(bits, [&](auto b) {
+        constexpr u32 Bits = decltype(b)::value;
+        unpack_span<Bits>(this->frame(frame), stride, 0, whole, out);
+        if (whole < wh) {
+            io_t last[kBlock];
+            unpack_span<Bits>(this->frame(frame), stride, whole, whole + kBlock, last);
+            std::copy(last, last + (wh - whole), out + whole);
+        }
+    });
+}
+
+} // namespace r2r
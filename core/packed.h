@@ -0,0 +1,70 @@
+/**
+ * Raw2Raw
+ * core/packed.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of the packed stack, which keeps the frames in as many bits as the camera has
+ * instead of in 16. Most sensors are 12 or 14 bit (see Task::max_val), so a stack packed to their depth is 25% or 12.5%
+ * smaller, which is that many more frames in memory, and that much less memory traffic for the reductions that only
+ * stream the samples (mean, summation, maximum, minimum and range), which are bound by it.
+ *
+ * A sample is split into bit planes: a frame of b bits is a plane of the top 8 bits of every sample, followed by the
+ * planes of the bits below them, of 8 bits (1 sample per byte), 4 bits (2 per byte) and 2 bits (4 per byte), as many as
+ * b - 8 has. The samples that share a byte are a quarter or a half of a block of 256 samples apart, so every plane is
+ * read in order and unpacked by the same shift and mask for a whole quarter of a block, which vectorizes like the
+ * reductions themselves, and the samples only go through the L1 cache in 16 bits.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+
+namespace r2r {
+
+/* The bits a sample of up to max_val is packed in: 10, 12, 14, or 16 if it needs more than 14 */
+u32 packed_bits(u32 max_val);
+
+class PackedStack {
+public:
+    PackedStack() = default;
+    /* Pack the frames of a task, in its layout. The task can be freed afterwards. */
+    explicit PackedStack(const Task &task);
+    /* Read the files straight into a packed stack, so only one frame per thread is ever unpacked. Of the options, only
+     * the calibration, the defects and the progress context are used, and std::invalid_argument is thrown if any of the
+     * options that need the whole stack (alignment, defect detection, quality, previews) is set. Throws the error of
+     * the first file that cannot be read, ParserErrors::SIZE_MISMATCH if the calibration or the defects are of another
+     * size than the frames, or ParserErrors::CANCELLED if it is cancelled.
+     */
+    PackedStack(const std::vector<std::filesystem::path> &files, const TaskOptions &options = {});
+
+    /* Whether a reduction can be computed from a packed stack */
+    static bool supported(pReduction reduction);
+
+    /* Compute a reduction like p_reduce, in the interleaved layout, or an empty buffer if it is not supported. The
+     * progress context is used like by p_reduce.
+     */
+    Buffer<io_t> reduce(pReduction reduction, Progress *progress = nullptr) const;
+
+    /* Unpack a frame into wh samples, in the layout of the stack */
+    void unpack(size_t frame, io_t *out) const;
+
+    /* The memory of the frames */
+    size_t bytes() const { return stride * bits / 8 * n_images; }
+
+    size_t n_images {0};
+    size_t width {0}, height {0}, wh {0};
+    u32 max_val {0};
+    u32 bits {16};                          // from packed_bits(max_val)
+    Layout layout {Layout::INTERLEAVED};
+    std::vector<RawInfo> infos;             // metadata of each image
+
+private:
+    void allocate();
+    const u8 *frame(size_t j) const { return data.get() + j * (stride * bits / 8); }
+
+    size_t stride {0};                      // wh rounded up to whole blocks of the planes
+    Buffer<u8> data;
+};
+
+} // namespace r2r
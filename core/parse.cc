@@ -17,10 +17,36 @@
  */
 
 #include "raw2raw.h"
+#include "calibrate.h"
+#include "defects.h"
+#include "quality.h"
+#include "progress.h"
+#include "cfa.h"
+#include "register.h"
+#include "stars.h"
 #include "libraw/libraw.h"
 #include <algorithm>
+#include <cmath>
+#include <stdexcept>
 
 namespace {
+constexpr size_t kPage = 4096 / sizeof(r2r::io_t);     // samples per page of memory
+
+/* Fault in the pages of the frames of a task on the threads that will reduce them. The kernels split the pixels between
+ * the threads with a static schedule, so every thread touches the same stripe of every frame here. On a NUMA machine
+ * (with the threads bound to the cores, e.g. OMP_PROC_BIND=spread) each stripe is then placed on the node that reads
+ * it, instead of on the node of whichever thread decodes the frame into it later.
+ */
+void first_touch(r2r::io_t *data, size_t wh, size_t n)
+{
+    #pragma omp parallel for default(none) shared(data, wh, n) schedule(static)
+    for (size_t i = 0; i < wh; i += kPage) {
+        for (size_t j = 0; j < n; j++) {
+            data[j * wh + i] = 0;
+        }
+    }
+}
+
 template<typename T>
 void to_little_endian_16(const T *input, char *output, size_t count)
 // 0x2010 -> \x10\x20
@@ -34,9 +60,137 @@ void to_little_endian_16(const T *input, char *output, size_t count)
     }
 }
 
+/* Move the frames of a task that were not rejected to the front, in order */
+void drop_rejected(r2r::Task &task, const std::vector<r2r::FrameQuality> &quality)
+{
+    size_t kept = 0;
+    for (size_t j = 0; j < task.n_images; j++) {
+        if (quality[j].rejected) continue;
+        if (kept != j) {
+            std::copy(task.data + j * task.wh, task.data + (j + 1) * task.wh, task.data + kept * task.wh);
+            task.infos[kept] = std::move(task.infos[j]);
+        }
+        kept++;
+    }
+    task.n_images = kept;
+    task.whn = task.wh * kept;
+    task.infos.resize(kept);
+}
+
+void fill_info(LibRaw &RawProcessor, r2r::RawInfo &info)
+{
+    const auto &sizes = RawProcessor.imgdata.sizes;
+    const auto &color = RawProcessor.imgdata.color;
+    const auto &idata = RawProcessor.imgdata.idata;
+    const auto &other = RawProcessor.imgdata.other;
+
+    info.width = sizes.raw_width;
+    info.height = sizes.raw_height;
+    info.left_margin = sizes.left_margin;
+    info.top_margin = sizes.top_margin;
+    info.visible_width = sizes.width;
+    info.visible_height = sizes.height;
+    info.max_val = color.maximum;
+
+    // filters < 1000 means a non-bayer pattern (e.g. X-Trans), 0 means no pattern at all
+    info.bayer = idata.filters >= 1000;
+    for (int p = 0; p < 4; p++) {
+        int r = p >> 1, c = p & 1;
+        // COLOR works in visible coordinates, but only the parity matters for a 2x2 pattern
+        info.cfa[p] = info.bayer ? RawProcessor.COLOR(r + sizes.top_margin, c + sizes.left_margin) : 1;
+        info.black[p] = color.black + color.cblack[info.cfa[p]];
+        if (color.cblack[4] == 2 && color.cblack[5] == 2) {
+            info.black[p] += color.cblack[6 + ((r + sizes.top_margin) & 1) * 2 + ((c + sizes.left_margin) & 1)];
+        }
+    }
+
+    info.make = idata.make;
+    info.model = idata.model;
+    info.serial = RawProcessor.imgdata.shootinginfo.BodySerial;
+    if (info.serial.empty()) {
+        info.serial = RawProcessor.imgdata.shootinginfo.InternalBodySerial;
+    }
+    info.iso = other.iso_speed;
+    info.shutter = other.shutter;
+    info.aperture = other.aperture;
+    // LibRaw uses -1000 for temperatures that are not recorded
+    float t = RawProcessor.imgdata.makernotes.common.SensorTemperature;
+    if (t <= -999.f) t = RawProcessor.imgdata.makernotes.common.CameraTemperature;
+    info.temperature = t <= -999.f ? NAN : t;
+    info.timestamp = other.timestamp;
+    info.shot_order = other.shot_order;
+    std::copy(&color.cam_xyz[0][0], &color.cam_xyz[0][0] + 12, &info.cam_xyz[0][0]);
+    std::copy(color.cam_mul, color.cam_mul + 4, info.cam_mul);
+}
+
+/* FNV-1a, over the bytes of a value or of the elements of a vector */
+struct Fnv {
+    r2r::u64 h {0xcbf29ce484222325ull};
+    void add(const void *p, size_t n)
+    {
+        const auto *b = static_cast<const unsigned char *>(p);
+        for (size_t k = 0; k < n; k++) {
+            h = (h ^ b[k]) * 0x100000001b3ull;
+        }
+    }
+    template<typename T> void add(const T &v) { add(&v, sizeof(v)); }
+    template<typename T> void add(const std::vector<T> &v) { add(v.size()); add(v.data(), v.size() * sizeof(T)); }
+};
+
 } // anonymous namespace
 
 namespace r2r {
+u64 decode_fingerprint(const TaskOptions &options)
+{
+    Fnv f;
+    if (const Calibration *cal = options.calibration) {
+        f.add(cal->width);
+        f.add(cal->height);
+        f.add(cal->max_val);
+        f.add(cal->black);
+        f.add(cal->offset);
+        f.add(cal->gain);
+    }
+    f.add(u8{0xff});
+    if (const DefectMap *defects = options.defects) {
+        f.add(defects->width);
+        f.add(defects->height);
+        f.add(defects->pixels);
+    }
+    return f.h;
+}
+
+u64 ingest_fingerprint(const TaskOptions &options)
+{
+    Fnv f;
+    f.add(decode_fingerprint(options));
+    f.add(options.align);
+    if (options.align == Alignment::SIMILARITY || options.align == Alignment::AFFINE) {
+        f.add(options.interpolation);
+    }
+    f.add(u8{0xff});
+    if (const DefectDetector *detector = options.detector) {
+        const DefectParams &p = detector->parameters();
+        f.add(p.threshold);
+        f.add(p.shot_noise);
+        f.add(p.read_noise);
+        f.add(p.min_fraction);
+        f.add(p.min_frames);
+    }
+    f.add(u8{0xff});
+    if (const QualityParams *q = options.quality) {
+        f.add(q->bin);
+        f.add(q->stars);
+        f.add(q->min_sharpness);
+        f.add(q->max_exposure_deviation);
+        f.add(q->min_correlation);
+        f.add(q->min_stars);
+        f.add(q->max_fwhm);
+        f.add(q->keep_best);
+    }
+    return f.h;
+}
+
 bool recognized_raw(std::filesystem::path fp)
 {
     auto ext = fp.extension().string();
@@ -58,10 +212,23 @@ ParserErrors get_dimensions (const char *filename, size_t &width, size_t &height
     return ParserErrors::PARSE_SUCCESS;
 }
 
+ParserErrors get_info(const char *filename, RawInfo &info)
+{
+    LibRaw RawProcessor;
+    if (RawProcessor.open_file(filename) != LIBRAW_SUCCESS) {
+        RawProcessor.recycle();
+        return ParserErrors::CANNOT_OPEN_FILE;
+    }
+    fill_info(RawProcessor, info);
+    RawProcessor.recycle();
+    return ParserErrors::PARSE_SUCCESS;
+}
+
 ParserErrors parse_image(const char *filename,
                  io_t *output,
                  size_t width,
-                 size_t height)
+                 size_t height,
+                 RawInfo *info)
 {
     LibRaw RawProcessor;
     if (RawProcessor.open_file(filename) != LIBRAW_SUCCESS) {
@@ -84,6 +251,9 @@ ParserErrors parse_image(const char *filename,
 
         memcpy(output, RawProcessor.imgdata.rawdata.raw_image, width * height * sizeof(*output));
     }
+    if (info) {
+        fill_info(RawProcessor, *info);
+    }
     RawProcessor.recycle();
     return ParserErrors::PARSE_SUCCESS;
 }
@@ -94,10 +264,18 @@ ParserErrors write_image(const std::filesystem::path &ref_file,
                          const u16 *output_data,
                          const u16 *raw_data,
                          size_t width,
-                         size_t height)
+                         size_t height,
+                         Progress *progress)
 {
     // this has to be signed since we will be subtracting them later
     long img_size = static_cast<long>(width * height * sizeof(u16));
+    if (cancelled(progress)) {
+        return ParserErrors::CANCELLED;
+    }
+    if (progress) {
+        // reading the reference, finding its raw data, and writing the output
+        progress->begin(Stage::WRITE, 3);
+    }
 
     // Open reference file and read its bytes
     std::ifstream ref(ref_file, std::ios::binary);
@@ -117,7 +295,25 @@ ParserErrors write_image(const std::filesystem::path &ref_file,
     // convert raw_data to binary, little endian
     // copy in little endian
     char *raw_bytes = new char[img_size];
-    to_little_endian_16(raw_data, raw_bytes, width * height);
+    if (raw_data) {
+        to_little_endian_16(raw_data, raw_bytes, width * height);
+    } else {
+        u16 *ref_data = new u16[width * height];
+        auto e = parse_image(ref_file.string().c_str(), ref_data, width, height);
+        to_little_endian_16(ref_data, raw_bytes, width * height);
+        delete[] ref_data;
+        if (e != ParserErrors::PARSE_SUCCESS) {
+            delete[] ref_bytes;
+            delete[] raw_bytes;
+            return e;
+        }
+    }
+    advance(progress, 1);
+    if (cancelled(progress)) {
+        delete[] ref_bytes;
+        delete[] raw_bytes;
+        return ParserErrors::CANCELLED;
+    }
 
     // find the offset of raw_data in ref_data
     long offset = -1;
@@ -132,6 +328,7 @@ ParserErrors write_image(const std::filesystem::path &ref_file,
         delete[] raw_bytes;
         return ParserErrors::MAY_BE_COMPRESSED;
     }
+    advance(progress, 1);
 
     // write the output data *RawProcessor.imgdata.rawdata.raw_image
     // overwrite the ref bytes with the output data bytes
@@ -144,39 +341,239 @@ ParserErrors write_image(const std::filesystem::path &ref_file,
 
     delete[] ref_bytes;
     delete[] raw_bytes;
+    advance(progress, 1);
 
     return ParserErrors::PARSE_SUCCESS; 
 }
 
 
-Task::Task(const std::vector<std::filesystem::path> &files)
-    : n_images(files.size())
+Task::Task(const std::vector<std::filesystem::path> &files, const TaskOptions &options)
+    : n_images(files.size()), infos(files.size())
 {   
+    // the defects are only known once every frame is read, and by then the warped frames have moved them
+    if (options.detector && (options.align == Alignment::SIMILARITY || options.align == Alignment::AFFINE)) {
+        throw std::invalid_argument("the defects cannot be detected in frames that are warped while they are read");
+    }
     get_dimensions(files[0].string().c_str(), width, height, max_val);
+    if (options.defects && !options.defects->pixels.empty() &&
+        (options.defects->width != width || options.defects->height != height)) {
+        throw ParserErrors::SIZE_MISMATCH;
+    }
+    if (options.calibration && (options.calibration->width != width || options.calibration->height != height)) {
+        throw ParserErrors::SIZE_MISMATCH;
+    }
     wh = width * height; whn = wh * n_images;
-    data = new u16[whn];
-    
+    // unpooled, so that first_touch places the pages
+    data = (io_t *)buffer_alloc(whn * sizeof(io_t), false);
+    first_touch(data, wh, n_images);
+    progress = options.progress;
+    if (progress) {
+        progress->begin(Stage::INGEST, n_images);
+    }
+
+    layout = options.layout;
+    size_t levels = options.preview_levels;
+    if (layout == Layout::CFA_PLANES || levels) {
+        RawInfo info;
+        get_info(files[0].string().c_str(), info);
+        if (!info.bayer || width % 2 || height % 2) {
+            layout = Layout::INTERLEAVED;
+            levels = 0;
+        }
+    }
+    const bool warp = options.align == Alignment::SIMILARITY || options.align == Alignment::AFFINE;
+    const bool corrected = options.calibration || options.defects || options.detector;
+    reference = corrected || layout != Layout::INTERLEAVED ? nullptr : data;
+
     std::vector<ParserErrors> errs(n_images);
-    // parse each image in parallel
-    #pragma omp parallel for default(none) shared(errs, files)
-    for (size_t i = 0; i < n_images; i++) {
-        errs[i] = parse_image(files[i].string().c_str(),
-            data + (i * wh), width, height);
+    std::vector<u8> unmatched(n_images, 0);
+    std::vector<std::vector<float>> thumbs(options.quality ? n_images : 0);
+    if (options.quality) {
+        quality.resize(n_images);
+    }
+    StarParams star_params;
+    star_params.affine = options.align == Alignment::AFFINE;
+    std::vector<Star> ref_stars;
+
+    // the previews are binned from the frames on their decoder threads, unless the frames change after they are read
+    for (size_t k = 0, w = width, h = height; k < levels && w >= 8 && h >= 8; k++) {
+        w = w / 4 * 2;
+        h = h / 4 * 2;
+        pyramid.push_back(std::make_unique<Task>(w, h, n_images, max_val));
+        pyramid.back()->progress = progress;
+    }
+    const bool bin_on_ingest = !options.detector && options.align != Alignment::GLOBAL &&
+                               options.align != Alignment::TILES;
+    const auto bin = [this](size_t i, const io_t *frame) {
+        size_t w = width, h = height;
+        for (auto &level : pyramid) {
+            io_t *dst = level->data + i * level->wh;
+            cfa_bin(frame, dst, w, h);
+            frame = dst;
+            w = level->width;
+            h = level->height;
+        }
+    };
+
+    // decode, correct, warp and split a frame, using at most two scratch frames of the thread
+    const auto ingest = [&](size_t i, std::vector<io_t> &scratch, std::vector<io_t> &warped) {
+        io_t *frame = scratch.empty() ? data + (i * wh) : scratch.data();
+        errs[i] = parse_image(files[i].string().c_str(), frame, width, height, &infos[i]);
+        if (errs[i] != ParserErrors::PARSE_SUCCESS) return;
+        // correct the frame on its decoder thread instead of in a separate pass over the whole stack
+        if (options.calibration) {
+            calibrate_frame(*options.calibration, frame);
+        }
+        if (options.defects) {
+            correct_defects(*options.defects, frame);
+        }
+        if (options.detector) {
+            options.detector->add(frame, infos[i], width, height);
+        }
+        if (options.quality) {
+            quality[i] = measure_frame(frame, infos[i], width, height, *options.quality, thumbs[i]);
+        }
+        if (warp && i > 0) {
+            Affine transform;
+            if (!match_stars(ref_stars, detect_stars(frame, infos[i], width, height, star_params), transform,
+                             star_params)) {
+                // warping by the identity would stack the frame where it is, so it is dropped below
+                unmatched[i] = 1;
+                return;
+            }
+            io_t *dst = warped.empty() ? data + (i * wh) : warped.data();
+            warp_cfa(frame, dst, width, height, transform, options.interpolation);
+            frame = dst;
+        } else if (warp) {
+            ref_stars = detect_stars(frame, infos[i], width, height, star_params);
+        }
+        if (bin_on_ingest) {
+            bin(i, frame);
+        }
+        if (layout == Layout::CFA_PLANES) {
+            cfa_split(frame, data + (i * wh), width, height);
+        }
+    };
+
+    // the warped frames are written straight into their slot, so the stack is never copied. The stars of the first
+    // frame are needed by every other frame, so it is read on its own.
+    const bool planar = layout == Layout::CFA_PLANES;
+    if (warp) {
+        std::vector<io_t> scratch(planar ? wh : 0), none;
+        ingest(0, scratch, none);
+        advance(progress, 1);
+    }
+    #pragma omp parallel default(none) shared(ingest, warp, planar)
+    {
+        std::vector<io_t> scratch(planar || warp ? wh : 0), warped(planar && warp ? wh : 0);
+        #pragma omp for
+        for (size_t i = warp ? 1 : 0; i < n_images; i++) {
+            // the frames that were not decoded yet are skipped once the task is cancelled
+            if (cancelled(progress)) continue;
+            ingest(i, scratch, warped);
+            advance(progress, 1);
+        }
+    }
+    if (cancelled(progress)) {
+        buffer_free(data);
+        throw ParserErrors::CANCELLED;
     }
     for (ParserErrors e : errs) {
         if (e != ParserErrors::PARSE_SUCCESS) {
-            delete[] data;
+            buffer_free(data);
             throw e;
         }
     }
+    if (options.quality) {
+        // score the frames against the first one
+        for (size_t j = 1; j < n_images; j++) {
+            quality[j].correlation = thumbnail_correlation(thumbs[0], thumbs[j]);
+        }
+        select_frames(quality, *options.quality);
+    }
+    for (size_t j = 0; j < n_images; j++) {
+        if (unmatched[j]) unaligned.push_back(j);
+    }
+    if (options.quality || !unaligned.empty()) {
+        // then squeeze the rejected and the unaligned frames out of the stack before anything else reads it
+        std::vector<FrameQuality> kept = quality;
+        kept.resize(n_images);
+        for (size_t j : unaligned) {
+            kept[j].rejected = true;
+        }
+        drop_rejected(*this, kept);
+        for (auto &level : pyramid) {
+            drop_rejected(*level, kept);
+        }
+        if (kept[0].rejected) {
+            reference = nullptr;
+        }
+    }
+    // the defects of this stack are only known once every frame is read
+    if (options.detector) {
+        correct_defects(options.detector->finish(), *this);
+    }
+    if (options.align == Alignment::GLOBAL) {
+        apply_shifts(*this, estimate_shifts(*this));
+    } else if (options.align == Alignment::TILES) {
+        apply_displacements(*this, align_tiles(*this));
+    }
+
+    if (!bin_on_ingest && !pyramid.empty()) {
+        #pragma omp parallel default(none) shared(bin, planar)
+        {
+            std::vector<io_t> scratch(planar ? wh : 0);
+            #pragma omp for schedule(static)
+            for (size_t i = 0; i < n_images; i++) {
+                const io_t *frame = data + i * wh;
+                if (planar) {
+                    cfa_merge(frame, scratch.data(), width, height);
+                    frame = scratch.data();
+                }
+                bin(i, frame);
+            }
+        }
+    }
+    for (size_t k = 0; k < pyramid.size(); k++) {
+        Task &level = *pyramid[k];
+        level.infos = infos;
+        for (RawInfo &info : level.infos) {
+            info.width = level.width;
+            info.height = level.height;
+            info.left_margin >>= k + 1;
+            info.top_margin >>= k + 1;
+            info.visible_width >>= k + 1;
+            info.visible_height >>= k + 1;
+        }
+    }
+}
+
+Task::Task(size_t width, size_t height, size_t n_images, u32 max_val)
+    : data((io_t *)buffer_alloc(width * height * n_images * sizeof(io_t), false)), max_val(max_val), width(width), height(height), n_images(n_images),
+      wh(width * height), whn(width * height * n_images), layout(Layout::INTERLEAVED), infos(n_images),
+      reference(nullptr)
+{
+    first_touch(data, wh, n_images);
 }
-Task::Task(const std::filesystem::path &root) : Task(
+
+const Task &Task::preview(size_t level) const
+{
+    if (level == 0) {
+        return *this;
+    }
+    if (level > pyramid.size()) {
+        throw std::invalid_argument("the preview level " + std::to_string(level) + " was not built");
+    }
+    return *pyramid[level - 1];
+}
+
+Task::Task(const std::filesystem::path &root, const TaskOptions &options) : Task(
     std::vector<std::filesystem::path>(std::filesystem::directory_iterator(root), 
-                                       std::filesystem::directory_iterator())) {}
+                                       std::filesystem::directory_iterator()), options) {}
 
 Task::~Task()
 {
-    delete[] data;
+    buffer_free(data);
 }
 
 } // namespace r2r
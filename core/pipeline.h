@@ -0,0 +1,290 @@
+/**
+ * Raw2Raw
+ * core/pipeline.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains a small expression-template API for fusing a chain of per-pixel, per-frame operations (dark
+ * subtraction, flat division, exposure scaling, clamping, ...) with a terminal pixel-wise reduction. The whole chain is
+ * evaluated in a single tiled kernel, so every sample of the task is read exactly once no matter how many stages are
+ * stacked, and no intermediate whn buffer is ever allocated.
+ *
+ * Per-pixel operands (darks, gains) must be in the same layout as the task, while the result is always interleaved.
+ * Like p_reduce, the kernel reports the tiles to the progress context of the task, and throws ParserErrors::CANCELLED
+ * once it is cancelled. p_reduce itself runs its streaming reductions through this kernel, with the identity chain.
+ *
+ * Usage:
+ *     auto ops = px::subtract(dark) | px::multiply(flat_gain) | px::clamp(0, task.max_val);
+ *     Buffer<io_t> ans = px::reduce<px::Mean>(task, ops);
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+#include "cfa.h"
+#include "progress.h"
+#include <algorithm>
+#include <cmath>
+#include <concepts>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace r2r::px {
+
+/* Number of pixels processed together by one thread. The accumulators of a tile stay in L1/L2 while every frame of the
+ * tile is streamed through them, and the progress context is checked once per tile.
+ */
+constexpr size_t kTile = 4096;
+
+/* Elementwise operations. Each op maps a sample value of frame j at pixel i to a new value. All of them are cheap
+ * enough that the compiler can inline the whole chain into the inner loop of the kernel.
+ */
+struct Identity {
+    float operator()(float v, size_t, size_t) const { return v; }
+};
+
+/* subtract a per-pixel frame, e.g. a master dark or bias */
+struct Subtract {
+    const io_t *frame;
+    float operator()(float v, size_t, size_t i) const { return v - frame[i]; }
+};
+
+/* multiply by a per-pixel gain, e.g. the reciprocal of a normalized flat */
+struct Multiply {
+    const float *gain;
+    float operator()(float v, size_t, size_t i) const { return v * gain[i]; }
+};
+
+/* multiply by a per-frame scale factor, e.g. to equalize exposures */
+struct Scale {
+    const float *per_frame;
+    float operator()(float v, size_t j, size_t) const { return v * per_frame[j]; }
+};
+
+/* add a constant, e.g. to restore the black level pedestal */
+struct Offset {
+    float c;
+    float operator()(float v, size_t, size_t) const { return v + c; }
+};
+
+struct Clamp {
+    float lo, hi;
+    float operator()(float v, size_t, size_t) const { return std::clamp(v, lo, hi); }
+};
+
+/* A chain of operations applied left to right */
+template<typename... Ops>
+struct Chain {
+    std::tuple<Ops...> ops;
+    float operator()(float v, size_t j, size_t i) const
+    {
+        std::apply([&](const auto &...op) { ((v = op(v, j, i)), ...); }, ops);
+        return v;
+    }
+};
+
+template<typename T> struct is_chain : std::false_type {};
+template<typename... Ops> struct is_chain<Chain<Ops...>> : std::true_type {};
+
+template<typename T>
+auto as_chain(const T &op)
+{
+    if constexpr (is_chain<T>::value) return op;
+    else return Chain<T>{std::make_tuple(op)};
+}
+
+template<typename T>
+concept PixelOp = requires(const T &op) { { op(0.f, size_t{}, size_t{}) } -> std::convertible_to<float>; };
+
+template<PixelOp A, PixelOp B>
+auto operator|(const A &a, const B &b)
+{
+    return std::apply([](const auto &...op) { return Chain<std::decay_t<decltype(op)>...>{std::make_tuple(op...)}; },
+                      std::tuple_cat(as_chain(a).ops, as_chain(b).ops));
+}
+
+inline Subtract subtract(const io_t *frame) { return {frame}; }
+inline Multiply multiply(const float *gain) { return {gain}; }
+inline Scale scale(const float *per_frame) { return {per_frame}; }
+inline Offset offset(float c) { return {c}; }
+inline Clamp clamp(float lo, float hi) { return {lo, hi}; }
+
+inline io_t to_io(double v, u32 max_val)
+{
+    return (io_t)std::clamp(v, 0.0, (double)max_val);
+}
+
+/* Terminal reductions. Streaming reductions keep an accumulator per pixel that is updated once per frame. Gathering
+ * reductions (gather = true) receive all n transformed samples of a pixel at once.
+ */
+struct Mean {
+    using acc_t = double;
+    static acc_t init() { return 0; }
+    static void push(acc_t &a, float v) { a += v; }
+    static io_t finish(const acc_t &a, size_t n, u32 max_val) { return to_io(a / n, max_val); }
+};
+
+struct Summation {
+    using acc_t = double;
+    static acc_t init() { return 0; }
+    static void push(acc_t &a, float v) { a += v; }
+    static io_t finish(const acc_t &a, size_t, u32 max_val) { return to_io(a, max_val); }
+};
+
+struct Maximum {
+    using acc_t = float;
+    static acc_t init() { return -INFINITY; }
+    static void push(acc_t &a, float v) { a = std::max(a, v); }
+    static io_t finish(const acc_t &a, size_t, u32 max_val) { return to_io(a, max_val); }
+};
+
+struct Minimum {
+    using acc_t = float;
+    static acc_t init() { return INFINITY; }
+    static void push(acc_t &a, float v) { a = std::min(a, v); }
+    static io_t finish(const acc_t &a, size_t, u32 max_val) { return to_io(a, max_val); }
+};
+
+struct Range {
+    struct acc_t { float m, M; };
+    static acc_t init() { return {INFINITY, -INFINITY}; }
+    static void push(acc_t &a, float v) { a.m = std::min(a.m, v); a.M = std::max(a.M, v); }
+    static io_t finish(const acc_t &a, size_t, u32 max_val) { return to_io(a.M - a.m, max_val); }
+};
+
+struct Variance {
+    struct acc_t { double s, s2; };
+    static acc_t init() { return {0, 0}; }
+    static void push(acc_t &a, float v) { a.s += v; a.s2 += (double)v * v; }
+    static double var(const acc_t &a, size_t n)
+    {
+        return n < 2 ? 0.0 : std::max(0.0, (a.s2 - a.s * a.s / n) / (n - 1));
+    }
+    static io_t finish(const acc_t &a, size_t n, u32 max_val) { return to_io(var(a, n), max_val); }
+};
+
+struct StandardDeviation : Variance {
+    static io_t finish(const acc_t &a, size_t n, u32 max_val) { return to_io(std::sqrt(var(a, n)), max_val); }
+};
+
+struct Median {
+    static constexpr bool gather = true;
+    static io_t finish(float *v, size_t n, u32 max_val)
+    {
+        std::nth_element(v, v + n / 2, v + n);
+        return to_io(v[n / 2], max_val);
+    }
+};
+
+template<typename R, typename = void> struct is_gather : std::false_type {};
+template<typename R> struct is_gather<R, std::void_t<decltype(R::gather)>> : std::bool_constant<R::gather> {};
+
+/* The fused kernel, without the stage of the progress context. Returns a new wh buffer in the layout of the task, and
+ * skips the tiles that are left once the task is cancelled.
+ */
+template<typename R, typename Op = Identity>
+Buffer<io_t> kernel(const Task &task, const Op &op = {})
+{
+    Buffer<io_t> out(task.wh);
+    io_t *ans = out.get();
+    const size_t n = task.n_images;
+    const size_t wh = task.wh;
+    const io_t *data = task.data;
+    const u32 max_val = task.max_val;
+    Progress *progress = task.progress;
+
+    if constexpr (is_gather<R>::value) {
+        // gathered samples are stored pixel-major, so keep the tile at roughly kTile samples in total
+        const size_t tile = std::max<size_t>(1, kTile / n);
+        const size_t n_tiles = (wh + tile - 1) / tile;
+        #pragma omp parallel default(none) shared(ans, op, n, wh, data, max_val, tile, n_tiles, progress)
+        {
+            std::vector<float> buf(tile * n);
+            #pragma omp for schedule(static)
+            for (size_t t = 0; t < n_tiles; t++) {
+                if (cancelled(progress)) continue;
+                const size_t begin = t * tile, end = std::min(wh, begin + tile);
+                for (size_t j = 0; j < n; j++) {
+                    const io_t *src = data + j * wh;
+                    for (size_t i = begin; i < end; i++) {
+                        buf[(i - begin) * n + j] = op((float)src[i], j, i);
+                    }
+                }
+                for (size_t i = begin; i < end; i++) {
+                    ans[i] = R::finish(buf.data() + (i - begin) * n, n, max_val);
+                }
+                advance(progress, end - begin);
+            }
+        }
+    } else {
+        const size_t n_tiles = (wh + kTile - 1) / kTile;
+        #pragma omp parallel default(none) shared(ans, op, n, wh, data, max_val, n_tiles, progress)
+        {
+            std::vector<typename R::acc_t> acc(kTile);
+            #pragma omp for schedule(static)
+            for (size_t t = 0; t < n_tiles; t++) {
+                if (cancelled(progress)) continue;
+                const size_t begin = t * kTile, end = std::min(wh, begin + kTile);
+                typename R::acc_t *a = acc.data();
+                for (size_t i = begin; i < end; i++) {
+                    a[i - begin] = R::init();
+                }
+                for (size_t j = 0; j < n; j++) {
+                    const io_t *src = data + j * wh;
+                    #pragma omp simd
+                    for (size_t i = begin; i < end; i++) {
+                        R::push(a[i - begin], op((float)src[i], j, i));
+                    }
+                }
+                for (size_t i = begin; i < end; i++) {
+                    ans[i] = R::finish(a[i - begin], n, max_val);
+                }
+                advance(progress, end - begin);
+            }
+        }
+    }
+    return out;
+}
+
+/* The fused reduction. Returns a new wh buffer in the interleaved layout, in the same way as p_reduce. */
+template<typename R, typename Op = Identity>
+Buffer<io_t> reduce(const Task &task, const Op &op = {})
+{
+    if (task.progress) task.progress->begin(Stage::REDUCE, task.wh);
+    Buffer<io_t> ans = kernel<R>(task, op);
+    if (cancelled(task.progress)) {
+        throw ParserErrors::CANCELLED;
+    }
+    return to_interleaved(task, std::move(ans));
+}
+
+/* Runtime dispatch for callers that select the reduction with a pReduction. Returns an empty buffer for the reductions
+ * that have no fused kernel.
+ */
+template<typename Op = Identity>
+Buffer<io_t> reduce(const Task &task, pReduction reduction, const Op &op = {})
+{
+    switch (reduction) {
+        case pReduction::MEAN:
+            return reduce<Mean>(task, op);
+        case pReduction::MEDIAN:
+            return reduce<Median>(task, op);
+        case pReduction::SUMMATION:
+            return reduce<Summation>(task, op);
+        case pReduction::MAXIMUM:
+            return reduce<Maximum>(task, op);
+        case pReduction::MINIMUM:
+            return reduce<Minimum>(task, op);
+        case pReduction::RANGE:
+            return reduce<Range>(task, op);
+        case pReduction::VARIANCE:
+            return reduce<Variance>(task, op);
+        case pReduction::STANDARD_DEVIATION:
+            return reduce<StandardDeviation>(task, op);
+        default:
+            return {};
+    }
+}
+
+} // namespace r2r::px
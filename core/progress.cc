@@ -0,0 +1,41 @@
+/**
+ * Raw2Raw
+ * core/progress.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the progress and cancellation context.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "progress.h"
+#include <algorithm>
+
+namespace r2r {
+
+void Progress::reset()
+{
+    cancelled_.store(false, std::memory_order_relaxed);
+    stage_.store((int)Stage::IDLE, std::memory_order_relaxed);
+    done_.store(0, std::memory_order_relaxed);
+    total_.store(0, std::memory_order_relaxed);
+}
+
+float Progress::fraction() const
+{
+    const size_t t = total();
+    return t ? std::min((float)done() / (float)t, 1.f) : 0.f;
+}
+
+void Progress::begin(Stage stage, size_t total)
+{
+    done_.store(0, std::memory_order_relaxed);
+    total_.store(total, std::memory_order_relaxed);
+    stage_.store((int)stage, std::memory_order_relaxed);
+    if (on_stage) {
+        on_stage(stage, total);
+    }
+}
+
+} // namespace r2r
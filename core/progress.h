@@ -0,0 +1,70 @@
+/**
+ * Raw2Raw
+ * core/progress.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of the progress and cancellation context of the long running calls: reading a
+ * task, reducing it and writing the result. The caller owns the context, passes it in TaskOptions::progress (a task
+ * keeps it for the reductions that run on it, see Task::progress), and may poll it or cancel from any thread.
+ *
+ * The engine only touches the context once per frame or per tile of pixels, with relaxed atomics, so a run with a
+ * context is as fast as one without. Once cancelled, the remaining frames and tiles are skipped, and the call throws
+ * ParserErrors::CANCELLED (write_image returns it instead).
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+#include <atomic>
+#include <functional>
+
+namespace r2r {
+
+enum class Stage {
+    IDLE = 0,
+    INGEST,             // frames decoded
+    REDUCE,             // pixels reduced
+    WRITE,              // output written
+    BATCH               // jobs done, see core/batch.h
+};
+
+class Progress {
+public:
+    /* Called when a stage begins, on the thread that runs it */
+    std::function<void(Stage stage, size_t total)> on_stage;
+
+    void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+    bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+    /* Clear the cancellation and the counters, to use the context for another run */
+    void reset();
+
+    Stage stage() const { return (Stage)stage_.load(std::memory_order_relaxed); }
+    size_t done() const { return done_.load(std::memory_order_relaxed); }
+    size_t total() const { return total_.load(std::memory_order_relaxed); }
+    /* The fraction of the current stage that is done */
+    float fraction() const;
+
+    /* For the engine: start a stage of total units of work (frames or pixels), and report units as they finish */
+    void begin(Stage stage, size_t total);
+    void advance(size_t units) { done_.fetch_add(units, std::memory_order_relaxed); }
+
+private:
+    std::atomic<bool> cancelled_ {false};
+    std::atomic<int> stage_ {0};
+    std::atomic<size_t> done_ {0}, total_ {0};
+};
+
+/* The checks of the kernels, where the context may be null */
+inline bool cancelled(const Progress *progress)
+{
+    return progress && progress->cancelled();
+}
+
+inline void advance(Progress *progress, size_t units)
+{
+    if (progress) progress->advance(units);
+}
+
+} // namespace r2r
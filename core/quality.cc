@@ -0,0 +1,159 @@
+/**
+ * Raw2Raw
+ * core/quality.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the frame quality metrics and the rejection policy.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "quality.h"
+#include "cfa.h"
+#include "stars.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+namespace {
+/* The median of the finite values, or NaN if there are none */
+float finite_median(std::vector<float> v)
+{
+    std::erase_if(v, [](float x) { return !std::isfinite(x); });
+    if (v.empty()) {
+        return NAN;
+    }
+    std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+    return v[v.size() / 2];
+}
+} // anonymous namespace
+
+namespace r2r {
+
+FrameQuality measure_frame(const io_t *frame, const RawInfo &info, size_t width, size_t height,
+                           const QualityParams &params, std::vector<float> &thumb)
+{
+    FrameQuality q {};
+    q.correlation = 1.f;
+    q.fwhm = NAN;
+
+    // bin the average of the two greens of each CFA block straight from the raw frame
+    const size_t bin = std::max<size_t>(params.bin, 1);
+    const size_t tw = width / (2 * bin), th = height / (2 * bin);
+    const int g1 = std::max(cfa_plane_of(info, 1), 0), g2 = cfa_plane_of(info, 3) < 0 ? g1 : cfa_plane_of(info, 3);
+    const size_t oa = (g1 >> 1) * width + (g1 & 1), ob = (g2 >> 1) * width + (g2 & 1);
+    thumb.assign(tw * th, 0.f);
+    for (size_t y = 0; y < th * bin; y++) {
+        const io_t *row = frame + 2 * y * width;
+        float *out = thumb.data() + (y / bin) * tw;
+        for (size_t x = 0; x < tw * bin; x++) {
+            out[x / bin] += (float)row[2 * x + oa] + (float)row[2 * x + ob];
+        }
+    }
+    const float norm = 1.f / (float)(2 * bin * bin);
+    for (float &v : thumb) v *= norm;
+
+    const float black = 0.5f * (float)(info.black[g1] + info.black[g2]);
+    double sum = 0, laplacian = 0;
+    for (float v : thumb) sum += v;
+    const float mean = thumb.empty() ? 0.f : (float)(sum / thumb.size());
+    for (size_t y = 1; y + 1 < th; y++) {
+        const float *r = thumb.data() + y * tw;
+        for (size_t x = 1; x + 1 < tw; x++) {
+            const float l = 4 * r[x] - r[x - 1] - r[x + 1] - r[x - tw] - r[x + tw];
+            laplacian += l * l;
+        }
+    }
+    q.brightness = mean - black;
+    // relative to the brightness, so that the exposure does not change the sharpness
+    const size_t inner = tw > 2 && th > 2 ? (tw - 2) * (th - 2) : 0;
+    q.sharpness = inner && q.brightness > 0 ? (float)(laplacian / inner) / (q.brightness * q.brightness) : 0.f;
+
+    if (params.stars) {
+        StarParams star_params;
+        star_params.max_stars = 1024;
+        std::vector<Star> stars = detect_stars(frame, info, width, height, star_params);
+        q.stars = stars.size();
+        std::vector<float> fwhm;
+        for (const Star &s : stars) fwhm.push_back(s.fwhm);
+        q.fwhm = finite_median(std::move(fwhm));
+    }
+    return q;
+}
+
+float thumbnail_correlation(const std::vector<float> &a, const std::vector<float> &b)
+{
+    const size_t n = std::min(a.size(), b.size());
+    if (n == 0) {
+        return 0.f;
+    }
+    double ma = 0, mb = 0;
+    for (size_t i = 0; i < n; i++) {
+        ma += a[i];
+        mb += b[i];
+    }
+    ma /= n;
+    mb /= n;
+    double sab = 0, saa = 0, sbb = 0;
+    for (size_t i = 0; i < n; i++) {
+        const double da = a[i] - ma, db = b[i] - mb;
+        sab += da * db;
+        saa += da * da;
+        sbb += db * db;
+    }
+    return saa > 0 && sbb > 0 ? (float)(sab / std::sqrt(saa * sbb)) : 0.f;
+}
+
+void select_frames(std::vector<FrameQuality> &quality, const QualityParams &params)
+{
+    if (quality.empty()) {
+        return;
+    }
+    std::vector<float> sharpness, brightness, stars, fwhm;
+    for (const auto &q : quality) {
+        sharpness.push_back(q.sharpness);
+        brightness.push_back(q.brightness);
+        stars.push_back((float)q.stars);
+        fwhm.push_back(q.fwhm);
+    }
+    const float med_sharpness = finite_median(sharpness), med_brightness = finite_median(brightness);
+    const float med_stars = finite_median(stars), med_fwhm = finite_median(fwhm);
+
+    for (auto &q : quality) {
+        q.rejected = false;
+        if (params.min_sharpness > 0 && q.sharpness < params.min_sharpness * med_sharpness) q.rejected = true;
+        if (params.max_exposure_deviation > 0 && med_brightness > 0 &&
+            std::abs(q.brightness / med_brightness - 1) > params.max_exposure_deviation) q.rejected = true;
+        if (params.min_correlation > 0 && q.correlation < params.min_correlation) q.rejected = true;
+        if (params.stars && params.min_stars > 0 && (float)q.stars < params.min_stars * med_stars) q.rejected = true;
+        // a frame without stars has no FWHM, and is already rejected by its star count if the others have stars
+        if (params.stars && params.max_fwhm > 0 && q.fwhm > params.max_fwhm * med_fwhm) q.rejected = true;
+    }
+
+    // the frames in order of preference
+    std::vector<size_t> order(quality.size());
+    std::iota(order.begin(), order.end(), 0);
+    const bool by_fwhm = params.stars && std::isfinite(med_fwhm);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (by_fwhm && quality[a].fwhm != quality[b].fwhm) {
+            // frames without stars go last
+            return std::isfinite(quality[a].fwhm) && (!std::isfinite(quality[b].fwhm) || quality[a].fwhm < quality[b].fwhm);
+        }
+        return quality[a].sharpness > quality[b].sharpness;
+    });
+    size_t kept = 0;
+    for (size_t j : order) {
+        if (quality[j].rejected) continue;
+        if (params.keep_best && kept == params.keep_best) {
+            quality[j].rejected = true;
+            continue;
+        }
+        kept++;
+    }
+    if (kept == 0) {
+        quality[order[0]].rejected = false;
+    }
+}
+
+} // namespace r2r
@@ -0,0 +1,46 @@
+/**
+ * Raw2Raw
+ * core/quality.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definitions of the frame quality stage, which scores every frame of a stack and drops the
+ * ones that would spoil it (a blurred or bumped frame, a flash or a passing car that changed the exposure, a frame that
+ * does not show the same scene) before anything is reduced.
+ *
+ * The metrics are computed during the ingest of a Task (see TaskOptions::quality), on the decoder thread of each frame
+ * while it is still in cache, from the green of the CFA binned into a small thumbnail. The rejected frames are then
+ * removed from the task, so no reduction ever reads them.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+
+namespace r2r {
+
+/* What is measured, and which frames are kept. The limits are relative to the median frame of the stack, unless they
+ * say otherwise, and a limit of 0 is not checked.
+ */
+struct QualityParams {
+    size_t bin {4};                     // CFA blocks per side of a thumbnail sample
+    bool stars {false};                 // count the stars and measure their FWHM, for astro
+    float min_sharpness {0.5f};
+    float max_exposure_deviation {0.25f};
+    float min_correlation {0.f};        // to the first frame, absolute
+    float min_stars {0.5f};
+    float max_fwhm {1.5f};
+    size_t keep_best {0};               // then keep at most this many frames, the sharpest (or with the smallest FWHM)
+};
+
+/* Measure an interleaved frame. The thumbnail of the frame is returned in thumb, and the correlation is left at 1. */
+FrameQuality measure_frame(const io_t *frame, const RawInfo &info, size_t width, size_t height,
+                           const QualityParams &params, std::vector<float> &thumb);
+
+/* The Pearson correlation of two thumbnails of the same size */
+float thumbnail_correlation(const std::vector<float> &a, const std::vector<float> &b);
+
+/* Set FrameQuality::rejected of every frame by the policy. At least the sharpest frame is always kept. */
+void select_frames(std::vector<FrameQuality> &quality, const QualityParams &params);
+
+} // namespace r2r
@@ -13,7 +13,10 @@
 #pragma once
 #include <cstdint>
 #include <vector>
+#include <string>
 #include <filesystem>
+#include <memory>
+#include "buffer.h"
 
 namespace r2r {
 
@@ -34,19 +37,59 @@ enum class ParserErrors {
     CANNOT_OPEN_FILE,
     CANNOT_UNPACK_FILE,
     SIZE_MISMATCH,
-    MAY_BE_COMPRESSED
+    MAY_BE_COMPRESSED,
+    CANCELLED,          // by the progress context, see core/progress.h
+    OUT_OF_MEMORY,      // a job of a batch could not allocate its frames or output, see core/batch.h
+    UNEXPECTED_ERROR    // any other exception in a job of a batch
 };
 
+class Progress;
+
 bool recognized_raw(std::filesystem::path fp);
 
-ParserErrors get_dimensions (const char *filename, size_t &width, size_t &height);
+ParserErrors get_dimensions (const char *filename, size_t &width, size_t &height, u32 &data_max);
 
-/* Parse a raw file using libraw, and return the raw data (as u16)
+/* Metadata of a raw file that the algorithms care about. The CFA is described by its 2x2 repeating block in raw
+ * coordinates, in row-major order, using LibRaw's color indices (0 = R, 1 = G, 2 = B, 3 = second G).
+ */
+struct RawInfo {
+    size_t width, height;                   // raw dimensions, including the masked area
+    size_t left_margin, top_margin;         // offset of the visible area
+    size_t visible_width, visible_height;
+    u32 max_val;
+    u32 black[4];                           // black level of each CFA position
+    u8 cfa[4];                              // color of each CFA position
+    bool bayer;                             // false for X-Trans, Foveon and linear raws
+    std::string make, model, serial;
+    float iso, shutter, aperture;
+    float temperature;                      // sensor temperature in C, NaN if unknown
+    s64 timestamp;
+    u32 shot_order;
+    float cam_xyz[4][3];                    // XYZ -> camera color matrix
+    float cam_mul[4];                       // as shot white balance multipliers
+};
+
+/* How good a frame is for stacking, see core/quality.h */
+struct FrameQuality {
+    float sharpness;                        // mean squared laplacian of the green thumbnail over its brightness squared
+    float brightness;                       // mean of the green above the black level
+    float correlation;                      // of the green thumbnail to the first frame
+    size_t stars;                           // 0 unless the stars are counted
+    float fwhm;                             // median FWHM of the stars in raw pixels, NaN if there are none
+    bool rejected;
+};
+
+/* Read only the metadata of a raw file, without unpacking the raw data */
+ParserErrors get_info(const char *filename, RawInfo &info);
+
+/* Parse a raw file using libraw, and return the raw data (as u16). If info is not null, it is filled with the metadata
+ * of the file.
  */
 ParserErrors parse_image(const char *filename,
                          io_t *output,
                          size_t width,
-                         size_t height);
+                         size_t height,
+                         RawInfo *info = nullptr);
 
 /* Write the image to an output file, that is in the spirit of a reference
  * file. As of now, the output file will have the same metadata as the reference
@@ -54,13 +97,17 @@ ParserErrors parse_image(const char *filename,
  * 
  * Note that only uncompressed files are supported at the moment. Compressed
  * raw will require some reverse engineering of the compression algorithm.
+ *
+ * raw_data is the unmodified raw data of the reference file, which is used to
+ * locate the raw data in the file. If it is null, the reference is parsed again.
  */
 ParserErrors write_image(const std::filesystem::path &ref_file,
                          const std::filesystem::path &out_file,
                          const io_t *output_data,
                          const io_t *raw_data,
                          size_t width,
-                         size_t height);
+                         size_t height,
+                         Progress *progress = nullptr);
 
 template<typename I, typename O>
 void array_cast(const I *input, O *output, size_t count)
@@ -83,6 +130,61 @@ private:
     double start_;
 };
 
+struct Calibration;
+struct DefectMap;
+class DefectDetector;
+struct QualityParams;
+
+/* How the frames of a task are stored in memory. See core/cfa.h for the planar layout. */
+enum class Layout {
+    INTERLEAVED = 0,    // the sensor layout, as it is in the raw file
+    CFA_PLANES          // four half-resolution planes per frame, one for each position of the 2x2 CFA block
+};
+
+/* How the frames of a task are moved onto the first one while they are read. See core/register.h. */
+enum class Alignment {
+    NONE = 0,
+    GLOBAL,             // one translation per frame
+    TILES,              // one translation per tile, for parallax and rolling shutter
+    SIMILARITY,         // rotation, scale and translation from matched stars, for field rotation (see core/stars.h)
+    AFFINE              // any affine transform from matched stars
+};
+
+/* How the SIMILARITY and AFFINE alignments resample the frames. See core/warp.h. */
+enum class Interpolation {
+    BILINEAR = 0,
+    LANCZOS3
+};
+
+/* Optional processing that is done while a task is read. The calibration, the defects of a DefectMap, the quality and
+ * the SIMILARITY and AFFINE alignments run on the decoder threads right after each frame is unpacked, so they do not
+ * need another pass over the whole stack. The GLOBAL and TILES alignments and the correction of the defects that the
+ * detector finds need every frame first, so they are passes over the stack once it is read, and the previews are then
+ * binned after them.
+ */
+struct TaskOptions {
+    const Calibration *calibration {nullptr};   // dark/bias/flat correction, see core/calibrate.h
+    Layout layout {Layout::INTERLEAVED};        // falls back to interleaved if the CFA is not a 2x2 bayer pattern
+    Alignment align {Alignment::NONE};          // move the frames onto the first one, see core/register.h
+    Interpolation interpolation {Interpolation::BILINEAR};
+    const DefectMap *defects {nullptr};         // hot, dead and stuck pixels to correct, see core/defects.h
+    // find the defects of the frames while they are read, and correct them. Not with SIMILARITY or AFFINE alignment.
+    DefectDetector *detector {nullptr};
+    const QualityParams *quality {nullptr};     // score the frames while they are read, and drop the bad ones
+    size_t preview_levels {0};                  // binned copies of the stack to build for previews, see Task::preview
+    Progress *progress {nullptr};               // reports the progress and checks for cancellation, see core/progress.h
+};
+
+/* A hash of the options that change the decoded frames, i.e. the calibration and the known defects (by their contents),
+ * so that a state that is kept across runs can tell whether its frames were read in the same way
+ */
+u64 decode_fingerprint(const TaskOptions &options);
+
+/* The same for all the options that change the frames of a task: the alignment, the defect detection and the quality
+ * selection as well. The layout, the previews and the progress context are left out.
+ */
+u64 ingest_fingerprint(const TaskOptions &options);
+
 /* A task that holds a set of images to be processed together in a 
  * contiguous block.
  * 
@@ -90,13 +192,34 @@ private:
  * for multiple tasks to be created at once.
  */
 struct Task {
-    Task(const std::filesystem::path &root);
-    Task(const std::vector<std::filesystem::path> &files);
+    Task(const std::filesystem::path &root, const TaskOptions &options = {});
+    Task(const std::vector<std::filesystem::path> &files, const TaskOptions &options = {});
+    /* An interleaved task of the given size, whose frames and infos are filled in by the caller */
+    Task(size_t width, size_t height, size_t n_images, u32 max_val);
     ~Task();
-    io_t *data;
+
+    /* The stack binned level times by 2x2 same-color superpixels (see cfa_bin), so every level has a quarter of the
+     * pixels of the one before. Level 0 is the task itself. Throws std::invalid_argument if the level was not built.
+     */
+    const Task &preview(size_t level) const;
+
+    io_t *data;                                 // from buffer_alloc (unpooled), see core/buffer.h
     u32 max_val;
     size_t width, height, n_images;
     size_t wh, whn;
+    Layout layout;
+    std::vector<RawInfo> infos;                 // metadata of each image
+    const io_t *reference;                      // unmodified data of the first image, or nullptr if ingest changed it
+    // the quality of every file (including the ones that were dropped, so n_images may be less than the number of
+    // files), if it was measured
+    std::vector<FrameQuality> quality;
+    // the files whose stars did not match the first one with SIMILARITY or AFFINE alignment. They cannot be registered,
+    // so they are dropped from the stack like the rejected ones.
+    std::vector<size_t> unaligned;
+    // the binned levels of the stack, always interleaved. They are made from the same decoded frames, while they are
+    // read unless alignment or defect detection still changes the frames after that.
+    std::vector<std::unique_ptr<Task>> pyramid;
+    Progress *progress {nullptr};               // of the reductions of the task, from TaskOptions::progress
 };
 
 enum class pReduction {
@@ -111,24 +234,66 @@ enum class pReduction {
     STANDARD_DEVIATION,
     SKEWNESS,
     KURTOSIS,
-    ENTROPY
+    ENTROPY,
+    WEIGHTED_MEAN,
+    HYBRID,             // mean where the scene is static, median where it moves, see core/hybrid.h
+    PERCENTILE,
+    TRIMMED_MEAN,
+    MODE,
+    CLIPPED_MEAN
+};
+
+/* Parameters of the reductions that have any */
+struct ReductionParams {
+    float percentile {50.f};        // PERCENTILE, e.g. 20 to keep the darker samples and drop passing headlights
+    float trim {25.f};              // TRIMMED_MEAN drops this percentage of the samples at each end (25 is the IQM)
+    u32 mode_bin {16};              // MODE counts the samples in bins of this many DN, and averages the fullest bin
+    float kappa {3.f};              // CLIPPED_MEAN keeps samples within kappa sigma of the median (sigma from the IQR)
 };
 
-io_t *p_reduce(const Task &task, pReduction reduction);
+/* Reduce the task to a single frame. The result is always in the interleaved layout, regardless of the task's layout.
+ * A level above 0 reduces the binned preview of the task (see Task::preview) instead, which is 4^level times faster.
+ */
+Buffer<io_t> p_reduce(const Task &task, pReduction reduction, const ReductionParams &params = {}, size_t level = 0);
 
 /* pixel-wise reduction functions (avail in photoshop stack modes)
  * but unlike photoshop, these functions can be done raw 
+ *
+ * their output is in the same layout as the task
  */
-io_t *p_mean(const Task &task);
-io_t *p_median(const Task &task);
-io_t *p_summation(const Task &task);
-io_t *p_maximum(const Task &task);
-io_t *p_minimum(const Task &task);
-io_t *p_range(const Task &task);
+Buffer<io_t> p_mean(const Task &task);
+Buffer<io_t> p_median(const Task &task);
+/* the rank based reductions share the sorting machinery of core/select.h */
+Buffer<io_t> p_percentile(const Task &task, float percentile);
+Buffer<io_t> p_trimmed_mean(const Task &task, float trim);
+Buffer<io_t> p_mode(const Task &task, u32 bin);
+Buffer<io_t> p_clipped_mean(const Task &task, float kappa);
+Buffer<io_t> p_summation(const Task &task);
+Buffer<io_t> p_maximum(const Task &task);
+Buffer<io_t> p_minimum(const Task &task);
+Buffer<io_t> p_range(const Task &task);
 /* these functions need to be renormalized, as they have vastly different ranges
  * compared with the input */
-io_t *p_variance(const Task &task);
-io_t *p_standard_deviation(const Task &task);
+Buffer<io_t> p_variance(const Task &task);
+Buffer<io_t> p_standard_deviation(const Task &task);
+
+/* Exposure of each frame (shutter * ISO / aperture^2) relative to the first frame. Fields that are missing from the
+ * EXIF are treated as equal for all frames.
+ */
+std::vector<float> relative_exposures(const std::vector<RawInfo> &infos);
+
+/* Weighted mean of the frames after scaling each one by scales[j] above its black level, e.g. to bring brackets to the
+ * same exposure. Clipped samples are left out, unless every sample of a pixel is clipped.
+ *
+ * Without weights and scales, they are derived from the EXIF: every frame is scaled to the exposure of the first one,
+ * and weighted by its exposure, which is the inverse variance weight for shot noise. Throws std::invalid_argument if
+ * there is not a weight and a scale for every frame.
+ */
+Buffer<io_t> p_weighted_mean(const Task &task, const std::vector<float> &weights, const std::vector<float> &scales);
+Buffer<io_t> p_weighted_mean(const Task &task);
+
+/* whole-image analysis functions: the temporal noise of each CFA position in DN. See core/analysis.h for the others. */
+std::vector<double> noise(const Task &task);
 
 /** TODO: Implement all of these, and more
 io_t *p_skewness(const Task &task);
@@ -140,8 +305,6 @@ io_t *p_entropy(const Task &task);
 io_t *p_mean_remove_outlier(Task &task, int outliers);
 
 
-// whole-image analysis functions
-std::vector<double> noise(const Task &task); 
 // TODO: a general renormalize function taking many parameters
 */
 
@@ -0,0 +1,484 @@
+/**
+ * Raw2Raw
+ * core/register.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the global registration by phase correlation, and of the local alignment by
+ * block matching on tiles.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "register.h"
+#include "cfa.h"
+#include "fft.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numbers>
+
+namespace r2r {
+
+namespace {
+/* A region of the green channel, downsampled, windowed and zero padded to a power of two for the transforms */
+struct Window {
+    size_t factor;              // downsampling
+    size_t gw, gh;              // region after downsampling
+    size_t fw, fh;              // transform
+    std::vector<float> hann_x, hann_y;
+};
+
+std::vector<float> hann(size_t n)
+{
+    std::vector<float> w(n);
+    for (size_t i = 0; i < n; i++) {
+        w[i] = n > 1 ? 0.5f - 0.5f * (float)std::cos(2 * std::numbers::pi * (double)i / (double)(n - 1)) : 1.f;
+    }
+    return w;
+}
+
+Window make_window(size_t gw, size_t gh, size_t factor)
+{
+    Window win {factor, gw, gh, fft_size(gw), fft_size(gh), hann(gw), hann(gh)};
+    return win;
+}
+
+/* Transform of the region of the green channel (pw samples per row) whose top left corner is (x0, y0) */
+void spectrum(const float *green, size_t pw, size_t x0, size_t y0, const Window &win, std::vector<cf32> &out)
+{
+    out.assign(win.fw * win.fh, 0.f);
+    const float norm = 1.f / (float)(win.factor * win.factor);
+    double mean = 0;
+    for (size_t y = 0; y < win.gh; y++) {
+        for (size_t x = 0; x < win.gw; x++) {
+            float s = 0;
+            for (size_t by = 0; by < win.factor; by++) {
+                const float *row = green + (y0 + y * win.factor + by) * pw + x0 + x * win.factor;
+                for (size_t bx = 0; bx < win.factor; bx++) s += row[bx];
+            }
+            out[y * win.fw + x] = s * norm;
+            mean += s * norm;
+        }
+    }
+    // remove the mean and taper the edges, so that the borders of the region do not correlate with each other
+    mean /= (double)(win.gw * win.gh);
+    for (size_t y = 0; y < win.gh; y++) {
+        for (size_t x = 0; x < win.gw; x++) {
+            cf32 &v = out[y * win.fw + x];
+            v = (v.real() - (float)mean) * win.hann_x[x] * win.hann_y[y];
+        }
+    }
+    fft2(out.data(), win.fw, win.fh);
+}
+
+/* Offset of the peak from the sample at its left (or top), fitted with a parabola through its neighbours */
+float subsample(float left, float mid, float right)
+{
+    const float d = left - 2 * mid + right;
+    return d < 0 ? std::clamp(0.5f * (left - right) / d, -0.5f, 0.5f) : 0.f;
+}
+
+/* Phase correlation of a spectrum against the reference spectrum. spec is overwritten. Returns the translation in
+ * samples of the window, and the height of the peak in confidence.
+ */
+void correlate(std::vector<cf32> &spec, const std::vector<cf32> &ref, const Window &win, float &fx, float &fy,
+               float &confidence)
+{
+    // normalized cross power spectrum, whose inverse is a peak at the translation
+    for (size_t k = 0; k < spec.size(); k++) {
+        const cf32 c = cmul(spec[k], std::conj(ref[k]));
+        const float mag = std::abs(c);
+        spec[k] = mag > 1e-20f ? c / mag : 0.f;
+    }
+    fft2(spec.data(), win.fw, win.fh, true);
+
+    size_t peak = 0;
+    for (size_t k = 1; k < spec.size(); k++) {
+        if (spec[k].real() > spec[peak].real()) peak = k;
+    }
+    const size_t px = peak % win.fw, py = peak / win.fw;
+    const auto at = [&](size_t x, size_t y) { return spec[(y % win.fh) * win.fw + x % win.fw].real(); };
+    const float mid = at(px, py);
+    fx = (float)px + subsample(at(px + win.fw - 1, py), mid, at(px + 1, py));
+    fy = (float)py + subsample(at(px, py + win.fh - 1), mid, at(px, py + 1));
+    if (fx > (float)win.fw / 2) fx -= (float)win.fw;
+    if (fy > (float)win.fh / 2) fy -= (float)win.fh;
+    confidence = std::clamp(mid / (float)(win.fw * win.fh), 0.f, 1.f);
+}
+
+/* Refine the translation of a frame (fx, fy) to a fraction of a sample, by Gauss-Newton steps on the squared difference
+ * to the reference over a central region of at most size x size samples. The peak of the phase correlation is only
+ * accurate to about a quarter of a sample, since the whitened spectrum of a smooth scene is mostly leakage.
+ */
+void refine(const float *ref, const float *green, size_t pw, size_t ph, size_t size, float &fx, float &fy)
+{
+    const long w = (long)pw, h = (long)ph, n = (long)std::max<size_t>(size, 8);
+    const long x0 = std::max(1l, (w - n) / 2), x1 = std::min(w - 1, x0 + n);
+    const long y0 = std::max(1l, (h - n) / 2), y1 = std::min(h - 1, y0 + n);
+    double hxx = 0, hxy = 0, hyy = 0;
+    for (long y = y0; y < y1; y++) {
+        for (long x = x0; x < x1; x++) {
+            const double gx = 0.5 * (ref[y * w + x + 1] - ref[y * w + x - 1]);
+            const double gy = 0.5 * (ref[(y + 1) * w + x] - ref[(y - 1) * w + x]);
+            hxx += gx * gx;
+            hxy += gx * gy;
+            hyy += gy * gy;
+        }
+    }
+    const double det = hxx * hyy - hxy * hxy;
+    if (!(det > 1e-9 * (hxx + hyy) * (hxx + hyy))) {
+        return;
+    }
+
+    for (int iter = 0; iter < 8; iter++) {
+        double bx = 0, by = 0;
+        for (long y = y0; y < y1; y++) {
+            const float sy = (float)y + fy;
+            const long iy = (long)std::floor(sy);
+            if (iy < 0 || iy + 1 >= h) continue;
+            const float ty = sy - (float)iy;
+            for (long x = x0; x < x1; x++) {
+                const float sx = (float)x + fx;
+                const long ix = (long)std::floor(sx);
+                if (ix < 0 || ix + 1 >= w) continue;
+                const float tx = sx - (float)ix;
+                const float *a = green + iy * w + ix, *b = a + w;
+                const float v = (1 - ty) * ((1 - tx) * a[0] + tx * a[1]) + ty * ((1 - tx) * b[0] + tx * b[1]);
+                const double e = v - ref[y * w + x];
+                bx += 0.5 * (ref[y * w + x + 1] - ref[y * w + x - 1]) * e;
+                by += 0.5 * (ref[(y + 1) * w + x] - ref[(y - 1) * w + x]) * e;
+            }
+        }
+        const double dx = -(hyy * bx - hxy * by) / det, dy = -(hxx * by - hxy * bx) / det;
+        if (std::abs(dx) > 1 || std::abs(dy) > 1) {
+            return;     // diverging, keep the estimate of the phase correlation
+        }
+        fx += (float)dx;
+        fy += (float)dy;
+        if (std::abs(dx) + std::abs(dy) < 1e-3) {
+            break;
+        }
+    }
+}
+
+/* Clamp a source row or column to the frame, keeping its parity (the CFA color) if period is 2 */
+inline long edge(long v, long n, long period)
+{
+    if (v < 0) return period == 2 ? (v & 1) : 0;
+    if (v >= n) return (n - 1) - (period == 2 && ((n - 1 - v) & 1));
+    return v;
+}
+
+/* Move every sample of frame j to where shift_at(x, y) points, where x and y are the coordinates of its 2x2 CFA block.
+ * In the planar layout a frame is four planes of half the size, and each of them is moved by half as much.
+ */
+template<typename F>
+void warp_frame(Task &task, size_t j, std::vector<io_t> &scratch, const F &shift_at)
+{
+    const bool planar = task.layout == Layout::CFA_PLANES;
+    const long w = planar ? (long)task.width / 2 : (long)task.width;
+    const long h = planar ? (long)task.height / 2 : (long)task.height;
+    const size_t n_planes = planar ? 4 : 1, plane = (size_t)(w * h);
+    const long step = planar ? 2 : 1, period = planar ? 1 : 2, block = planar ? 1 : 2;
+
+    io_t *frame = task.data + j * task.wh;
+    if (frame == task.reference) task.reference = nullptr;
+    std::copy(frame, frame + task.wh, scratch.begin());
+    for (size_t p = 0; p < n_planes; p++) {
+        const io_t *src = scratch.data() + p * plane;
+        io_t *dst = frame + p * plane;
+        #pragma omp parallel for default(none) shared(src, dst, w, h, step, period, block, shift_at) schedule(static)
+        for (long y = 0; y < h; y++) {
+            for (long x = 0; x < w; x++) {
+                const Shift &s = shift_at(x / block, y / block);
+                dst[y * w + x] = src[edge(y + s.dy / step, h, period) * w + edge(x + s.dx / step, w, period)];
+            }
+        }
+    }
+}
+
+/* Downsampling of each level of the alignment pyramid from the previous one, as in HDR+ */
+constexpr size_t kLevelFactor[4] = {1, 2, 4, 4};
+
+struct Level {
+    size_t w {0}, h {0};
+    std::vector<float> v;
+};
+
+void build_pyramid(const Task &task, size_t frame, size_t levels, std::vector<Level> &pyr)
+{
+    pyr.resize(levels);
+    pyr[0].w = task.width / 2;
+    pyr[0].h = task.height / 2;
+    pyr[0].v.resize(pyr[0].w * pyr[0].h);
+    cfa_green(task, frame, pyr[0].v.data());
+    for (size_t l = 1; l < levels; l++) {
+        const Level &in = pyr[l - 1];
+        Level &out = pyr[l];
+        const size_t f = kLevelFactor[l];
+        out.w = in.w / f;
+        out.h = in.h / f;
+        out.v.resize(out.w * out.h);
+        const float norm = 1.f / (float)(f * f);
+        #pragma omp parallel for default(none) shared(in, out, f, norm) schedule(static)
+        for (size_t y = 0; y < out.h; y++) {
+            for (size_t x = 0; x < out.w; x++) {
+                float s = 0;
+                for (size_t by = 0; by < f; by++) {
+                    const float *row = in.v.data() + (y * f + by) * in.w + x * f;
+                    for (size_t bx = 0; bx < f; bx++) s += row[bx];
+                }
+                out.v[y * out.w + x] = s * norm;
+            }
+        }
+    }
+}
+
+/* Mean distance between the tile [x0, x1) x [y0, y1) of the reference and the same tile of the other frame moved by
+ * (u, v). Only the part of the tile that stays inside the frame is compared, and the move is rejected (infinity) if less
+ * than half of the tile is left.
+ */
+float tile_cost(const Level &ref, const Level &alt, long x0, long y0, long x1, long y1, long u, long v, bool l2)
+{
+    const long cx0 = std::max(x0, -u), cy0 = std::max(y0, -v);
+    const long cx1 = std::min(x1, (long)alt.w - u), cy1 = std::min(y1, (long)alt.h - v);
+    if (cx1 <= cx0 || cy1 <= cy0 || 2 * (cx1 - cx0) * (cy1 - cy0) < (x1 - x0) * (y1 - y0)) {
+        return std::numeric_limits<float>::infinity();
+    }
+    const size_t n = (size_t)(cx1 - cx0);
+    float cost = 0;
+    for (long y = cy0; y < cy1; y++) {
+        const float *a = ref.v.data() + y * ref.w + cx0;
+        const float *b = alt.v.data() + (y + v) * alt.w + cx0 + u;
+        if (l2) {
+            #pragma omp simd reduction(+:cost)
+            for (size_t i = 0; i < n; i++) cost += (a[i] - b[i]) * (a[i] - b[i]);
+        } else {
+            #pragma omp simd reduction(+:cost)
+            for (size_t i = 0; i < n; i++) cost += std::abs(a[i] - b[i]);
+        }
+    }
+    return cost / (float)(n * (size_t)(cy1 - cy0));
+}
+} // anonymous namespace
+
+namespace {
+/* Translation of a frame in green samples */
+struct Offset {
+    float gx {0.f}, gy {0.f};
+    float confidence {0.f};
+};
+
+std::vector<Offset> phase_offsets(const Task &task, const RegistrationParams &params, bool subpixel)
+{
+    std::vector<Offset> shifts(task.n_images);
+    const size_t ref = std::min(params.reference, task.n_images - 1);
+    shifts[ref].confidence = 1.f;
+    if (task.infos.size() != task.n_images || task.width < 4 || task.height < 4) {
+        return shifts;
+    }
+
+    // the coarse pass covers the whole green channel, downsampled to at most max_size. When it is downsampled, the
+    // fine pass correlates a central crop at full resolution, around where the coarse pass found the match.
+    const size_t pw = task.width / 2, ph = task.height / 2;
+    const size_t max_size = std::max<size_t>(params.max_size, 8);
+    size_t factor = 1;
+    while (pw / factor > max_size || ph / factor > max_size) {
+        factor *= 2;
+    }
+    const Window coarse = make_window(pw / factor, ph / factor, factor);
+    const size_t crop = std::min({max_size / 4, pw, ph});
+    const Window fine = make_window(crop, crop, 1);
+    const size_t cx = (pw - crop) / 2, cy = (ph - crop) / 2;
+
+    std::vector<float> ref_green(pw * ph);
+    std::vector<cf32> ref_coarse, ref_fine;
+    cfa_green(task, ref, ref_green.data());
+    spectrum(ref_green.data(), pw, 0, 0, coarse, ref_coarse);
+    if (factor > 1) {
+        spectrum(ref_green.data(), pw, cx, cy, fine, ref_fine);
+    }
+
+    // the transforms are single threaded, so the frames are spread across the threads, each with its own scratch space
+    #pragma omp parallel default(none) shared(task, params, subpixel, ref, shifts, pw, ph, factor, coarse, fine, crop, cx, cy, ref_green, ref_coarse, ref_fine)
+    {
+        std::vector<float> green(pw * ph);
+        std::vector<cf32> spec;
+        #pragma omp for schedule(dynamic)
+        for (size_t j = 0; j < task.n_images; j++) {
+            if (j == ref) continue;
+            cfa_green(task, j, green.data());
+            spectrum(green.data(), pw, 0, 0, coarse, spec);
+            float fx, fy, confidence;
+            correlate(spec, ref_coarse, coarse, fx, fy, confidence);
+            fx *= (float)factor;
+            fy *= (float)factor;
+
+            if (factor > 1) {
+                const long gx = std::lround(fx), gy = std::lround(fy);
+                // the crop of the frame follows the coarse shift, so the residual is within a few samples
+                const long x0 = std::clamp<long>((long)cx + gx, 0, (long)(pw - crop));
+                const long y0 = std::clamp<long>((long)cy + gy, 0, (long)(ph - crop));
+                spectrum(green.data(), pw, x0, y0, fine, spec);
+                correlate(spec, ref_fine, fine, fx, fy, confidence);
+                fx += (float)(x0 - (long)cx);
+                fy += (float)(y0 - (long)cy);
+            }
+            if (subpixel) {
+                refine(ref_green.data(), green.data(), pw, ph, std::min(params.max_size, std::min(pw, ph)), fx, fy);
+            }
+            shifts[j] = {fx, fy, confidence};
+        }
+    }
+    return shifts;
+}
+} // anonymous namespace
+
+std::vector<Shift> estimate_shifts(const Task &task, const RegistrationParams &params)
+{
+    // one green sample is one 2x2 block of the raw frame
+    std::vector<Shift> shifts;
+    for (const Offset &o : phase_offsets(task, params, false)) {
+        shifts.push_back({2 * (int)std::lround(o.gx), 2 * (int)std::lround(o.gy), o.confidence});
+    }
+    return shifts;
+}
+
+std::vector<Affine> estimate_offsets(const Task &task, const RegistrationParams &params)
+{
+    std::vector<Affine> offsets;
+    for (const Offset &o : phase_offsets(task, params, true)) {
+        Affine T;
+        T.tx = 2.0 * o.gx;
+        T.ty = 2.0 * o.gy;
+        offsets.push_back(T);
+    }
+    return offsets;
+}
+
+
+void apply_shifts(Task &task, const std::vector<Shift> &shifts)
+{
+    std::vector<io_t> scratch(task.wh);
+    for (size_t j = 0; j < task.n_images && j < shifts.size(); j++) {
+        const Shift &s = shifts[j];
+        if (s.dx == 0 && s.dy == 0) continue;
+        warp_frame(task, j, scratch, [&s](long, long) -> const Shift & { return s; });
+    }
+}
+
+std::vector<DisplacementField> align_tiles(const Task &task, const TileAlignParams &params)
+{
+    const size_t T = std::max<size_t>(params.tile, 2);
+    const size_t ref = std::min(params.reference, task.n_images - 1);
+    std::vector<DisplacementField> fields(task.n_images);
+    for (auto &f : fields) {
+        f.tile = 2 * T;
+        f.tiles_x = (task.width + f.tile - 1) / f.tile;
+        f.tiles_y = (task.height + f.tile - 1) / f.tile;
+        f.vectors.assign(f.tiles_x * f.tiles_y, Shift {0, 0, 1.f});
+    }
+    if (task.infos.size() != task.n_images || task.width < 2 * T || task.height < 2 * T) {
+        return fields;
+    }
+
+    // a level is only useful if it still has at least one whole tile
+    size_t levels = 1, pw = task.width / 2, ph = task.height / 2;
+    while (levels < std::min<size_t>(params.levels, 4)) {
+        pw /= kLevelFactor[levels];
+        ph /= kLevelFactor[levels];
+        if (pw < T || ph < T) break;
+        levels++;
+    }
+
+    std::vector<Level> ref_pyr, alt_pyr;
+    build_pyramid(task, ref, levels, ref_pyr);
+    using Vec = std::pair<long, long>;
+    std::vector<Vec> prev, cur;
+
+    for (size_t j = 0; j < task.n_images; j++) {
+        if (j == ref) continue;
+        build_pyramid(task, j, levels, alt_pyr);
+        size_t prev_tx = 0, prev_ty = 0, tx = 0, ty = 0;
+        prev.clear();
+
+        for (size_t l = levels; l-- > 0;) {
+            const Level &R = ref_pyr[l], &A = alt_pyr[l];
+            tx = (R.w + T - 1) / T;
+            ty = (R.h + T - 1) / T;
+            cur.assign(tx * ty, {0, 0});
+            // L2 is more robust to noise at the coarse levels, L1 is more robust to outliers at the finest one
+            const bool l2 = l > 0;
+            const long radius = l == 0 ? 2 : params.search;
+            const long ratio = l + 1 < levels ? (long)kLevelFactor[l + 1] : 1;
+
+            #pragma omp parallel for default(none) shared(R, A, T, tx, ty, prev, prev_tx, prev_ty, cur, l2, radius, ratio) schedule(dynamic)
+            for (size_t t = 0; t < tx * ty; t++) {
+                const long x0 = (long)((t % tx) * T), y0 = (long)((t / tx) * T);
+                const long x1 = std::min<long>(x0 + (long)T, (long)R.w), y1 = std::min<long>(y0 + (long)T, (long)R.h);
+
+                // the guess comes from the coarser tile under this one, or one of its two nearest neighbours, whichever
+                // fits best at this level
+                Vec guess {0, 0};
+                if (!prev.empty()) {
+                    const long cx = (x0 + x1) / 2 / ratio, cy = (y0 + y1) / 2 / ratio;
+                    const long px = std::min<long>(cx / (long)T, (long)prev_tx - 1);
+                    const long py = std::min<long>(cy / (long)T, (long)prev_ty - 1);
+                    const long nx = std::clamp<long>(px + (cx % (long)T < (long)T / 2 ? -1 : 1), 0, (long)prev_tx - 1);
+                    const long ny = std::clamp<long>(py + (cy % (long)T < (long)T / 2 ? -1 : 1), 0, (long)prev_ty - 1);
+                    float best = std::numeric_limits<float>::infinity();
+                    for (const Vec &c : {prev[py * prev_tx + px], prev[py * prev_tx + nx], prev[ny * prev_tx + px]}) {
+                        const Vec g {c.first * ratio, c.second * ratio};
+                        const float cost = tile_cost(R, A, x0, y0, x1, y1, g.first, g.second, l2);
+                        if (cost < best) {
+                            best = cost;
+                            guess = g;
+                        }
+                    }
+                }
+
+                Vec found = guess;
+                float best = std::numeric_limits<float>::infinity();
+                for (long v = guess.second - radius; v <= guess.second + radius; v++) {
+                    for (long u = guess.first - radius; u <= guess.first + radius; u++) {
+                        const float cost = tile_cost(R, A, x0, y0, x1, y1, u, v, l2);
+                        if (cost < best) {
+                            best = cost;
+                            found = {u, v};
+                        }
+                    }
+                }
+                cur[t] = found;
+            }
+            std::swap(prev, cur);
+            prev_tx = tx;
+            prev_ty = ty;
+        }
+
+        // one tile of the finest level is one tile of the field, an odd width or height may add one more at the edge
+        DisplacementField &f = fields[j];
+        for (size_t y = 0; y < f.tiles_y; y++) {
+            for (size_t x = 0; x < f.tiles_x; x++) {
+                const Vec &v = prev[std::min(y, prev_ty - 1) * prev_tx + std::min(x, prev_tx - 1)];
+                f.vectors[y * f.tiles_x + x] = Shift {2 * (int)v.first, 2 * (int)v.second, 1.f};
+            }
+        }
+    }
+    return fields;
+}
+
+void apply_displacements(Task &task, const std::vector<DisplacementField> &fields)
+{
+    std::vector<io_t> scratch(task.wh);
+    for (size_t j = 0; j < task.n_images && j < fields.size(); j++) {
+        const DisplacementField &f = fields[j];
+        const bool moved = std::any_of(f.vectors.begin(), f.vectors.end(), [](const Shift &s) {
+            return s.dx != 0 || s.dy != 0;
+        });
+        if (!moved) continue;
+        warp_frame(task, j, scratch, [&f](long x, long y) -> const Shift & { return f.at(2 * x, 2 * y); });
+    }
+}
+
+} // namespace r2r
@@ -0,0 +1,69 @@
+/**
+ * Raw2Raw
+ * core/register.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of the global registration, which estimates the translation of every frame of a
+ * task against a reference frame by phase correlation, and shifts the frames so that they line up. The correlation is
+ * done on the green channel (one sample per 2x2 block), downsampled so that the transforms stay small, and the shifts
+ * are applied in steps of 2 pixels so that the CFA pattern is preserved without demosaicing.
+ *
+ * For parallax and rolling shutter, the local alignment finds one displacement per tile instead, by block matching
+ * from coarse to fine on a pyramid of the green channel.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+#include "warp.h"
+
+namespace r2r {
+
+/* Translation of a frame in raw pixels: frame(x + dx, y + dy) matches reference(x, y). Both are multiples of 2. */
+struct Shift {
+    int dx {0}, dy {0};
+    float confidence {0.f};         // height of the correlation peak, from 0 (no match) to 1 (identical frames)
+};
+
+struct RegistrationParams {
+    size_t reference {0};           // index of the frame the others are aligned to
+    size_t max_size {1024};         // the green channel is downsampled until it fits in max_size x max_size
+};
+
+/* Estimate the shift of every frame of the task. The shift of the reference is always zero. */
+std::vector<Shift> estimate_shifts(const Task &task, const RegistrationParams &params = {});
+
+/* The same estimate without rounding, as a pure translation with sub-pixel precision, e.g. for drizzle */
+std::vector<Affine> estimate_offsets(const Task &task, const RegistrationParams &params = {});
+
+/* Shift every frame of the task in place. The pixels that are shifted in from outside the frame repeat the nearest
+ * pixel of the same color.
+ */
+void apply_shifts(Task &task, const std::vector<Shift> &shifts);
+
+struct TileAlignParams {
+    size_t reference {0};
+    size_t tile {16};               // tile size in green samples, i.e. tiles of 2 * tile raw pixels
+    size_t levels {4};              // pyramid levels (at most 4), downsampled by 1, 2, 8 and 32
+    int search {4};                 // search radius in samples at the coarse levels, the finest level searches +/- 2
+};
+
+/* Displacement of every tile of a frame, in raw pixels (multiples of 2), with the convention of Shift. The tiles cover
+ * the frame in row-major order, starting at the top left corner, and the last row and column may be cut short.
+ */
+struct DisplacementField {
+    size_t tile {0};                // raw pixels
+    size_t tiles_x {0}, tiles_y {0};
+    std::vector<Shift> vectors;
+
+    const Shift &at(size_t x, size_t y) const { return vectors[(y / tile) * tiles_x + x / tile]; }
+};
+
+/* Estimate the displacement field of every frame of the task. The field of the reference is all zero. */
+std::vector<DisplacementField> align_tiles(const Task &task, const TileAlignParams &params = {});
+
+/* Move every tile of every frame of the task in place, with the same edge handling as apply_shifts */
+void apply_displacements(Task &task, const std::vector<DisplacementField> &fields);
+
+} // namespace r2r
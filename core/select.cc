@@ -0,0 +1,188 @@
+/**
+ * Raw2Raw
+ * core/select.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the sorting network and the radix sort of the rank based reductions.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "select.h"
+#include <algorithm>
+#include <cmath>
+
+namespace r2r {
+
+SortingNetwork::SortingNetwork(size_t n)
+{
+    if (n > kMaxInputs) {
+        return;
+    }
+    // the comparators of the network for the next power of two, without those that touch the (infinite) padding
+    for (size_t p = 1; p < n; p <<= 1) {
+        for (size_t k = p; k >= 1; k >>= 1) {
+            for (size_t j = k % p; j + k < n; j += 2 * k) {
+                for (size_t i = 0; i < std::min(k, n - j - k); i++) {
+                    if ((i + j) / (2 * p) == (i + j + k) / (2 * p)) {
+                        comparators.emplace_back((u16)(i + j), (u16)(i + j + k));
+                    }
+                }
+            }
+        }
+    }
+}
+
+void SortingNetwork::sort(io_t *block, size_t lanes) const
+{
+    for (const auto &[i, j] : comparators) {
+        io_t *a = block + i * kLanes, *b = block + j * kLanes;
+        #pragma omp simd
+        for (size_t l = 0; l < lanes; l++) {
+            const io_t lo = std::min(a[l], b[l]), hi = std::max(a[l], b[l]);
+            a[l] = lo;
+            b[l] = hi;
+        }
+    }
+}
+
+void radix_sort(io_t *v, size_t n, io_t *tmp)
+{
+    u32 lo[257] = {0}, hi[257] = {0};
+    for (size_t i = 0; i < n; i++) {
+        lo[(v[i] & 0xff) + 1]++;
+        hi[(v[i] >> 8) + 1]++;
+    }
+    for (size_t b = 0; b < 256; b++) {
+        lo[b + 1] += lo[b];
+        hi[b + 1] += hi[b];
+    }
+    for (size_t i = 0; i < n; i++) tmp[lo[v[i] & 0xff]++] = v[i];
+    for (size_t i = 0; i < n; i++) v[hi[tmp[i] >> 8]++] = tmp[i];
+}
+
+void sort_pixels(const Task &task, size_t i0, size_t lanes, const SortingNetwork &network, io_t *block,
+                 std::vector<io_t> &scratch)
+{
+    const size_t n = task.n_images, L = SortingNetwork::kLanes;
+    for (size_t j = 0; j < n; j++) {
+        const io_t *src = task.data + j * task.wh + i0;
+        std::copy(src, src + lanes, block + j * L);
+    }
+    if (n <= SortingNetwork::kMaxInputs) {
+        network.sort(block, lanes);
+        return;
+    }
+    scratch.resize(2 * n);
+    io_t *v = scratch.data(), *tmp = v + n;
+    for (size_t l = 0; l < lanes; l++) {
+        for (size_t j = 0; j < n; j++) v[j] = block[j * L + l];
+        radix_sort(v, n, tmp);
+        for (size_t j = 0; j < n; j++) block[j * L + l] = v[j];
+    }
+}
+
+bool RankStatistic::supported(pReduction reduction)
+{
+    switch (reduction) {
+        case pReduction::MEDIAN:
+        case pReduction::PERCENTILE:
+        case pReduction::TRIMMED_MEAN:
+        case pReduction::MODE:
+        case pReduction::CLIPPED_MEAN:
+        case pReduction::MINIMUM:
+        case pReduction::MAXIMUM:
+        case pReduction::RANGE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+RankStatistic::RankStatistic(pReduction reduction, const ReductionParams &params, size_t n)
+    : reduction(reduction), n(n), bin(std::max<u32>(params.mode_bin, 1)), kappa(std::max(0.f, params.kappa))
+{
+    switch (reduction) {
+        case pReduction::MEDIAN:
+            lo = n / 2;
+            break;
+        case pReduction::PERCENTILE:
+            // the nearest rank, which is the upper median at 50
+            lo = std::min<size_t>(n - 1, (size_t)std::lround(std::clamp(params.percentile, 0.f, 100.f) / 100.f * (n - 1)));
+            break;
+        case pReduction::TRIMMED_MEAN:
+            lo = (size_t)(std::clamp(params.trim, 0.f, 50.f) / 100.f * n);
+            hi = n - lo;
+            if (hi <= lo) {
+                // nothing is left between the trimmed ends, so take the median
+                lo = n / 2;
+                hi = lo + 1;
+            }
+            break;
+        case pReduction::MAXIMUM:
+            lo = n - 1;
+            break;
+        default:
+            break;
+    }
+}
+
+io_t RankStatistic::operator()(const io_t *sorted, size_t stride) const
+{
+    switch (reduction) {
+        case pReduction::MEDIAN:
+        case pReduction::PERCENTILE:
+        case pReduction::MINIMUM:
+        case pReduction::MAXIMUM:
+            return sorted[lo * stride];
+        case pReduction::RANGE:
+            return sorted[(n - 1) * stride] - sorted[0];
+        case pReduction::TRIMMED_MEAN: {
+            interm_t s = 0;
+            for (size_t j = lo; j < hi; j++) s += sorted[j * stride];
+            return (io_t)((s + (hi - lo) / 2) / (hi - lo));
+        }
+        case pReduction::MODE: {
+            // the samples of a bin are consecutive once sorted, so the fullest bin is the longest run. Ties go to the
+            // darker bin.
+            size_t best_count = 0, start = 0;
+            interm_t best_sum = 0, s = 0;
+            for (size_t j = 0; j < n; j++) {
+                const io_t v = sorted[j * stride];
+                if (v / bin != sorted[start * stride] / bin) {
+                    start = j;
+                    s = 0;
+                }
+                s += v;
+                if (j + 1 - start > best_count) {
+                    best_count = j + 1 - start;
+                    best_sum = s;
+                }
+            }
+            return (io_t)((best_sum + best_count / 2) / best_count);
+        }
+        case pReduction::CLIPPED_MEAN: {
+            // kappa standard deviations around the median, where the standard deviation is estimated from the
+            // interquartile range. The samples that are kept are a contiguous run of ranks.
+            const float median = sorted[(n / 2) * stride];
+            const float sigma = (float)(sorted[(3 * n / 4) * stride] - sorted[(n / 4) * stride]) / 1.349f;
+            const float low = median - kappa * sigma, high = median + kappa * sigma;
+            interm_t s = 0, count = 0;
+            for (size_t j = 0; j < n; j++) {
+                const io_t v = sorted[j * stride];
+                if (v < low) continue;
+                if (v > high) break;
+                s += v;
+                count++;
+            }
+            // kappa is not negative, so the median itself is always kept, but never divide by zero
+            if (count == 0) return (io_t)median;
+            return (io_t)((s + count / 2) / count);
+        }
+        default:
+            return 0;
+    }
+}
+
+} // namespace r2r
@@ -0,0 +1,95 @@
+/**
+ * Raw2Raw
+ * core/select.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of the order statistics machinery shared by the rank based reductions (median,
+ * percentile, trimmed mean, mode and clipped mean) and the sorted stack index. The samples of a pixel are put in order
+ * without a comparison sort:
+ * - for small stacks, a sorting network orders a block of pixels at once. The network is a fixed sequence of
+ *   compare-exchanges between frames, so every compare-exchange is a min and a max over the pixels of the block, which
+ *   the compiler vectorizes
+ * - for large stacks, each pixel is ordered by two counting passes over the bytes of its samples (a radix sort), which
+ *   is linear in the number of frames
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+#include "progress.h"
+
+namespace r2r {
+
+/* Batcher's odd-even merge sort network for n inputs */
+class SortingNetwork {
+public:
+    static constexpr size_t kMaxInputs = 64;    // larger stacks are radix sorted per pixel
+    static constexpr size_t kLanes = 64;        // pixels that are sorted together
+
+    /* The network is empty if n is larger than kMaxInputs */
+    explicit SortingNetwork(size_t n);
+
+    /* Sort each of the lanes columns of a block, where sample j of lane l is block[j * kLanes + l] */
+    void sort(io_t *block, size_t lanes = kLanes) const;
+
+private:
+    std::vector<std::pair<u16, u16>> comparators;
+};
+
+/* Sort n samples with two counting passes, using tmp (n samples) as scratch */
+void radix_sort(io_t *v, size_t n, io_t *tmp);
+
+/* Gather the samples of the pixels [i0, i0 + lanes) of a task into a block of n_images x kLanes samples, and sort each
+ * pixel. scratch is resized as needed.
+ */
+void sort_pixels(const Task &task, size_t i0, size_t lanes, const SortingNetwork &network, io_t *block,
+                 std::vector<io_t> &scratch);
+
+/* A reduction of the sorted samples of a pixel. Supports MEDIAN, PERCENTILE, TRIMMED_MEAN, MODE, CLIPPED_MEAN,
+ * MINIMUM, MAXIMUM and RANGE.
+ */
+class RankStatistic {
+public:
+    static bool supported(pReduction reduction);
+    RankStatistic(pReduction reduction, const ReductionParams &params, size_t n);
+
+    /* sorted[j * stride] is the j-th smallest of the n samples of a pixel */
+    io_t operator()(const io_t *sorted, size_t stride) const;
+
+private:
+    pReduction reduction;
+    size_t n, lo {0}, hi {0};       // the ranks that are averaged, or lo is the rank that is taken
+    u32 bin {1};
+    float kappa {3.f};
+};
+
+/* Call f(sorted, stride) for every pixel of the task, where sorted[j * stride] is the j-th smallest sample of the
+ * pixel, and store what it returns in the output, which is in the same layout as the task.
+ */
+template<typename F>
+Buffer<io_t> rank_reduce(const Task &task, F &&f)
+{
+    const size_t n = task.n_images, wh = task.wh;
+    const size_t L = SortingNetwork::kLanes, n_blocks = (wh + L - 1) / L;
+    const SortingNetwork network(n);
+    Buffer<io_t> out(wh);
+    io_t *ans = out.get();
+    #pragma omp parallel default(none) shared(task, f, ans, network, n, wh, L, n_blocks)
+    {
+        std::vector<io_t> block(n * L), scratch;
+        #pragma omp for schedule(static)
+        for (size_t b = 0; b < n_blocks; b++) {
+            if (cancelled(task.progress)) continue;
+            const size_t i0 = b * L, lanes = std::min(L, wh - i0);
+            sort_pixels(task, i0, lanes, network, block.data(), scratch);
+            for (size_t l = 0; l < lanes; l++) {
+                ans[i0 + l] = f(block.data() + l, L);
+            }
+            advance(task.progress, lanes);
+        }
+    }
+    return out;
+}
+
+} // namespace r2r
@@ -0,0 +1,268 @@
+/**
+ * Raw2Raw
+ * core/sliding.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the sliding window engine.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "sliding.h"
+#include "stream.h"
+#include <algorithm>
+#include <bit>
+
+namespace r2r {
+
+namespace {
+/* Running maximum (or minimum) over the last w frames, using the van Herk/Gil-Werman algorithm. The sequence is cut in
+ * blocks of w frames. The window ending at frame m covers the tail of the previous block and the head of the current
+ * one, so its extreme is the extreme of a suffix of the previous block and a prefix of the current one. The frames of
+ * a block are stored as they arrive, and replaced in place by their suffix extremes once the block is complete; a slot
+ * is only overwritten by the next block after its suffix has been used for the last time.
+ */
+template<bool Max>
+class RunningExtreme {
+public:
+    RunningExtreme() = default;
+    RunningExtreme(size_t w, size_t wh) : w(w), wh(wh), blocks(w * wh), prefix(wh) {}
+
+    static io_t op(io_t a, io_t b) { return Max ? std::max(a, b) : std::min(a, b); }
+
+    void push(size_t m, const io_t *frame)
+    {
+        const size_t q = m % w;
+        io_t *slot = blocks.data() + q * wh;
+        io_t *pre = prefix.data();
+        const size_t n = wh;
+        #pragma omp parallel for default(none) shared(frame, slot, pre, q, n) schedule(static)
+        for (size_t i = 0; i < n; i++) {
+            slot[i] = frame[i];
+            pre[i] = q == 0 ? frame[i] : op(pre[i], frame[i]);
+        }
+    }
+
+    /* Extreme of pixel i over the window that ends at frame m */
+    io_t at(size_t m, size_t i) const
+    {
+        const size_t k = (m + 1 - w) % w;
+        return k == 0 ? prefix[i] : op(blocks[k * wh + i], prefix[i]);
+    }
+
+    /* Must be called after the window ending at frame m has been read */
+    void close_block(size_t m)
+    {
+        if (m % w != w - 1) {
+            return;
+        }
+        for (size_t s = w - 1; s-- > 0;) {
+            io_t *cur = blocks.data() + s * wh;
+            const io_t *nxt = cur + wh;
+            const size_t n = wh;
+            #pragma omp parallel for default(none) shared(cur, nxt, n) schedule(static)
+            for (size_t i = 0; i < n; i++) {
+                cur[i] = op(cur[i], nxt[i]);
+            }
+        }
+    }
+
+private:
+    size_t w {0}, wh {0};
+    std::vector<io_t> blocks, prefix;
+};
+
+/* Running median of the window of every pixel, from a two level histogram of its samples. The coarse level counts the
+ * samples by their top bits, and the fine level counts the samples of one coarse bin (the one of the median) by their
+ * low bits. Both levels keep a cursor at the median, with the number of samples below it, so a sample that enters or
+ * leaves the window is O(1), and the cursors only move as far as the median does. When the median moves into another
+ * coarse bin, the fine level is counted again from the samples of the window.
+ */
+class RunningMedian {
+public:
+    RunningMedian() = default;
+    RunningMedian(size_t w, size_t wh, u32 max_val)
+        : w(w), wh(wh), max_val(max_val), shift(std::bit_width(std::max<u32>(max_val, 3)) / 2),
+          n_coarse((max_val >> shift) + 1), n_fine(1u << shift), coarse(wh * n_coarse), fine(wh * n_fine), bin(wh),
+          below(wh), cursor(wh), below_cursor(wh)
+    {
+    }
+
+    /* The counters of a pixel, to compare with the w samples of a sorted window */
+    static size_t counters(u32 max_val)
+    {
+        const u32 s = std::bit_width(std::max<u32>(max_val, 3)) / 2;
+        return (max_val >> s) + 1 + (1u << s);
+    }
+
+    /* Add (d = 1) or remove (d = -1) a sample of pixel i. Samples above max_val count as max_val. */
+    void count(size_t i, io_t v, int d)
+    {
+        const u32 c = std::min<u32>(v, max_val) >> shift, f = std::min<u32>(v, max_val) & (n_fine - 1);
+        coarse[i * n_coarse + c] += d;
+        if (c < bin[i]) {
+            below[i] += d;
+        } else if (c == bin[i]) {
+            fine[i * n_fine + f] += d;
+            if (f < cursor[i]) below_cursor[i] += d;
+        }
+    }
+
+    /* The median of pixel i (the sample of rank w / 2), where ring holds the w frames of the window */
+    io_t at(size_t i, const io_t *ring)
+    {
+        const size_t k = w / 2;
+        const u16 *c = coarse.data() + i * n_coarse;
+        u16 *f = fine.data() + i * n_fine;
+        const u32 old = bin[i];
+        while (k < below[i]) {
+            below[i] -= c[--bin[i]];
+        }
+        while (k >= (size_t)below[i] + c[bin[i]]) {
+            below[i] += c[bin[i]++];
+        }
+        if (bin[i] != old) {
+            std::fill(f, f + n_fine, 0);
+            for (size_t s = 0; s < w; s++) {
+                const u32 v = std::min<u32>(ring[s * wh + i], max_val);
+                if (v >> shift == bin[i]) f[v & (n_fine - 1)]++;
+            }
+            cursor[i] = 0;
+            below_cursor[i] = 0;
+        }
+        const size_t r = k - below[i];
+        while (r < below_cursor[i]) {
+            below_cursor[i] -= f[--cursor[i]];
+        }
+        while (r >= (size_t)below_cursor[i] + f[cursor[i]]) {
+            below_cursor[i] += f[cursor[i]++];
+        }
+        return (io_t)((bin[i] << shift) | cursor[i]);
+    }
+
+private:
+    size_t w {0}, wh {0};
+    u32 max_val {0}, shift {0}, n_coarse {0}, n_fine {0};
+    std::vector<u16> coarse, fine;                  // pixel-major
+    std::vector<u16> bin, below;                    // the coarse bin of the median, and the samples in the bins below
+    std::vector<u16> cursor, below_cursor;          // the same in the fine level of that bin
+};
+} // anonymous namespace
+
+void sliding_reduce(const std::vector<std::filesystem::path> &files, const SlidingParams &params,
+                    const SlidingEmit &emit)
+{
+    const pReduction reduction = params.reduction;
+    const bool sums = reduction == pReduction::MEAN || reduction == pReduction::SUMMATION;
+    const bool maxes = reduction == pReduction::MAXIMUM || reduction == pReduction::RANGE;
+    const bool mins = reduction == pReduction::MINIMUM || reduction == pReduction::RANGE;
+    const bool median = reduction == pReduction::MEDIAN;
+    if (!sums && !maxes && !mins && !median) {
+        throw std::invalid_argument("the reduction cannot be computed over a sliding window");
+    }
+    const size_t w = params.window, step = std::max<size_t>(params.step, 1);
+    if (w == 0 || w > files.size()) {
+        throw std::invalid_argument("the window must be between 1 and the number of frames");
+    }
+
+    FrameStream stream(files, params.options);
+    const size_t wh = stream.wh;
+    const interm_t limit = stream.max_val;
+
+    // a long window takes the median from histograms, which are then smaller than the sorted window and O(1) to update
+    const bool histogram = median && w >= RunningMedian::counters(stream.max_val);
+    if (histogram && w > 0xffff) {
+        throw std::invalid_argument("the median can only be taken over windows of up to 65535 frames");
+    }
+
+    // the raw frames of the window are only needed to take the outgoing frame out of the sums and the median
+    std::vector<io_t> ring((sums || median) ? w * wh : 0);
+    std::vector<interm_t> sum(sums ? wh : 0, 0);
+    // pixel-major, the samples of each pixel's window in order
+    std::vector<io_t> sorted(median && !histogram ? w * wh : 0);
+    RunningExtreme<true> hi;
+    RunningExtreme<false> lo;
+    RunningMedian med;
+    if (maxes) hi = RunningExtreme<true>(w, wh);
+    if (mins) lo = RunningExtreme<false>(w, wh);
+    if (histogram) med = RunningMedian(w, wh, stream.max_val);
+    std::vector<io_t> ans(wh);
+
+    while (const io_t *frame = stream.next()) {
+        const size_t m = stream.index();
+        const size_t n = std::min(m, w);    // number of samples in the window before this frame
+        const bool evict = m >= w;
+
+        if (!ring.empty()) {
+            io_t *slot = ring.data() + (m % w) * wh;
+            #pragma omp parallel for default(none) shared(frame, slot, sum, sorted, med, n, evict, sums, median, \
+                                                          histogram, w, wh) schedule(static)
+            for (size_t i = 0; i < wh; i++) {
+                const io_t v = frame[i];
+                if (sums) {
+                    sum[i] += v - (evict ? slot[i] : 0);
+                }
+                if (histogram) {
+                    if (evict) med.count(i, slot[i], -1);
+                    med.count(i, v, 1);
+                } else if (median) {
+                    io_t *s = sorted.data() + i * w;
+                    size_t p = n;
+                    if (evict) {
+                        // reuse the position of the outgoing sample, and move the new one to its place from there
+                        p = std::lower_bound(s, s + n, slot[i]) - s;
+                        while (p + 1 < n && s[p + 1] < v) {
+                            s[p] = s[p + 1];
+                            p++;
+                        }
+                    }
+                    while (p > 0 && s[p - 1] > v) {
+                        s[p] = s[p - 1];
+                        p--;
+                    }
+                    s[p] = v;
+                }
+                slot[i] = v;
+            }
+        }
+        if (maxes) hi.push(m, frame);
+        if (mins) lo.push(m, frame);
+
+        if (m + 1 >= w && (m + 1 - w) % step == 0) {
+            io_t *out = ans.data();
+            const io_t *window = ring.data();
+            #pragma omp parallel for default(none) shared(out, sum, sorted, hi, lo, med, window, histogram, reduction, \
+                                                          m, w, wh, limit) schedule(static)
+            for (size_t i = 0; i < wh; i++) {
+                switch (reduction) {
+                    case pReduction::MEAN:
+                        out[i] = sum[i] / w;
+                        break;
+                    case pReduction::SUMMATION:
+                        out[i] = std::min(sum[i], limit);
+                        break;
+                    case pReduction::MAXIMUM:
+                        out[i] = hi.at(m, i);
+                        break;
+                    case pReduction::MINIMUM:
+                        out[i] = lo.at(m, i);
+                        break;
+                    case pReduction::RANGE:
+                        out[i] = hi.at(m, i) - lo.at(m, i);
+                        break;
+                    case pReduction::MEDIAN:
+                        out[i] = histogram ? med.at(i, window) : sorted[i * w + w / 2];
+                        break;
+                    default:
+                        out[i] = 0;
+                }
+            }
+            emit(m + 1 - w, out);
+        }
+        if (maxes) hi.close_block(m);
+        if (mins) lo.close_block(m);
+    }
+}
+
+} // namespace r2r
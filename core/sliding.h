@@ -0,0 +1,46 @@
+/**
+ * Raw2Raw
+ * core/sliding.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of the sliding window engine, which reduces every window [k, k + window) of a
+ * sequence of frames, e.g. for timelapse trails or temporal denoising. Each frame is decoded exactly once, and the
+ * reductions are updated incrementally as the window slides:
+ * - mean and sum keep running sums, and subtract the frame that leaves the window
+ * - minimum and maximum use the van Herk/Gil-Werman algorithm (block prefix and suffix extremes), which is the
+ *   branch-free equivalent of a monotonic deque, with O(1) amortized work per pixel per step
+ * - median keeps a two level (coarse and fine) histogram of each pixel's window, with O(1) amortized work per pixel
+ *   per step. A histogram has about 2^(b/2 + 1) counters for b bit samples, so a window of fewer frames than that
+ *   keeps its samples sorted instead, and moves the incoming sample to the place of the outgoing one, which takes less
+ *   memory and is as fast for such a window
+ *
+ * Only a window's worth of frames is kept in memory, never the whole sequence.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+#include <functional>
+#include <stdexcept>
+
+namespace r2r {
+
+struct SlidingParams {
+    size_t window {2};
+    size_t step {1};                // only every step-th window is emitted
+    pReduction reduction {pReduction::MEAN};   // MEAN, SUMMATION, MAXIMUM, MINIMUM, RANGE or MEDIAN
+    TaskOptions options {};         // only the calibration is used
+};
+
+/* Called with the index of the first frame of a window and the reduced window. The data is only valid during the call.
+ */
+using SlidingEmit = std::function<void(size_t first, const io_t *ans)>;
+
+/* Run a sliding window reduction over a sequence of files. Throws a ParserErrors if a file cannot be read, and
+ * std::invalid_argument if the reduction is not supported or the window is longer than the sequence.
+ */
+void sliding_reduce(const std::vector<std::filesystem::path> &files, const SlidingParams &params,
+                    const SlidingEmit &emit);
+
+} // namespace r2r
@@ -0,0 +1,221 @@
+/**
+ * Raw2Raw
+ * core/sorted.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the sorted stack index.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "sorted.h"
+#include "cfa.h"
+#include "progress.h"
+#include <cstring>
+#include <fstream>
+
+namespace {
+constexpr char kSortedMagic[4] = {'R', '2', 'R', 'S'};
+constexpr r2r::u32 kSortedVersion = 2;        // 2: fingerprint of the options
+
+template<typename T>
+void write_vec(std::ofstream &out, const std::vector<T> &v)
+{
+    r2r::u64 n = v.size();
+    out.write(reinterpret_cast<const char *>(&n), sizeof(n));
+    out.write(reinterpret_cast<const char *>(v.data()), (std::streamsize)(n * sizeof(T)));
+}
+
+template<typename T>
+void read_vec(std::ifstream &in, std::vector<T> &v)
+{
+    r2r::u64 n = 0;
+    in.read(reinterpret_cast<char *>(&n), sizeof(n));
+    v.resize(in ? n : 0);
+    in.read(reinterpret_cast<char *>(v.data()), (std::streamsize)(v.size() * sizeof(T)));
+}
+
+/* LEB128: 7 bits per byte, the high bit is set on every byte but the last */
+inline void put_varint(std::vector<r2r::u8> &out, r2r::u32 v)
+{
+    while (v >= 0x80) {
+        out.push_back((r2r::u8)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((r2r::u8)v);
+}
+
+/* Reads nothing past end, so a corrupt block cannot overrun its bytes */
+inline r2r::u32 get_varint(const r2r::u8 *&p, const r2r::u8 *end)
+{
+    r2r::u32 v = 0;
+    for (int shift = 0; p < end && shift < 32; shift += 7) {
+        const r2r::u8 b = *p++;
+        v |= (r2r::u32)(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+    }
+    return v;
+}
+} // anonymous namespace
+
+namespace r2r {
+
+SortedStack::SortedStack(const Task &task)
+    : n_images(task.n_images), width(task.width), height(task.height), wh(task.wh), max_val(task.max_val),
+      layout(task.layout)
+{
+    const size_t n = n_images, L = SortingNetwork::kLanes, n_blocks = (wh + L - 1) / L;
+    const SortingNetwork network(n);
+    data.resize(n_blocks * n * L);
+    io_t *blocks = data.data();
+    if (task.progress) task.progress->begin(Stage::REDUCE, wh);
+    #pragma omp parallel default(none) shared(task, network, blocks, n, L, n_blocks)
+    {
+        std::vector<io_t> scratch;
+        #pragma omp for schedule(static)
+        for (size_t b = 0; b < n_blocks; b++) {
+            if (cancelled(task.progress)) continue;
+            const size_t i0 = b * L, lanes = std::min(L, task.wh - i0);
+            sort_pixels(task, i0, lanes, network, blocks + b * n * L, scratch);
+            advance(task.progress, lanes);
+        }
+    }
+    if (cancelled(task.progress)) {
+        throw ParserErrors::CANCELLED;
+    }
+}
+
+Buffer<io_t> SortedStack::reduce(pReduction reduction, const ReductionParams &params) const
+{
+    if (!RankStatistic::supported(reduction) || n_images == 0) {
+        return {};
+    }
+    return scan(RankStatistic(reduction, params, n_images));
+}
+
+Buffer<io_t> SortedStack::interleave(Buffer<io_t> ans) const
+{
+    if (layout != Layout::CFA_PLANES) {
+        return ans;
+    }
+    Buffer<io_t> out(wh);
+    cfa_merge(ans.get(), out.get(), width, height);
+    return out;
+}
+
+ParserErrors SortedStack::save(const std::filesystem::path &file, bool compress) const
+{
+    std::ofstream out(file, std::ios::binary);
+    if (!out.is_open()) {
+        return ParserErrors::CANNOT_OPEN_FILE;
+    }
+    u64 header[7] = {n_images, width, height, max_val, (u64)layout, compress, fingerprint};
+    out.write(kSortedMagic, sizeof(kSortedMagic));
+    out.write(reinterpret_cast<const char *>(&kSortedVersion), sizeof(kSortedVersion));
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    u64 n_sources = sources.size();
+    out.write(reinterpret_cast<const char *>(&n_sources), sizeof(n_sources));
+    for (const auto &src : sources) {
+        std::string s = src.string();
+        write_vec(out, std::vector<char>(s.begin(), s.end()));
+    }
+    if (!compress) {
+        write_vec(out, data);
+        return out.good() ? ParserErrors::PARSE_SUCCESS : ParserErrors::CANNOT_OPEN_FILE;
+    }
+
+    // every block is coded on its own, one pixel after the other, so that blocks can be decoded in parallel
+    const size_t n = n_images, L = SortingNetwork::kLanes, n_blocks = data.size() / std::max<size_t>(n * L, 1);
+    std::vector<std::vector<u8>> coded(n_blocks);
+    const io_t *blocks = data.data();
+    #pragma omp parallel for default(none) shared(coded, blocks, n, L, n_blocks) schedule(static)
+    for (size_t b = 0; b < n_blocks; b++) {
+        const io_t *block = blocks + b * n * L;
+        std::vector<u8> &c = coded[b];
+        for (size_t l = 0; l < L; l++) {
+            io_t prev = 0;
+            for (size_t j = 0; j < n; j++) {
+                put_varint(c, block[j * L + l] - prev);
+                prev = block[j * L + l];
+            }
+        }
+    }
+    std::vector<u64> sizes(n_blocks);
+    for (size_t b = 0; b < n_blocks; b++) sizes[b] = coded[b].size();
+    write_vec(out, sizes);
+    for (const auto &c : coded) {
+        out.write(reinterpret_cast<const char *>(c.data()), (std::streamsize)c.size());
+    }
+    return out.good() ? ParserErrors::PARSE_SUCCESS : ParserErrors::CANNOT_OPEN_FILE;
+}
+
+ParserErrors SortedStack::load(const std::filesystem::path &file)
+{
+    std::ifstream in(file, std::ios::binary);
+    if (!in.is_open()) {
+        return ParserErrors::CANNOT_OPEN_FILE;
+    }
+    char magic[4];
+    u32 version;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char *>(&version), sizeof(version));
+    if (!in || memcmp(magic, kSortedMagic, sizeof(magic)) != 0 || version != kSortedVersion) {
+        return ParserErrors::CANNOT_UNPACK_FILE;
+    }
+    u64 header[7];
+    in.read(reinterpret_cast<char *>(header), sizeof(header));
+    n_images = header[0];
+    width = header[1];
+    height = header[2];
+    wh = width * height;
+    max_val = (u32)header[3];
+    layout = (Layout)header[4];
+    const bool compressed = header[5] != 0;
+    fingerprint = header[6];
+
+    u64 n_sources = 0;
+    in.read(reinterpret_cast<char *>(&n_sources), sizeof(n_sources));
+    sources.clear();
+    for (u64 k = 0; in && k < n_sources; k++) {
+        std::vector<char> s;
+        read_vec(in, s);
+        sources.emplace_back(std::string(s.begin(), s.end()));
+    }
+
+    const size_t n = n_images, L = SortingNetwork::kLanes, n_blocks = (wh + L - 1) / L;
+    if (!compressed) {
+        read_vec(in, data);
+        return in && data.size() == n_blocks * n * L ? ParserErrors::PARSE_SUCCESS : ParserErrors::SIZE_MISMATCH;
+    }
+
+    std::vector<u64> sizes;
+    read_vec(in, sizes);
+    if (!in || sizes.size() != n_blocks) {
+        return ParserErrors::SIZE_MISMATCH;
+    }
+    std::vector<u64> offsets(n_blocks + 1, 0);
+    for (size_t b = 0; b < n_blocks; b++) offsets[b + 1] = offsets[b] + sizes[b];
+    std::vector<u8> coded(offsets[n_blocks]);
+    in.read(reinterpret_cast<char *>(coded.data()), (std::streamsize)coded.size());
+    if (!in) {
+        return ParserErrors::SIZE_MISMATCH;
+    }
+    data.assign(n_blocks * n * L, 0);
+    io_t *blocks = data.data();
+    #pragma omp parallel for default(none) shared(coded, offsets, blocks, n, L, n_blocks) schedule(static)
+    for (size_t b = 0; b < n_blocks; b++) {
+        const u8 *p = coded.data() + offsets[b], *end = coded.data() + offsets[b + 1];
+        io_t *block = blocks + b * n * L;
+        for (size_t l = 0; l < L; l++) {
+            io_t v = 0;
+            for (size_t j = 0; j < n; j++) {
+                v += (io_t)get_varint(p, end);
+                block[j * L + l] = v;
+            }
+        }
+    }
+    return ParserErrors::PARSE_SUCCESS;
+}
+
+} // namespace r2r
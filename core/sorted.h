@@ -0,0 +1,73 @@
+/**
+ * Raw2Raw
+ * core/sorted.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of the sorted stack, an index of the samples of every pixel in order. It is built
+ * once from a task with the machinery of core/select.h, and after that every rank based reduction (median, any
+ * percentile, trimmed or clipped mean, mode) is a sequential scan that does not gather or sort anything, so tuning the
+ * reduction of a selection is instant.
+ *
+ * The samples are stored in tiles of SortingNetwork::kLanes pixels, with the j-th smallest sample of all the pixels of
+ * a tile next to each other. The index can be saved next to the inputs, delta coded: the sorted samples of a pixel
+ * only grow, so most of the differences fit in one byte.
+ *
+ * An index is only current for the files and the options it was read with, so the caller keeps both in it (sources and
+ * fingerprint) and builds it again when either changes.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+#include "select.h"
+
+namespace r2r {
+
+class SortedStack {
+public:
+    SortedStack() = default;
+    /* Sort a task, as the REDUCE stage of its progress context. Throws ParserErrors::CANCELLED if it is cancelled. */
+    explicit SortedStack(const Task &task);
+
+    /* Compute a rank based reduction (see RankStatistic) in the interleaved layout, or an empty buffer if the reduction
+     * is not rank based.
+     */
+    Buffer<io_t> reduce(pReduction reduction, const ReductionParams &params = {}) const;
+
+    /* Call f(sorted, stride) for every pixel, like rank_reduce. The output is in the interleaved layout. */
+    template<typename F>
+    Buffer<io_t> scan(F &&f) const
+    {
+        const size_t L = SortingNetwork::kLanes, count = wh, n_blocks = (count + L - 1) / L, n = n_images;
+        const io_t *blocks = data.data();
+        Buffer<io_t> out(count);
+        io_t *ans = out.get();
+        #pragma omp parallel for default(none) shared(f, ans, blocks, L, count, n_blocks, n) schedule(static)
+        for (size_t b = 0; b < n_blocks; b++) {
+            const io_t *block = blocks + b * n * L;
+            const size_t i0 = b * L, lanes = std::min(L, count - i0);
+            for (size_t l = 0; l < lanes; l++) {
+                ans[i0 + l] = f(block + l, L);
+            }
+        }
+        return interleave(std::move(out));
+    }
+
+    /* Save with the files the task was read from, delta coded unless compress is false */
+    ParserErrors save(const std::filesystem::path &file, bool compress = true) const;
+    ParserErrors load(const std::filesystem::path &file);
+
+    size_t n_images {0};
+    size_t width {0}, height {0}, wh {0};
+    u32 max_val {0};
+    Layout layout {Layout::INTERLEAVED};
+    std::vector<std::filesystem::path> sources;     // set by the caller, to tell if the index is still current
+    u64 fingerprint {0};                            // the same, for the ingest_fingerprint of the options of the task
+
+private:
+    Buffer<io_t> interleave(Buffer<io_t> ans) const;
+    std::vector<io_t> data;
+};
+
+} // namespace r2r
@@ -0,0 +1,239 @@
+/**
+ * Raw2Raw
+ * core/stars.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the star detection, the triangle matching and the RANSAC fit.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "stars.h"
+#include "cfa.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace r2r {
+
+namespace {
+struct Pair {
+    const Star *ref, *star;
+};
+
+/* Least squares similarity (or affine) transform from the reference stars to the stars of the pairs */
+bool fit(const std::vector<Pair> &pairs, bool affine, Affine &T)
+{
+    double mrx = 0, mry = 0, msx = 0, msy = 0;
+    for (const Pair &p : pairs) {
+        mrx += p.ref->x; mry += p.ref->y;
+        msx += p.star->x; msy += p.star->y;
+    }
+    const double n = (double)pairs.size();
+    mrx /= n; mry /= n; msx /= n; msy /= n;
+
+    double sxx = 0, sxy = 0, syy = 0, sxu = 0, syu = 0, sxv = 0, syv = 0;
+    for (const Pair &p : pairs) {
+        const double x = p.ref->x - mrx, y = p.ref->y - mry, u = p.star->x - msx, v = p.star->y - msy;
+        sxx += x * x; sxy += x * y; syy += y * y;
+        sxu += x * u; syu += y * u; sxv += x * v; syv += y * v;
+    }
+    Affine fitted;
+    if (affine) {
+        const double det = sxx * syy - sxy * sxy;
+        if (std::abs(det) < 1e-9) return false;
+        fitted.a = (sxu * syy - syu * sxy) / det;
+        fitted.b = (syu * sxx - sxu * sxy) / det;
+        fitted.c = (sxv * syy - syv * sxy) / det;
+        fitted.d = (syv * sxx - sxv * sxy) / det;
+    } else {
+        const double norm = sxx + syy;
+        if (norm < 1e-9) return false;
+        const double a = (sxu + syv) / norm, b = (sxv - syu) / norm;
+        fitted.a = a; fitted.b = -b;
+        fitted.c = b; fitted.d = a;
+    }
+    fitted.tx = msx - fitted.a * mrx - fitted.b * mry;
+    fitted.ty = msy - fitted.c * mrx - fitted.d * mry;
+    T = fitted;
+    return true;
+}
+
+/* A triangle of stars, described by the ratios of its sides to the longest one. The vertices are ordered by the length
+ * of the side opposite to them, so the same triangle in two frames lists its vertices in the same order.
+ */
+struct Triangle {
+    float r0, r1;
+    int v[3];
+};
+
+std::vector<Triangle> triangles(const std::vector<Star> &stars, size_t n)
+{
+    std::vector<Triangle> tris;
+    const auto dist = [&stars](int i, int j) { return std::hypot(stars[i].x - stars[j].x, stars[i].y - stars[j].y); };
+    for (int i = 0; i < (int)n; i++) {
+        for (int j = i + 1; j < (int)n; j++) {
+            for (int k = j + 1; k < (int)n; k++) {
+                std::pair<float, int> sides[3] = {{dist(j, k), i}, {dist(i, k), j}, {dist(i, j), k}};
+                std::sort(sides, sides + 3);
+                // tiny triangles are dominated by the error of the centroids
+                if (sides[0].first < 4.f) continue;
+                tris.push_back({sides[0].first / sides[2].first, sides[1].first / sides[2].first,
+                                {sides[0].second, sides[1].second, sides[2].second}});
+            }
+        }
+    }
+    std::sort(tris.begin(), tris.end(), [](const Triangle &a, const Triangle &b) { return a.r0 < b.r0; });
+    return tris;
+}
+} // anonymous namespace
+
+std::vector<Star> detect_stars(const io_t *frame, const RawInfo &info, size_t width, size_t height,
+                               const StarParams &params)
+{
+    const long pw = (long)width / 2, ph = (long)height / 2;
+    std::vector<float> green(pw * ph);
+    cfa_green(frame, info, width, height, green.data());
+
+    // the background and its noise, from the median and the median absolute deviation of a subsample
+    const size_t step = std::max<size_t>(1, green.size() / 65536);
+    std::vector<float> sample;
+    for (size_t i = 0; i < green.size(); i += step) sample.push_back(green[i]);
+    std::nth_element(sample.begin(), sample.begin() + sample.size() / 2, sample.end());
+    const float bg = sample[sample.size() / 2];
+    for (float &s : sample) s = std::abs(s - bg);
+    std::nth_element(sample.begin(), sample.begin() + sample.size() / 2, sample.end());
+    const float sigma = std::max(1.4826f * sample[sample.size() / 2], 0.5f);
+    const float threshold = bg + params.threshold * sigma;
+
+    constexpr long r = 3;                       // radius of the centroid window, in green samples
+    std::vector<Star> stars;
+    #pragma omp parallel default(none) shared(green, stars, pw, ph, bg, threshold)
+    {
+        std::vector<Star> found;
+        #pragma omp for schedule(static)
+        for (long y = r; y < ph - r; y++) {
+            for (long x = r; x < pw - r; x++) {
+                const float v = green[y * pw + x];
+                if (v <= threshold) continue;
+                // a strict maximum, where ties go to the first sample in raster order
+                bool peak = true;
+                for (long dy = -1; dy <= 1 && peak; dy++) {
+                    for (long dx = -1; dx <= 1; dx++) {
+                        const float n = green[(y + dy) * pw + x + dx];
+                        const bool before = dy < 0 || (dy == 0 && dx < 0);
+                        if ((dy || dx) && (before ? n >= v : n > v)) {
+                            peak = false;
+                            break;
+                        }
+                    }
+                }
+                if (!peak) continue;
+                float sum = 0, sx = 0, sy = 0, s2 = 0;
+                for (long dy = -r; dy <= r; dy++) {
+                    for (long dx = -r; dx <= r; dx++) {
+                        const float w = std::max(green[(y + dy) * pw + x + dx] - bg, 0.f);
+                        sum += w;
+                        sx += w * (float)dx;
+                        sy += w * (float)dy;
+                        s2 += w * (float)(dx * dx + dy * dy);
+                    }
+                }
+                // for a gaussian, the mean squared distance from the centroid is twice the variance
+                const float mx = sx / sum, my = sy / sum;
+                const float sigma = std::sqrt(std::max(s2 / sum - mx * mx - my * my, 0.f) / 2);
+                // a green sample is the center of a 2x2 block
+                found.push_back({2.f * ((float)x + mx) + 0.5f, 2.f * ((float)y + my) + 0.5f, sum, 2 * 2.3548f * sigma});
+            }
+        }
+        #pragma omp critical
+        stars.insert(stars.end(), found.begin(), found.end());
+    }
+
+    std::sort(stars.begin(), stars.end(), [](const Star &a, const Star &b) {
+        return a.flux != b.flux ? a.flux > b.flux : (a.y != b.y ? a.y < b.y : a.x < b.x);
+    });
+    if (stars.size() > params.max_stars) {
+        stars.resize(params.max_stars);
+    }
+    return stars;
+}
+
+bool match_stars(const std::vector<Star> &reference, const std::vector<Star> &stars, Affine &transform,
+                 const StarParams &params)
+{
+    const size_t minimal = params.affine ? 3 : 2;
+    const size_t n_ref = std::min(params.match_stars, reference.size()), n = std::min(params.match_stars, stars.size());
+    if (n_ref < minimal + 1 || n < minimal + 1) {
+        return false;
+    }
+
+    // every pair of triangles with the same shape votes for the pairs of stars at their vertices
+    constexpr float eps = 0.005f;
+    const std::vector<Triangle> ref_tris = triangles(reference, n_ref), tris = triangles(stars, n);
+    std::vector<int> votes(n_ref * n, 0);
+    for (const Triangle &t : tris) {
+        auto it = std::lower_bound(ref_tris.begin(), ref_tris.end(), t.r0 - eps,
+                                   [](const Triangle &a, float r) { return a.r0 < r; });
+        for (; it != ref_tris.end() && it->r0 <= t.r0 + eps; ++it) {
+            if (std::abs(it->r1 - t.r1) > eps) continue;
+            for (int k = 0; k < 3; k++) votes[it->v[k] * n + t.v[k]]++;
+        }
+    }
+
+    // the candidate pairs are the stars that voted most for each other
+    std::vector<std::pair<int, Pair>> ranked;
+    for (size_t i = 0; i < n_ref; i++) {
+        const size_t j = std::max_element(votes.begin() + i * n, votes.begin() + (i + 1) * n) - (votes.begin() + i * n);
+        const int best = votes[i * n + j];
+        if (best == 0) continue;
+        bool mutual = true;
+        for (size_t k = 0; k < n_ref && mutual; k++) {
+            mutual = k == i || votes[k * n + j] < best;
+        }
+        if (mutual) ranked.push_back({best, {&reference[i], &stars[j]}});
+    }
+    std::stable_sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+    std::vector<Pair> candidates;
+    for (const auto &r : ranked) candidates.push_back(r.second);
+    if (candidates.size() < minimal + 1) {
+        return false;
+    }
+
+    // RANSAC on the candidates, with a fixed seed so that the result is reproducible
+    const float tol2 = params.tolerance * params.tolerance;
+    const auto inliers_of = [&](const Affine &T) {
+        std::vector<Pair> in;
+        for (const Pair &p : candidates) {
+            const double x = T.a * p.ref->x + T.b * p.ref->y + T.tx, y = T.c * p.ref->x + T.d * p.ref->y + T.ty;
+            if ((x - p.star->x) * (x - p.star->x) + (y - p.star->y) * (y - p.star->y) < tol2) in.push_back(p);
+        }
+        return in;
+    };
+    std::mt19937 rng(0x5eed);
+    std::uniform_int_distribution<size_t> pick(0, candidates.size() - 1);
+    std::vector<Pair> best;
+    for (int iter = 0; iter < 500; iter++) {
+        std::vector<Pair> sample;
+        while (sample.size() < minimal) {
+            const Pair &p = candidates[pick(rng)];
+            if (std::none_of(sample.begin(), sample.end(), [&p](const Pair &q) { return q.ref == p.ref; })) {
+                sample.push_back(p);
+            }
+        }
+        Affine T;
+        if (!fit(sample, params.affine, T)) continue;
+        std::vector<Pair> in = inliers_of(T);
+        if (in.size() > best.size()) best = std::move(in);
+    }
+    // a fit through the minimal sample always agrees with it, so one more star has to confirm it
+    Affine T;
+    if (best.size() < minimal + 1 || !fit(best, params.affine, T)) {
+        return false;
+    }
+    transform = T;
+    return true;
+}
+
+} // namespace r2r
@@ -0,0 +1,44 @@
+/**
+ * Raw2Raw
+ * core/stars.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of the star-based alignment, for field rotation on alt-az mounts and tripod creep
+ * in long sequences. Point features (stars, or any small bright spots) are detected on the green channel, matched
+ * between frames by the shape of the triangles they form, which does not change under rotation, scale and translation,
+ * and a similarity or affine transform is fitted to the matches with RANSAC.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+#include "warp.h"
+
+namespace r2r {
+
+struct Star {
+    float x, y;                     // centroid in raw pixels
+    float flux;                     // background subtracted sum
+    float fwhm;                     // in raw pixels, from the second moment of the centroid window
+};
+
+struct StarParams {
+    float threshold {5.f};          // detection threshold, in standard deviations of the background noise
+    size_t max_stars {64};          // only the brightest stars are kept
+    size_t match_stars {20};        // the triangles are formed from the brightest ones of those
+    float tolerance {2.f};          // distance in raw pixels for a match to agree with a transform
+    bool affine {false};            // fit an affine transform instead of a similarity
+};
+
+/* Detect the stars of an interleaved frame, from the brightest to the faintest */
+std::vector<Star> detect_stars(const io_t *frame, const RawInfo &info, size_t width, size_t height,
+                               const StarParams &params = {});
+
+/* Find the transform from the reference stars to the stars of another frame. Returns false (and leaves the transform
+ * alone) if not enough stars could be matched.
+ */
+bool match_stars(const std::vector<Star> &reference, const std::vector<Star> &stars, Affine &transform,
+                 const StarParams &params = {});
+
+} // namespace r2r
@@ -0,0 +1,83 @@
+/**
+ * Raw2Raw
+ * core/stream.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the FrameStream class, a double buffered reader of raw files.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "stream.h"
+#include "calibrate.h"
+#include "defects.h"
+
+namespace r2r {
+
+FrameStream::FrameStream(const std::vector<std::filesystem::path> &files, const TaskOptions &options)
+    : files(files), options(options)
+{
+    if (files.empty() ||
+        get_dimensions(files[0].string().c_str(), width, height, max_val) != ParserErrors::PARSE_SUCCESS)
+    {
+        throw ParserErrors::CANNOT_OPEN_FILE;
+    }
+    if (options.defects && !options.defects->pixels.empty() &&
+        (options.defects->width != width || options.defects->height != height)) {
+        throw ParserErrors::SIZE_MISMATCH;
+    }
+    if (options.calibration && (options.calibration->width != width || options.calibration->height != height)) {
+        throw ParserErrors::SIZE_MISMATCH;
+    }
+    wh = width * height;
+    for (auto &slot : slots) {
+        slot.data.resize(wh);
+    }
+    prefetch();
+}
+
+FrameStream::~FrameStream()
+{
+    if (pending.valid()) {
+        pending.wait();
+    }
+}
+
+void FrameStream::prefetch()
+{
+    if (current >= files.size()) {
+        return;
+    }
+    Slot &slot = slots[current % 2];
+    pending = std::async(std::launch::async, [this, &slot, i = current] () {
+        slot.err = parse_image(files[i].string().c_str(), slot.data.data(), width, height, &slot.info);
+        if (slot.err == ParserErrors::PARSE_SUCCESS && options.calibration) {
+            calibrate_frame(*options.calibration, slot.data.data());
+        }
+        if (slot.err == ParserErrors::PARSE_SUCCESS && options.defects) {
+            correct_defects(*options.defects, slot.data.data());
+        }
+    });
+}
+
+const io_t *FrameStream::next(RawInfo *info)
+{
+    if (current >= files.size()) {
+        return nullptr;
+    }
+    pending.get();
+    Slot &slot = slots[current % 2];
+    if (slot.err != ParserErrors::PARSE_SUCCESS) {
+        throw slot.err;
+    }
+    if (info) {
+        *info = slot.info;
+    }
+    current++;
+    // the other slot is free now, since the frame in it was returned by the previous call
+    prefetch();
+    return slot.data.data();
+}
+
+} // namespace r2r
@@ -0,0 +1,60 @@
+/**
+ * Raw2Raw
+ * core/stream.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of the FrameStream class, which reads a list of raw files one frame at a time,
+ * instead of loading the whole stack into a Task. It is used by the algorithms that only need to see each frame once
+ * (HDR merge, sliding windows, burst merges, ...) so their memory does not grow with the number of frames.
+ *
+ * The next frame is decoded in the background while the current one is being processed, so the decode time is hidden
+ * behind the compute time.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+#include <future>
+
+namespace r2r {
+
+class FrameStream {
+public:
+    /* Only the calibration and the known defects of the options are applied to the streamed frames. Throws a
+     * ParserErrors if the first file cannot be opened, or SIZE_MISMATCH if the calibration or the defects are of
+     * another size than it.
+     */
+    FrameStream(const std::vector<std::filesystem::path> &files, const TaskOptions &options = {});
+    ~FrameStream();
+    FrameStream(const FrameStream &) = delete;
+    FrameStream &operator=(const FrameStream &) = delete;
+
+    /* Decode the next frame. The returned pointer is valid until the next call. Returns nullptr when all the frames
+     * have been read, and throws a ParserErrors if a frame cannot be decoded.
+     */
+    const io_t *next(RawInfo *info = nullptr);
+
+    /* Index of the frame that the last call to next returned */
+    size_t index() const { return current - 1; }
+    size_t size() const { return files.size(); }
+
+    size_t width, height, wh;
+    u32 max_val;
+
+private:
+    struct Slot {
+        std::vector<io_t> data;
+        RawInfo info;
+        ParserErrors err;
+    };
+    void prefetch();
+
+    std::vector<std::filesystem::path> files;
+    TaskOptions options;
+    Slot slots[2];
+    std::future<void> pending;
+    size_t current {0};
+};
+
+} // namespace r2r
@@ -0,0 +1,99 @@
+/**
+ * Raw2Raw
+ * core/warp.cc
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the implementation of the CFA-aware resampling engine.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+
+#include "warp.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <numbers>
+
+namespace r2r {
+
+namespace {
+constexpr int kLanczosA = 3;
+constexpr int kLanczosPhases = 64;              // the kernel is tabulated at 1/64 sample
+
+/* Normalized Lanczos weights of the 2 * a taps around a sample, for every phase of the fractional position */
+const std::array<std::array<float, 2 * kLanczosA>, kLanczosPhases> &lanczos_table()
+{
+    static const auto table = [] {
+        std::array<std::array<float, 2 * kLanczosA>, kLanczosPhases> t;
+        for (int p = 0; p < kLanczosPhases; p++) {
+            const double frac = (double)p / kLanczosPhases;
+            double sum = 0;
+            for (int k = 0; k < 2 * kLanczosA; k++) {
+                const double x = (double)(k - kLanczosA + 1) - frac;
+                double w = 1.0;
+                if (x != 0) {
+                    const double px = std::numbers::pi * x;
+                    w = std::abs(x) < kLanczosA ? kLanczosA * std::sin(px) * std::sin(px / kLanczosA) / (px * px) : 0.0;
+                }
+                t[p][k] = (float)w;
+                sum += w;
+            }
+            for (float &w : t[p]) w = (float)(w / sum);
+        }
+        return t;
+    }();
+    return table;
+}
+} // anonymous namespace
+
+void warp_cfa(const io_t *in, io_t *out, size_t width, size_t height, const Affine &T, Interpolation interpolation)
+{
+    // a CFA plane has one sample every 2 raw pixels, starting at the offset of its position in the 2x2 block
+    const long pw = (long)width / 2, ph = (long)height / 2;
+    const auto &lanczos = lanczos_table();
+
+    #pragma omp parallel for default(none) shared(in, out, width, height, T, interpolation, pw, ph, lanczos) schedule(static)
+    for (size_t y = 0; y < height; y++) {
+        const long oy = (long)(y & 1);
+        for (long ox = 0; ox < 2; ox++) {
+            const io_t *plane = in + oy * width + ox;  // sample (u, v) of this plane is plane[2 * v * width + 2 * u]
+            const long stride = 2 * (long)width;
+            // plane coordinates of the source of output x = ox, stepped by one output sample (2 raw pixels)
+            double u = (T.a * ox + T.b * (double)y + T.tx - ox) / 2, v = (T.c * ox + T.d * (double)y + T.ty - oy) / 2;
+            const double du = T.a, dv = T.c;
+            if (interpolation == Interpolation::LANCZOS3) {
+                for (size_t x = ox; x < width; x += 2, u += du, v += dv) {
+                    const long iu = (long)std::floor(u), iv = (long)std::floor(v);
+                    const auto &wu = lanczos[std::min(kLanczosPhases - 1, (int)((u - iu) * kLanczosPhases))];
+                    const auto &wv = lanczos[std::min(kLanczosPhases - 1, (int)((v - iv) * kLanczosPhases))];
+                    float s = 0;
+                    for (int j = 0; j < 2 * kLanczosA; j++) {
+                        const io_t *row = plane + std::clamp(iv + j - kLanczosA + 1, 0L, ph - 1) * stride;
+                        float r = 0;
+                        for (int i = 0; i < 2 * kLanczosA; i++) {
+                            r += wu[i] * (float)row[2 * std::clamp(iu + i - kLanczosA + 1, 0L, pw - 1)];
+                        }
+                        s += wv[j] * r;
+                    }
+                    out[y * width + x] = (io_t)std::clamp(s + 0.5f, 0.f, 65535.f);
+                }
+            } else {
+                #pragma omp simd
+                for (size_t x = ox; x < width; x += 2) {
+                    const double k = (double)((x - ox) / 2);
+                    const double su = u + k * du, sv = v + k * dv;
+                    const long iu = (long)std::floor(su), iv = (long)std::floor(sv);
+                    const float fu = (float)(su - iu), fv = (float)(sv - iv);
+                    const long u0 = std::clamp(iu, 0L, pw - 1), u1 = std::clamp(iu + 1, 0L, pw - 1);
+                    const long v0 = std::clamp(iv, 0L, ph - 1), v1 = std::clamp(iv + 1, 0L, ph - 1);
+                    const float top = (1 - fu) * plane[v0 * stride + 2 * u0] + fu * plane[v0 * stride + 2 * u1];
+                    const float bottom = (1 - fu) * plane[v1 * stride + 2 * u0] + fu * plane[v1 * stride + 2 * u1];
+                    out[y * width + x] = (io_t)((1 - fv) * top + fv * bottom + 0.5f);
+                }
+            }
+        }
+    }
+}
+
+} // namespace r2r
@@ -0,0 +1,48 @@
+/**
+ * Raw2Raw
+ * core/warp.h
+ * Author: Jonah Chen
+ * Last updated in rev 0.1
+ *
+ * This file contains the definition of the CFA-aware resampling engine. A frame is warped by an affine transform
+ * without demosaicing: every sample of the output is interpolated from the samples of the same CFA color of the input,
+ * so each color plane is resampled on its own grid.
+ *
+ * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
+ */
+#pragma once
+#include "raw2raw.h"
+
+namespace r2r {
+
+/* Maps a position (x, y) of the reference frame to the position of the same point in another frame, in raw pixels:
+ * x' = a * x + b * y + tx, y' = c * x + d * y + ty
+ */
+struct Affine {
+    double a {1}, b {0}, c {0}, d {1};
+    double tx {0}, ty {0};
+
+    bool identity() const { return a == 1 && b == 0 && c == 0 && d == 1 && tx == 0 && ty == 0; }
+
+    /* The transform from the other frame back to the reference. The transform must not be singular. */
+    Affine inverse() const
+    {
+        const double det = a * d - b * c;
+        Affine inv;
+        inv.a = d / det;
+        inv.b = -b / det;
+        inv.c = -c / det;
+        inv.d = a / det;
+        inv.tx = -(inv.a * tx + inv.b * ty);
+        inv.ty = -(inv.c * tx + inv.d * ty);
+        return inv;
+    }
+};
+
+/* Resample a width x height interleaved frame, so that out(x, y) = in(T(x, y)) for every sample, interpolating only
+ * between the samples of the same CFA position. Samples that map outside of the frame repeat its edge.
+ */
+void warp_cfa(const io_t *in, io_t *out, size_t width, size_t height, const Affine &transform,
+              Interpolation interpolation = Interpolation::BILINEAR);
+
+} // namespace r2r
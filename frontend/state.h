@@ -19,6 +19,9 @@
 #include <set>
 #include "thumbnail.h"
 #include "loupe.h"
+#include "core/accumulate.h"
+#include "core/sorted.h"
+#include "core/progress.h"
 #include <optional>
 #include <chrono>
 
@@ -59,7 +62,7 @@ private: // grid view
         int last_selected_image {-1};
     } updates;
     std::vector<std::filesystem::path> missing_thumbs, temp;
-    std::future<r2r::u8*> thumb_future;
+    std::future<r2r::Buffer<r2r::u8>> thumb_future;
     double thumb_future_submit_time;
     void update_thumbnail_async(int chunk_size);
     void render_grid_view();
@@ -81,7 +84,16 @@ private: // primary
     fspath loupe_path;
     Image8 loupe_image;
     std::future<void> single_future;
-    std::future<void> algo_future;
+    // whether the output was written, and what to log, polled by the render loop so that the GUI never waits for it
+    std::future<std::pair<bool, std::string>> algo_future;
+    r2r::Progress progress;
+    // the streaming reductions are updated incrementally when the selection changes
+    r2r::Accumulator accumulator;
+    int align {0};          // r2r::Alignment, the accumulator is not used for aligned frames
+    r2r::ReductionParams reduction_params;
+    // the rank based reductions are scans of the sorted index while the selection and alignment stay the same
+    std::unique_ptr<r2r::SortedStack> sorted;
+    int sorted_align {0};
     void render_single_image_view();
     void render_bottom_bar();
     void run_algo(r2r::pReduction algo);
@@ -72,13 +72,11 @@ void State::update_thumbnail_async(int chunk_size) {
         if (thumb_future.wait_for(kZero) != std::future_status::ready) {
             return;
         }
-        auto *thumbs = thumb_future.get();
+        auto thumbs = thumb_future.get();
         if (temp.empty()) { // we have moved on to a different folder, so we don't need to do anymore work here
-            delete[] thumbs;
             return;
         }
-        thumbnails.read_thumbs_to_opengl(thumbs, temp, thumb_size, 8);
-        delete[] thumbs;
+        thumbnails.read_thumbs_to_opengl(thumbs.get(), temp, thumb_size, 8);
         log(std::format("{} thumbnails loaded in {:0.2f}s.\n", temp.size(), omp_get_wtime() - thumb_future_submit_time));
 
         // TODO: to save on resources (for weaker systems), we may want to purge some thumbnails here with openGL.
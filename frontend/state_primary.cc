@@ -27,6 +27,10 @@ State::State() {
 }
 
 State::~State() {
+    // a run that is still going uses the progress context, the accumulator and the index, so stop it and let it
+    // return before they are destroyed; once cancelled, it skips the frames and tiles that are left
+    progress.cancel();
+    if (algo_future.valid()) algo_future.wait();
     cleanup_file_tree();
 }
 
@@ -130,6 +134,35 @@ void State::render_bottom_bar() {
     make_algo_button("Range", pReduction::RANGE);
     make_algo_button("Variance", pReduction::VARIANCE);
     make_algo_button("Standard Deviation", pReduction::STANDARD_DEVIATION);
+    make_algo_button("Weighted Mean", pReduction::WEIGHTED_MEAN);
+    make_algo_button("Hybrid", pReduction::HYBRID);
+    make_algo_button("Percentile", pReduction::PERCENTILE);
+    make_algo_button("Trimmed Mean", pReduction::TRIMMED_MEAN);
+    make_algo_button("Mode", pReduction::MODE);
+    ImGui::SetNextItemWidth(slider_width);
+    ImGui::SliderFloat("Percentile##slider", &reduction_params.percentile, 0.f, 100.f, "%.0f");
+    ImGui::SameLine();
+    ImGui::SetNextItemWidth(slider_width);
+    ImGui::Combo("Align", &align, "None\0Global\0Tiles\0Similarity\0Affine\0");
+
+    if (algo_future.valid()) {
+        if (algo_future.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            auto [written, msg] = algo_future.get();
+            log(std::move(msg));
+            if (written) {
+                single_future = loupe_image.open_async((loupe_path = output.path));
+            }
+            update_thumbnails = true;
+        } else {
+            constexpr const char *stage_names[] = {"", "Reading", "Reducing", "Writing", "Batch"};
+            ImGui::ProgressBar(progress.fraction(), ImVec2(slider_width, 0.f),
+                               stage_names[(int)progress.stage()]);
+            ImGui::SameLine();
+            if (ImGui::Button("Cancel")) {
+                progress.cancel();
+            }
+        }
+    }
     ImGui::End();
 }
 
@@ -159,28 +192,74 @@ void State::run_algo(r2r::pReduction algo) {
     }
 
     update_thumbnails = false; // stop updating thumbnails to free up CPU time
+    progress.reset();
 
-    algo_future = std::async(std::launch::async, [this, algo] () {
+    // the worker only sees copies of what the GUI keeps changing while it runs
+    path_vec selected_images;
+    for (int i: updates.selected_images) {
+        selected_images.push_back(images_in_path[i]);
+    }
+    algo_future = std::async(std::launch::async, [this, algo, selected_images, params = reduction_params,
+                                                  align = align, path = std::string(output.path)] () {
         r2r::Timer timer;
-        path_vec selected_images;
-        for (int i: updates.selected_images) {
-            selected_images.push_back(images_in_path[i]);
+        std::string msg;
+        r2r::Buffer<r2r::io_t> ans;
+        const r2r::io_t *reference = nullptr;
+        size_t width, height;
+        std::unique_ptr<r2r::Task> task;
+        bool streaming = align == 0 && (algo == r2r::pReduction::MEAN || algo == r2r::pReduction::SUMMATION ||
+                         algo == r2r::pReduction::MAXIMUM || algo == r2r::pReduction::MINIMUM ||
+                         algo == r2r::pReduction::RANGE || algo == r2r::pReduction::VARIANCE ||
+                         algo == r2r::pReduction::STANDARD_DEVIATION);
+        r2r::TaskOptions options;
+        options.align = static_cast<r2r::Alignment>(align);
+        options.progress = &progress;
+        try {
+            if (streaming) {
+                // only the images that were (de)selected since the last run are read
+                try {
+                    accumulator.sync(selected_images, options);
+                } catch (r2r::ParserErrors e) {
+                    if (e == r2r::ParserErrors::CANCELLED) throw;
+                    // the selection moved to images of another size, so start over
+                    accumulator = {};
+                    accumulator.sync(selected_images, options);
+                }
+                ans = accumulator.finalize(algo);
+                width = accumulator.width;
+                height = accumulator.height;
+            } else if (r2r::RankStatistic::supported(algo)) {
+                if (!sorted || sorted->sources != selected_images || sorted_align != align) {
+                    sorted.reset();
+                    sorted = std::make_unique<r2r::SortedStack>(r2r::Task(selected_images, options));
+                    sorted->sources = selected_images;
+                    sorted_align = align;
+                }
+                ans = sorted->reduce(algo, params);
+                width = sorted->width;
+                height = sorted->height;
+            } else {
+                task = std::make_unique<r2r::Task>(selected_images, options);
+                ans = r2r::p_reduce(*task, algo, params);
+                width = task->width;
+                height = task->height;
+                reference = task->reference;
+            }
+        } catch (r2r::ParserErrors e) {
+            if (e == r2r::ParserErrors::CANCELLED) {
+                return std::make_pair(false, std::format("Cancelled after {:0.2f}s.\n", timer.stop() / 1000));
+            }
+            return std::make_pair(false, std::format("Failed to read the images due to {}.\n", (int)e));
         }
-        r2r::Task task(selected_images);
-        r2r::io_t *ans = r2r::p_reduce(task, algo);
-        auto e = r2r::write_image(selected_images[0], output.path, ans, task.data, task.width, task.height);
+        auto e = r2r::write_image(selected_images[0], path, ans.get(), reference, width, height, &progress);
         if (e == r2r::ParserErrors::PARSE_SUCCESS) {
-            log(std::format("Output written to {}.\n", output.path));
+            msg = std::format("Output written to {}.\n", path);
+        } else if (e == r2r::ParserErrors::CANCELLED) {
+            msg = "Cancelled before the output was written.\n";
         } else {
-            log(std::format("Failed to write the output due to {}.\n", (int)e));
+            msg = std::format("Failed to write the output due to {}.\n", (int)e);
         }
-        delete[] ans;
-        log(std::format("The algorithm took {:0.2f}s on {} images.\n", timer.stop() / 1000, selected_images.size()));
+        msg += std::format("The algorithm took {:0.2f}s on {} images.\n", timer.stop() / 1000, selected_images.size());
+        return std::make_pair(e == r2r::ParserErrors::PARSE_SUCCESS, std::move(msg));
     });
-
-    algo_future.get();
-
-    single_future = loupe_image.open_async((loupe_path = output.path));
-
-    update_thumbnails = true;
 }
@@ -127,10 +127,10 @@ void read_thumb(const fspath &filename, int width, int height, r2r::u8 *output)
     stbi_image_free(resized_img);
 }
 
-r2r::u8 *read_thumbs(path_vec files, int width, int height) {
+r2r::Buffer<r2r::u8> read_thumbs(path_vec files, int width, int height) {
     auto n = files.size();
     auto image_size = width * height * nchannels;
-    r2r::u8 *output = new r2r::u8[n * image_size];
+    r2r::Buffer<r2r::u8> output(n * image_size);
     #pragma omp parallel for default(shared) schedule(auto)
     for (int i = 0; i < n; i++) {
         read_thumb(files[i], width, height, &output[i * image_size]);
@@ -197,7 +197,7 @@ void ThumbnailStore::read_thumbs_to_opengl(r2r::u8 *thumbs, const path_vec &file
 
 void ThumbnailStore::load_default(const fspath &default_thumb_path) {
     auto output = read_thumbs({default_thumb_path}, thumb_size, thumb_size);
-    read_thumbs_to_opengl(output, {fspath()}, thumb_size, 1);
+    read_thumbs_to_opengl(output.get(), {fspath()}, thumb_size, 1);
 }
 
 size_t ThumbnailStore::purge(const std::function<bool(const fspath &)>& pred) {
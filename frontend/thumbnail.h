@@ -23,7 +23,7 @@
 using fspath = std::filesystem::path;
 using path_vec = std::vector<fspath>;
 
-r2r::u8 *read_thumbs(path_vec files, int width, int height);
+r2r::Buffer<r2r::u8> read_thumbs(path_vec files, int width, int height);
 void read_thumb(const fspath &filename, int width, int height, r2r::u8 *output);
 
 constexpr unsigned char kSingleClick = 1;
@@ -8,7 +8,76 @@
  * in a list of files and an algorithm, and then processes the files using the algorithm. The output is then written to
  * a file.
  *
- * Usage: raw2rawcli <algorithm> <directory or list of files> [-o <output path>]
+ * Usage: raw2rawcli <algorithm> <directory or list of files> [-o <output path>] [-c <master library>] [-s <state>]
+ *                   [-m <bins>] [-a|-t|-r|-A] [-l] [-p <parameter>] [-i <index>] [-d <defect cache>] [-q] [-b <count>]
+ *                   [-v <level>] [-P]
+ *        raw2rawcli analyze <directory or list of files> [-c <master library>] [-d <defect cache>]
+ *        raw2rawcli master <bias|dark|flat> <directory or list of files> -o <master library>
+ *        raw2rawcli hdr <directory or list of brackets> [-o <output dng>] [-c <master library>]
+ *        raw2rawcli sliding <algorithm> <directory or list of files> -w <window> [-k <step>] [-o <output directory>]
+ *                   [-c <master library>]
+ *        raw2rawcli batch <algorithm> <directory or list of files> [-g <seconds>|-n <count>|-e] [-o <name template>]
+ *                   [-H <header cache>] [-c <master library>] [-a|-t|-r|-A] [-l] [-p <parameter>] [-q] [-b <count>]
+ *        raw2rawcli drizzle <directory or list of files> [-o <output dng>] [-c <master library>] [-a|-r|-A]
+ *                   [-x <scale>] [-L]
+ *
+ * The master command builds a calibration master and stores it in a library directory. Passing that library with -c
+ * corrects every frame with the matching bias, dark and flat while it is read.
+ *
+ * The analyze command prints the noise, black level and clipping of each CFA channel, and the conversion gain and read
+ * noise from the photon transfer curve of the stack, without writing anything.
+ *
+ * With -d, hot, dead and stuck pixels are replaced by the mean of their same-color neighbors while the frames are read.
+ * The defects of a camera are looked up in the cache directory by its serial number. When they are not there yet, they
+ * are found in the frames of the stack and then cached, so later stacks of the same camera skip detection. They cannot
+ * be found in frames that are warped with -r or -A.
+ *
+ * With -q, every frame is scored while it is read, and the frames that are much blurrier, brighter or darker than the
+ * others are dropped before the reduction (with -r or -A, also the frames with fewer stars or wider stars). With -b, at
+ * most that many of the best frames are kept.
+ *
+ * With -v, the stack is binned by 2x2 same-color superpixels that many times while it is read, and only the binned stack
+ * is reduced, into a CFA DNG with 4^level times fewer pixels. This previews any reduction in a fraction of the time.
+ *
+ * With -P, the frames of the streaming reductions (mean, summation, minimum, maximum, range) are kept in memory in as
+ * many bits as the camera has (12 or 14 for most, see core/packed.h), which fits a larger stack and reduces it faster.
+ * Only -c and a cached -d correction can be used with it.
+ *
+ * With -s, the streaming reductions (mean, sum, min, max, range) keep their state in a file. When the same state is used
+ * again, only the files that were added to or removed from the list since the last run are read. The median can be
+ * kept too, from a histogram of -m bins per pixel (accurate to the width of a bin), which is set when the state is
+ * made. The state is made again when a removed file cannot be read anymore, and a state cannot be used with another -c
+ * or -d than it was made with.
+ *
+ * With -i, the rank based reductions (median, percentile, trimmed_mean, mode, clipped_mean, minimum, maximum and range)
+ * read the samples of every pixel in order from an index file. The index is built (and saved) when it does not exist
+ * or was made from other files or with other options, and after that the files are not read at all, so trying another
+ * percentile or trim is instant.
+ *
+ * With -a, handheld frames are aligned to the first one (by whole CFA blocks) before they are reduced. With -t, every
+ * tile of a frame is aligned on its own instead, which also follows parallax and rolling shutter. With -r (similarity)
+ * or -A (affine), the stars of each frame are matched to the first one, which also corrects field rotation; the frames
+ * are then resampled bilinearly, or with Lanczos if -l is given.
+ *
+ * The sliding command reduces every window of consecutive files (e.g. for timelapse trails) while reading each file only
+ * once, and writes one output per window, named after the first file of the window. Only mean, summation, maximum,
+ * minimum, range and median are supported over a sliding window.
+ *
+ * The batch command splits the files into stacks and reduces every stack into its own output, all in one process that
+ * reads the next stacks while it reduces and writes the ones before (see core/batch.h). The files are put in order of
+ * capture, and a new stack starts after a pause of more than -g seconds (2 by default), every -n files, or with -e when
+ * an exposure of the current bracket comes again. The outputs are named by the -o template, where {first} and {last}
+ * are the names of the first and last files of the stack without their extension, {index} is the number of the stack,
+ * {count} its number of files, {algorithm} the algorithm and {ext} the extension of the files. The default is
+ * output/{first}_{algorithm}{ext}. With -H, the metadata of the files is kept in a cache file, so grouping the same
+ * files again only reads the files that changed.
+ *
+ * The drizzle command registers the frames to a fraction of a pixel (by phase correlation with -a, the default, or by
+ * their stars with -r or -A) and drops their samples on a grid that is -x times finer than the sensor (2 by default).
+ * The output is a CFA DNG, or a linear DNG with -L.
+ *
+ * On a machine with several NUMA nodes, run with OMP_PROC_BIND=spread and OMP_PLACES=cores. Every frame is then spread
+ * over the nodes in stripes of pixels, and each thread reduces the stripe in the memory of its own node.
  *
  * Supported algorithms:
  * - mean
@@ -17,48 +86,216 @@
  * - maximum
  * - minimum
  * - range
+ * - weighted_mean (frames are scaled to the exposure of the first one, using the EXIF)
+ * - hybrid (the mean where the scene is static, and the median only in the tiles where something moves)
+ * - percentile (-p, 50 by default, e.g. -p 20 to suppress headlights)
+ * - trimmed_mean (drops -p percent of the samples at each end, 25 by default, which is the interquartile mean)
+ * - mode (the mean of the fullest bin of -p DN, 16 by default)
+ * - clipped_mean (the mean of the samples within -p sigma of the median, 3 by default)
+ * - hdr (streams the brackets and writes a floating point DNG)
+ * - merge (streams a burst and merges it into the first frame in the Fourier domain, which denoises like the mean
+ *   without the ghosts of moving subjects)
+ * - focus (takes every CFA block from the frame where it is the sharpest, and also writes the index of that frame as a
+ *   PGM next to the output), or focus_blend to blend the frames by their sharpness
  *
  * This project is licensed under the GPL v3.0 license. Please see the LICENSE file for more information.
  */
 
 #include "core/raw2raw.h"
+#include "core/analysis.h"
+#include "core/calibrate.h"
+#include "core/cfa.h"
+#include "core/defects.h"
+#include "core/dng.h"
+#include "core/drizzle.h"
+#include "core/focus.h"
+#include "core/hybrid.h"
+#include "core/hdr.h"
+#include "core/merge.h"
+#include "core/quality.h"
+#include "core/accumulate.h"
+#include "core/batch.h"
+#include "core/group.h"
+#include "core/sliding.h"
+#include "core/sorted.h"
+#include "core/packed.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <filesystem>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+
+namespace {
+/* The output of a stack of a batch, from the name template of the command line */
+std::filesystem::path output_name(const std::string &name_template, const std::vector<std::filesystem::path> &files,
+                                  size_t index, const std::string &algorithm)
+{
+    char number[16];
+    std::snprintf(number, sizeof(number), "%04zu", index);
+    const std::pair<std::string, std::string> fields[] = {
+        {"{first}", files.front().stem().string()},
+        {"{last}", files.back().stem().string()},
+        {"{index}", number},
+        {"{count}", std::to_string(files.size())},
+        {"{algorithm}", algorithm},
+        {"{ext}", files.front().extension().string()},
+    };
+    std::string name = name_template;
+    for (const auto &[key, value] : fields) {
+        for (size_t at; (at = name.find(key)) != std::string::npos;) {
+            name.replace(at, key.size(), value);
+        }
+    }
+    return name;
+}
+} // anonymous namespace
 
 int main(int argc, char *argv[])
 {
     if (argc < 3) {
-        std::cout << "Usage: " << argv[0] << " <algorithm> <directory or list of files> [-o <output path>]\n";
+        std::cout << "Usage: " << argv[0] << " <algorithm> <directory or list of files> [-o <output path>]"
+                  << " [-c <master library>] [-s <state>] [-m <bins>] [-a|-t|-r|-A] [-l] [-p <parameter>] [-i <index>]"
+                  << " [-d <defect cache>] [-q] [-b <count>] [-v <level>] [-P]\n"
+                  << "       " << argv[0] << " analyze <directory or list of files> [-c <master library>]"
+                  << " [-d <defect cache>]\n"
+                  << "       " << argv[0] << " master <bias|dark|flat> <directory or list of files>"
+                  << " -o <master library>\n"
+                  << "       " << argv[0] << " hdr <directory or list of brackets> [-o <output dng>]"
+                  << " [-c <master library>]\n"
+                  << "       " << argv[0] << " sliding <algorithm> <directory or list of files> -w <window>"
+                  << " [-k <step>] [-o <output directory>] [-c <master library>]\n"
+                  << "       " << argv[0] << " batch <algorithm> <directory or list of files> [-g <seconds>|-n <count>|-e]"
+                  << " [-o <name template>] [-H <header cache>] [-c <master library>] [-a|-t|-r|-A] [-l]"
+                  << " [-p <parameter>] [-q] [-b <count>]\n"
+                  << "       " << argv[0] << " drizzle <directory or list of files> [-o <output dng>]"
+                  << " [-c <master library>] [-a|-r|-A] [-x <scale>] [-L]\n";
         return 0;
     }
     std::string algorithm = argv[1];
     std::filesystem::path output_path = "output";
+    std::filesystem::path library_path;
+    std::filesystem::path state_path;
+    std::filesystem::path index_path;
+    std::filesystem::path defects_dir;
+    std::filesystem::path headers_path;
+    r2r::Alignment align = r2r::Alignment::NONE;
+    r2r::Interpolation interpolation = r2r::Interpolation::BILINEAR;
+    r2r::SlidingParams sliding;
+    r2r::DrizzleParams drizzle;
+    r2r::QualityParams quality;
+    r2r::GroupParams grouping;
+    bool score = false;
+    bool packed = false;
+    size_t preview = 0;
+    r2r::AccumulatorOptions accumulated;
+    const char *parameter = nullptr;
+    const bool windowed = algorithm == "sliding";
+    const bool batched = algorithm == "batch";
+
+    std::string master_kind;
+    int first_file = 2;
+    if (algorithm == "master") {
+        master_kind = argv[first_file++];
+    } else if (windowed) {
+        algorithm = argv[first_file++];
+        sliding.window = 0;
+    } else if (batched) {
+        algorithm = argv[first_file++];
+    }
 
     std::vector<std::filesystem::path> files;
-    {
-        int i;
-        for (i = 2; i < argc && std::string(argv[i]) != "-o"; i++) {
-            files.emplace_back(argv[i]);
-        }
-        if (i < argc) // which means we have a -o
-        {
+    for (int i = first_file; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-o" || arg == "-c" || arg == "-s" || arg == "-i" || arg == "-d" || arg == "-H") {
             if (++i == argc) {
-                std::cout << "Need an output path\n";
+                std::cout << "Need a path after " << arg << "\n";
+                return 1;
+            }
+            (arg == "-o" ? output_path : arg == "-c" ? library_path : arg == "-s" ? state_path :
+             arg == "-i" ? index_path : arg == "-d" ? defects_dir : headers_path) = argv[i];
+        } else if (arg == "-a" || arg == "-t" || arg == "-r" || arg == "-A") {
+            align = arg == "-a" ? r2r::Alignment::GLOBAL : arg == "-t" ? r2r::Alignment::TILES :
+                    arg == "-r" ? r2r::Alignment::SIMILARITY : r2r::Alignment::AFFINE;
+        } else if (arg == "-l") {
+            interpolation = r2r::Interpolation::LANCZOS3;
+        } else if (arg == "-w" || arg == "-k") {
+            if (++i == argc || std::atoi(argv[i]) <= 0) {
+                std::cout << "Need a positive number after " << arg << "\n";
+                return 1;
+            }
+            (arg == "-w" ? sliding.window : sliding.step) = std::atoi(argv[i]);
+        } else if (arg == "-g") {
+            if (++i == argc || std::atof(argv[i]) <= 0) {
+                std::cout << "Need a positive number of seconds after -g\n";
                 return 1;
             }
-            output_path = argv[i];
+            grouping.by = r2r::Grouping::TIME_GAP;
+            grouping.max_gap = std::atof(argv[i]);
+        } else if (arg == "-n") {
+            if (++i == argc || std::atoi(argv[i]) <= 0) {
+                std::cout << "Need a positive number after -n\n";
+                return 1;
+            }
+            grouping.by = r2r::Grouping::COUNT;
+            grouping.count = std::atoi(argv[i]);
+        } else if (arg == "-e") {
+            grouping.by = r2r::Grouping::EXPOSURE;
+        } else if (arg == "-q") {
+            score = true;
+        } else if (arg == "-b") {
+            if (++i == argc || std::atoi(argv[i]) <= 0) {
+                std::cout << "Need a positive number after -b\n";
+                return 1;
+            }
+            score = true;
+            quality.keep_best = std::atoi(argv[i]);
+        } else if (arg == "-m") {
+            if (++i == argc || std::atoi(argv[i]) <= 0) {
+                std::cout << "Need a positive number of bins after -m\n";
+                return 1;
+            }
+            accumulated.histogram_bins = std::atoi(argv[i]);
+        } else if (arg == "-v") {
+            if (++i == argc || std::atoi(argv[i]) <= 0) {
+                std::cout << "Need a positive level after -v\n";
+                return 1;
+            }
+            preview = std::atoi(argv[i]);
+        } else if (arg == "-x") {
+            if (++i == argc || std::atof(argv[i]) <= 0) {
+                std::cout << "Need a positive scale after -x\n";
+                return 1;
+            }
+            drizzle.scale = std::atof(argv[i]);
+        } else if (arg == "-p") {
+            if (++i == argc) {
+                std::cout << "Need a number after -p\n";
+                return 1;
+            }
+            parameter = argv[i];
+        } else if (arg == "-L") {
+            drizzle.linear = true;
+        } else if (arg == "-P") {
+            packed = true;
+        } else {
+            files.emplace_back(arg);
         }
     }
-    if (output_path == "output") {
-        output_path += files[0].extension();
-    }
     
     if (files.empty()) {
         std::cout << "No file is specified\n";
         return 1;
     }
+    if (output_path == "output" && batched) {
+        output_path = "output/{first}_{algorithm}{ext}";
+    } else if (output_path == "output" && !windowed) {
+        const bool dng = algorithm == "hdr" || algorithm == "drizzle" || preview;
+        output_path += dng ? std::filesystem::path(".dng") : files[0].extension();
+    }
     if (files.size() == 1) {
         files = {std::filesystem::directory_iterator(files[0]), std::filesystem::directory_iterator()};
     }
@@ -67,10 +304,193 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    std::cout << "Reading " << files.size() << " files...\n";
     r2r::Timer timer;
-    r2r::Task task(files);
-    std::cout << "...finished in " << std::setprecision(5) << timer.stop() << "ms\n\n";
+    if (algorithm == "master") {
+        std::unordered_map<std::string, r2r::MasterKind> kinds = {
+            {"bias", r2r::MasterKind::BIAS},
+            {"dark", r2r::MasterKind::DARK},
+            {"flat", r2r::MasterKind::FLAT},
+        };
+        if (kinds.find(master_kind) == kinds.end()) {
+            std::cout << master_kind << " is not a master kind. Use bias, dark or flat.\n";
+            return 1;
+        }
+        std::cout << "Building a master " << master_kind << " from " << files.size() << " files...\n";
+        r2r::MasterLibrary library(output_path);
+        auto e = library.add(r2r::build_master(files, kinds[master_kind]));
+        if (e != r2r::ParserErrors::PARSE_SUCCESS) {
+            std::cout << "Failed to write the master due to " << (int)e << ".\n";
+            return 1;
+        }
+        std::cout << "...finished in " << std::setprecision(5) << timer.stop() << "ms. The library at "
+                  << output_path << " now has " << library.size() << " masters.\n";
+        return 0;
+    }
+
+    r2r::TaskOptions options;
+    options.align = align;
+    options.interpolation = interpolation;
+    r2r::Calibration calibration;
+    if (!library_path.empty()) {
+        r2r::RawInfo info;
+        if (r2r::get_info(files[0].string().c_str(), info) != r2r::ParserErrors::PARSE_SUCCESS) {
+            std::cout << "Cannot read " << files[0] << "\n";
+            return 1;
+        }
+        r2r::MasterLibrary library(library_path);
+        calibration = r2r::make_calibration(info, library);
+        std::cout << "Calibrating with" << (calibration.offset.empty() ? " no dark or bias" : " a dark or bias")
+                  << (calibration.gain.empty() ? " and no flat" : " and a flat") << ".\n";
+        options.calibration = &calibration;
+    }
+    options.preview_levels = preview;
+    if (score) {
+        quality.stars = align == r2r::Alignment::SIMILARITY || align == r2r::Alignment::AFFINE;
+        options.quality = &quality;
+    }
+    r2r::DefectMap defects;
+    r2r::DefectDetector detector;
+    std::filesystem::path defects_path;
+    if (!defects_dir.empty()) {
+        r2r::RawInfo info;
+        if (r2r::get_info(files[0].string().c_str(), info) != r2r::ParserErrors::PARSE_SUCCESS) {
+            std::cout << "Cannot read " << files[0] << "\n";
+            return 1;
+        }
+        defects_path = r2r::defect_cache_path(defects_dir, info);
+        if (!defects_path.empty() && r2r::load_defects(defects_path, defects) == r2r::ParserErrors::PARSE_SUCCESS) {
+            std::cout << "Correcting the " << defects.pixels.size() << " defective pixels of the camera.\n";
+            options.defects = &defects;
+        } else {
+            if (defects_path.empty()) {
+                std::cout << "The camera does not report its serial number, so its defects cannot be cached.\n";
+            }
+            options.detector = &detector;
+        }
+    }
+
+    if (algorithm == "analyze") {
+        std::cout << "Analyzing " << files.size() << " files...\n";
+        timer.start();
+        r2r::Task task(files, options);
+        auto stats = r2r::analyze(task);
+        std::cout << "...finished in " << std::setprecision(5) << timer.stop() << "ms\n\n";
+        const char *names = "RGBG";
+        std::cout << std::setprecision(4);
+        for (int p = 0; p < 4; p++) {
+            const auto &ch = stats.channels[p];
+            std::cout << names[task.infos[0].cfa[p]] << " (" << (p >> 1) << ", " << (p & 1) << "): mean " << ch.mean
+                      << " DN, temporal noise " << ch.temporal_sigma << " DN, spatial noise " << ch.spatial_sigma
+                      << " DN, masked black " << ch.black << " DN, clipped " << 100 * ch.clipped << "%\n";
+        }
+        std::cout << "Photon transfer curve of " << stats.ptc.size() << " points: " << stats.conversion_gain
+                  << " DN/e-, read noise " << stats.read_noise << " DN\n";
+        return 0;
+    }
+
+    if (algorithm == "hdr") {
+        std::cout << "Merging " << files.size() << " brackets...\n";
+        timer.start();
+        r2r::HdrParams params;
+        params.options = options;
+        auto hdr = r2r::hdr_merge(files, params);
+        std::cout << "...finished in " << std::setprecision(5) << timer.stop() << "ms\n\n";
+        auto e = r2r::write_hdr(output_path, hdr);
+        if (e != r2r::ParserErrors::PARSE_SUCCESS) {
+            std::cout << "Failed to write the output due to " << (int)e << ".\n";
+            return 1;
+        }
+        std::cout << "Output written to " << output_path << "\n";
+        return 0;
+    }
+
+    if (algorithm == "merge") {
+        std::cout << "Merging " << files.size() << " frames...\n";
+        timer.start();
+        r2r::FourierMergeParams params;
+        params.options = options;
+        r2r::Buffer<r2r::io_t> ans;
+        try {
+            ans = r2r::fourier_merge(files, params);
+        } catch (const std::invalid_argument &e) {
+            std::cout << e.what() << "\n";
+            return 1;
+        }
+        std::cout << "...finished in " << std::setprecision(5) << timer.stop() << "ms\n\n";
+        size_t width, height;
+        r2r::u32 max_val;
+        r2r::get_dimensions(files[0].string().c_str(), width, height, max_val);
+        auto e = r2r::write_image(files[0], output_path, ans.get(), nullptr, width, height);
+        if (e != r2r::ParserErrors::PARSE_SUCCESS) {
+            std::cout << "Failed to write the output due to " << (int)e << ".\n";
+            return 1;
+        }
+        std::cout << "Output written to " << output_path << "\n";
+        return 0;
+    }
+
+    if (algorithm == "drizzle") {
+        if (align == r2r::Alignment::NONE) {
+            align = r2r::Alignment::GLOBAL;
+        }
+        // the frames are registered here, but never resampled
+        options.align = r2r::Alignment::NONE;
+        std::cout << "Reading " << files.size() << " files...\n";
+        timer.start();
+        r2r::Task task(files, options);
+        std::cout << "...finished in " << std::setprecision(5) << timer.stop() << "ms\n\n";
+        timer.start();
+        r2r::DrizzleResult result;
+        try {
+            std::vector<size_t> unmatched;
+            const auto transforms = r2r::estimate_transforms(task, align, &unmatched);
+            result = r2r::drizzle(task, transforms, drizzle, unmatched);
+        } catch (const std::invalid_argument &e) {
+            std::cout << e.what() << "\n";
+            return 1;
+        }
+        std::cout << "Drizzling to " << result.width << "x" << result.height << " took " << std::setprecision(5)
+                  << timer.stop() << "ms, " << result.holes << " samples were filled from the first frame\n";
+        if (result.dropped) {
+            std::cout << result.dropped << " frames were left out, since their stars do not match the first frame\n";
+        }
+        std::cout << "\n";
+        auto e = r2r::write_drizzle(output_path, result);
+        if (e != r2r::ParserErrors::PARSE_SUCCESS) {
+            std::cout << "Failed to write the output due to " << (int)e << ".\n";
+            return 1;
+        }
+        std::cout << "Output written to " << output_path << "\n";
+        return 0;
+    }
+
+    if (algorithm == "focus" || algorithm == "focus_blend") {
+        std::cout << "Focus stacking " << files.size() << " frames...\n";
+        timer.start();
+        r2r::FocusParams params;
+        params.blend = algorithm == "focus_blend";
+        params.options = options;
+        r2r::FocusResult result;
+        try {
+            result = r2r::focus_stack(files, params);
+        } catch (const std::invalid_argument &e) {
+            std::cout << e.what() << "\n";
+            return 1;
+        }
+        std::cout << "...finished in " << std::setprecision(5) << timer.stop() << "ms\n\n";
+        auto index_path = output_path;
+        index_path.replace_filename(output_path.stem().string() + "_index.pgm");
+        auto e = r2r::write_image(files[0], output_path, result.data.data(), nullptr, result.width, result.height);
+        if (e == r2r::ParserErrors::PARSE_SUCCESS) {
+            e = r2r::write_index_map(index_path, result);
+        }
+        if (e != r2r::ParserErrors::PARSE_SUCCESS) {
+            std::cout << "Failed to write the output due to " << (int)e << ".\n";
+            return 1;
+        }
+        std::cout << "Output written to " << output_path << " and the index map to " << index_path << "\n";
+        return 0;
+    }
 
     std::unordered_map<std::string, r2r::pReduction> reduction_algos = {
         {"mean",        r2r::pReduction::MEAN},
@@ -84,43 +504,336 @@ int main(int argc, char *argv[])
         {"minimum",     r2r::pReduction::MINIMUM},
         {"min",         r2r::pReduction::MINIMUM},
         {"range",       r2r::pReduction::RANGE},
+        {"weighted_mean", r2r::pReduction::WEIGHTED_MEAN},
+        {"wmean",       r2r::pReduction::WEIGHTED_MEAN},
+        {"hybrid",      r2r::pReduction::HYBRID},
+        {"percentile",  r2r::pReduction::PERCENTILE},
+        {"trimmed_mean", r2r::pReduction::TRIMMED_MEAN},
+        {"iqm",         r2r::pReduction::TRIMMED_MEAN},
+        {"mode",        r2r::pReduction::MODE},
+        {"clipped_mean", r2r::pReduction::CLIPPED_MEAN},
     };
 
-    if (reduction_algos.find(algorithm) != reduction_algos.end()) {
-        // reduction algo will have the same output
+    if (reduction_algos.find(algorithm) == reduction_algos.end()) {
+        std::cout << algorithm << " is not supported. Only the following [ ";
+        for (auto &&[algo,_] : reduction_algos) {
+            std::cout << algo << " ";
+        }
+        std::cout << "] algorithms are currently supported. If you would like to suggest another algorithm, feel"
+        << " free to raise the suggestion as an issue on https://github.com/jonah-chen/raw2raw.\n";
+        return 1;
+    }
+    // reduction algo will have the same output
+    const r2r::pReduction reduction = reduction_algos[algorithm];
+    r2r::ReductionParams reduction_params;
+    if (parameter) {
+        const float p = std::atof(parameter);
+        if (reduction == r2r::pReduction::PERCENTILE) {
+            reduction_params.percentile = p;
+        } else if (reduction == r2r::pReduction::TRIMMED_MEAN) {
+            reduction_params.trim = p;
+        } else if (reduction == r2r::pReduction::MODE) {
+            reduction_params.mode_bin = (r2r::u32)std::max(p, 1.f);
+        } else if (reduction == r2r::pReduction::CLIPPED_MEAN) {
+            reduction_params.kappa = p;
+        }
+    }
 
+    if (batched) {
+        if (!state_path.empty() || !index_path.empty() || preview) {
+            std::cout << "-s, -i and -v cannot be used with batch\n";
+            return 1;
+        }
+        if (options.detector) {
+            std::cout << "The defects of the camera are not cached yet, so they are not corrected. Stack once without"
+                      << " batch to find them.\n";
+            options.detector = nullptr;
+        }
+        r2r::HeaderCache headers;
+        if (!headers_path.empty()) {
+            headers.load(headers_path);
+        }
+        std::cout << "Grouping " << files.size() << " files...\n";
         timer.start();
-        r2r::io_t *ans = r2r::p_reduce(task, reduction_algos[algorithm]);
+        std::vector<r2r::RawInfo> infos;
+        try {
+            infos = headers.get(files);
+        } catch (r2r::ParserErrors) {
+            std::cout << "Cannot read the metadata of the files\n";
+            return 1;
+        }
+        if (!headers_path.empty() && headers.save(headers_path) != r2r::ParserErrors::PARSE_SUCCESS) {
+            std::cout << "Cannot write the header cache to " << headers_path << "\n";
+        }
+        const auto groups = r2r::group_files(files, infos, grouping);
+        std::vector<r2r::BatchJob> jobs(groups.size());
+        for (size_t k = 0; k < groups.size(); k++) {
+            jobs[k].files = groups[k];
+            jobs[k].reduction = reduction;
+            jobs[k].params = reduction_params;
+            jobs[k].output = output_name(output_path.string(), groups[k], k, algorithm);
+        }
+        // every stack would overwrite the output of the one before, e.g. with a template without {index}
+        std::unordered_set<std::string> names;
+        for (const auto &job : jobs) {
+            if (!names.insert(job.output.lexically_normal().string()).second) {
+                std::cout << "The template " << output_path << " gives " << job.output << " to more than one stack."
+                          << " Use {index}, {first} or {last} in it.\n";
+                return 1;
+            }
+        }
+        for (const auto &job : jobs) {
+            if (job.output.has_parent_path()) {
+                std::filesystem::create_directories(job.output.parent_path());
+            }
+        }
+        std::cout << "...found " << jobs.size() << " stacks in " << std::setprecision(5) << timer.stop() << "ms\n\n";
 
-        std::cout << "Computing the " << algorithm << " took " <<
-            std::setprecision(5) << timer.stop() << "ms\n\n" << 
-            "------------------------------------------\n\nA small preview of the output:\n";
-        
-        // print a 10x10 square of the reduced image
-        for (size_t i = 0; i < 10; i++) {
-            for (size_t j = 0; j < 10; j++) {
-                std::cout << std::setw(5) << ans[i * task.width + j] << " ";
+        std::cout << "Computing the " << algorithm << " of every stack...\n";
+        timer.start();
+        r2r::BatchParams batch;
+        batch.options = options;
+        batch.on_done = [&](size_t k, r2r::ParserErrors e) {
+            if (e != r2r::ParserErrors::PARSE_SUCCESS) {
+                std::cout << "Failed to write " << jobs[k].output << " due to " << (int)e << ".\n";
             }
-            std::cout << "\n";
+        };
+        const auto status = r2r::run_batch(jobs, batch);
+        const size_t written = std::count(status.begin(), status.end(), r2r::ParserErrors::PARSE_SUCCESS);
+        std::cout << "...finished in " << std::setprecision(5) << timer.stop() << "ms. " << written << " of "
+                  << jobs.size() << " outputs written\n";
+        return written == jobs.size() ? 0 : 1;
+    }
+
+    if (windowed) {
+        if (sliding.window == 0) {
+            std::cout << "Need the size of the window with -w\n";
+            return 1;
         }
-        std::cout << "------------------------------------------\n\n";
+        size_t width, height;
+        r2r::u32 max_val;
+        if (r2r::get_dimensions(files[0].string().c_str(), width, height, max_val) != r2r::ParserErrors::PARSE_SUCCESS) {
+            std::cout << "Cannot read " << files[0] << "\n";
+            return 1;
+        }
+        sliding.reduction = reduction;
+        sliding.options = options;
+        std::filesystem::create_directories(output_path);
+        std::cout << "Computing the " << algorithm << " over windows of " << sliding.window << " of " << files.size()
+                  << " files...\n";
+        timer.start();
+        size_t written = 0;
+        try {
+            r2r::sliding_reduce(files, sliding, [&](size_t first, const r2r::io_t *ans) {
+                auto out = output_path / (files[first].stem().string() + "_" + algorithm +
+                                          files[first].extension().string());
+                auto e = r2r::write_image(files[first], out, ans, nullptr, width, height);
+                written += e == r2r::ParserErrors::PARSE_SUCCESS;
+            });
+        } catch (const std::invalid_argument &e) {
+            std::cout << e.what() << "\n";
+            return 1;
+        }
+        std::cout << "...finished in " << std::setprecision(5) << timer.stop() << "ms. " << written
+                  << " outputs written to " << output_path << "\n";
+        return 0;
+    }
 
-        auto e = r2r::write_image(files[0], output_path, ans, task.data, task.width, task.height);
-        if (e == r2r::ParserErrors::PARSE_SUCCESS) {
-            std::cout <<  "Output written to " << output_path << "\n";
-        } else {
-            std::cout << "Failed to write the output due to " << (int)e << ".\n";
-            delete[] ans;
+    if (options.detector && (align == r2r::Alignment::SIMILARITY || align == r2r::Alignment::AFFINE)) {
+        std::cout << "The defects of the camera are not cached yet, and they cannot be found in frames that are warped"
+                  << " with -r or -A. Run once with -d but without -r or -A to cache them.\n";
+        return 1;
+    }
+
+    if (align != r2r::Alignment::NONE && !state_path.empty()) {
+        std::cout << "-a, -t, -r and -A cannot be used with -s, since an accumulated state is never aligned\n";
+        return 1;
+    }
+
+    if (!state_path.empty() && reduction == r2r::pReduction::MEDIAN && !accumulated.histogram_bins) {
+        std::cout << "The median of an accumulated state needs the number of bins of its histograms with -m\n";
+        return 1;
+    }
+
+    if (preview && (!index_path.empty() || !state_path.empty())) {
+        std::cout << "-v cannot be used with -i or -s\n";
+        return 1;
+    }
+
+    if (packed && (!index_path.empty() || !state_path.empty() || preview || score || options.detector ||
+                   align != r2r::Alignment::NONE)) {
+        std::cout << "-P can only be used with -c and the defects of a camera that are already cached\n";
+        return 1;
+    }
+
+    if (packed && !r2r::PackedStack::supported(reduction)) {
+        std::cout << algorithm << " cannot be computed from packed frames\n";
+        return 1;
+    }
+
+    if (!index_path.empty() && !r2r::RankStatistic::supported(reduction)) {
+        std::cout << algorithm << " is not rank based, so it cannot be computed from an index\n";
+        return 1;
+    }
+
+    r2r::Buffer<r2r::io_t> ans;
+    size_t width, height;
+    const r2r::io_t *reference = nullptr;
+    std::unique_ptr<r2r::Task> task;
+    if (!index_path.empty()) {
+        r2r::SortedStack index;
+        // an index read with other -c, -d, -a, -t, -r, -A, -l, -q or -b options has other samples
+        const r2r::u64 fingerprint = r2r::ingest_fingerprint(options);
+        if (index.load(index_path) != r2r::ParserErrors::PARSE_SUCCESS || index.sources != files ||
+            index.fingerprint != fingerprint) {
+            std::cout << "Indexing " << files.size() << " files...\n";
+            timer.start();
+            index = r2r::SortedStack(r2r::Task(files, options));
+            index.sources = files;
+            index.fingerprint = fingerprint;
+            if (index.save(index_path) != r2r::ParserErrors::PARSE_SUCCESS) {
+                std::cout << "Cannot write the index to " << index_path << "\n";
+            }
+            std::cout << "...finished in " << std::setprecision(5) << timer.stop() << "ms\n\n";
+        }
+        timer.start();
+        ans = index.reduce(reduction, reduction_params);
+        width = index.width;
+        height = index.height;
+        std::cout << "Computing the " << algorithm << " from the index took " << std::setprecision(5) << timer.stop()
+                  << "ms\n\n";
+    } else if (!state_path.empty()) {
+        r2r::Accumulator acc(accumulated);
+        if (std::filesystem::exists(state_path) && acc.load(state_path) != r2r::ParserErrors::PARSE_SUCCESS) {
+            std::cout << "Cannot read the state in " << state_path << "\n";
+            return 1;
+        }
+        std::cout << "Updating the state of " << acc.sources.size() << " files to " << files.size() << " files...\n";
+        timer.start();
+        try {
+            try {
+                acc.sync(files, options);
+            } catch (r2r::ParserErrors e) {
+                // a removed file that was deleted cannot be subtracted anymore, so start over from the files
+                std::cout << "Cannot update the state due to " << (int)e << ", so it is made again from the files\n";
+                acc = r2r::Accumulator(accumulated);
+                acc.sync(files, options);
+            }
+        } catch (r2r::ParserErrors e) {
+            std::cout << "Cannot read the files due to " << (int)e << "\n";
+            return 1;
+        } catch (const std::invalid_argument &e) {
+            std::cout << "Cannot update the state in " << state_path << ": " << e.what() << ". Delete it to make it"
+                      << " again.\n";
             return 1;
         }
-        delete[] ans;
+        ans = acc.finalize(reduction);
+        if (!ans) {
+            std::cout << algorithm << " cannot be computed from the state in " << state_path << ", which was made"
+                      << " without the statistics it needs (the median needs -m). Delete it to make it again.\n";
+            return 1;
+        }
+        if (acc.save(state_path) != r2r::ParserErrors::PARSE_SUCCESS) {
+            std::cout << "Cannot write the state to " << state_path << ", so the next run reads every file again\n";
+        }
+        width = acc.width;
+        height = acc.height;
+        std::cout << "...finished in " << std::setprecision(5) << timer.stop() << "ms\n\n";
+    } else if (packed) {
+        std::cout << "Reading " << files.size() << " files...\n";
+        timer.start();
+        r2r::PackedStack stack(files, options);
+        std::cout << "...finished in " << std::setprecision(5) << timer.stop() << "ms. The frames are packed in "
+                  << stack.bits << " bits, " << (stack.bytes() >> 20) << " MiB\n\n";
+        timer.start();
+        ans = stack.reduce(reduction);
+        width = stack.width;
+        height = stack.height;
+        std::cout << "Computing the " << algorithm << " took " << std::setprecision(5) << timer.stop() << "ms\n\n";
     } else {
-        std::cout << algorithm << " is not supported. Only the following [ ";
-        for (auto &&[algo,_] : reduction_algos) {
-            std::cout << algo << " ";
+        std::cout << "Reading " << files.size() << " files...\n";
+        timer.start();
+        task = std::make_unique<r2r::Task>(files, options);
+        std::cout << "...finished in " << std::setprecision(5) << timer.stop() << "ms\n\n";
+        for (size_t j = 0; j < task->quality.size(); j++) {
+            const auto &q = task->quality[j];
+            if (!q.rejected) continue;
+            std::cout << "Dropped " << files[j] << " (sharpness " << std::setprecision(3) << q.sharpness
+                      << ", brightness " << q.brightness << ", correlation " << q.correlation;
+            if (quality.stars) {
+                std::cout << ", " << q.stars << " stars of FWHM " << q.fwhm;
+            }
+            std::cout << ")\n";
         }
-        std::cout << "] algorithms are currently supported. If you would like to suggest another algorithm, feel"
-        << " free to raise the suggestion as an issue on https://github.com/jonah-chen/raw2raw.\n";
+        for (size_t j : task->unaligned) {
+            std::cout << "Dropped " << files[j] << " (its stars do not match the first frame)\n";
+        }
+        if (task->n_images < files.size()) {
+            std::cout << "Stacking " << task->n_images << " of " << files.size() << " frames\n\n";
+        }
+
+        if (preview > task->pyramid.size()) {
+            std::cout << "The frames cannot be binned " << preview << " times\n";
+            return 1;
+        }
+        const r2r::Task &reduced = task->preview(preview);
+
+        timer.start();
+        if (reduction == r2r::pReduction::HYBRID) {
+            r2r::HybridStats stats;
+            ans = r2r::to_interleaved(reduced, r2r::p_hybrid(reduced, {}, &stats));
+            std::cout << "The median was taken in " << stats.moving_tiles << " of "
+                      << stats.moving_tiles + stats.static_tiles << " tiles (" << std::setprecision(3)
+                      << 100 * stats.moving_fraction() << "%), and the mean in the others\n";
+        } else {
+            ans = r2r::p_reduce(*task, reduction, reduction_params, preview);
+        }
+        width = reduced.width;
+        height = reduced.height;
+        reference = reduced.reference;
+        std::cout << "Computing the " << algorithm << " took " <<
+            std::setprecision(5) << timer.stop() << "ms\n\n";
+    }
+
+    if (options.detector) {
+        defects = detector.finish();
+        std::cout << "Found " << defects.pixels.size() << " defective pixels in " << defects.n_frames << " frames.\n";
+        if (!defects_path.empty() && defects.n_frames >= r2r::DefectParams{}.min_frames) {
+            std::filesystem::create_directories(defects_dir);
+            if (r2r::save_defects(defects, defects_path) != r2r::ParserErrors::PARSE_SUCCESS) {
+                std::cout << "Cannot write the defects to " << defects_path << "\n";
+            }
+        }
+    }
+
+    std::cout << "------------------------------------------\n\nA small preview of the output:\n";
+    // print a 10x10 square of the reduced image
+    for (size_t i = 0; i < 10; i++) {
+        for (size_t j = 0; j < 10; j++) {
+            std::cout << std::setw(5) << ans[i * width + j] << " ";
+        }
+        std::cout << "\n";
+    }
+    std::cout << "------------------------------------------\n\n";
+
+    r2r::ParserErrors e;
+    if (preview) {
+        // the binned frames do not fit in the container of the raw files
+        const r2r::RawInfo &info = task->preview(preview).infos[0];
+        r2r::DngImage image;
+        image.width = width;
+        image.height = height;
+        image.u16 = ans.get();
+        std::copy(info.black, info.black + 4, image.black);
+        image.white = info.max_val;
+        e = r2r::write_dng(output_path, info, image);
+    } else {
+        e = r2r::write_image(files[0], output_path, ans.get(), reference, width, height);
+    }
+    if (e == r2r::ParserErrors::PARSE_SUCCESS) {
+        std::cout <<  "Output written to " << output_path << "\n";
+    } else {
+        std::cout << "Failed to write the output due to " << (int)e << ".\n";
         return 1;
     }
 